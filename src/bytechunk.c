@@ -2,6 +2,7 @@
 
 #include "bytechunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void initByteChunk(ByteChunk *byteChunk) {
@@ -10,6 +11,9 @@ void initByteChunk(ByteChunk *byteChunk) {
   byteChunk->code = NULL;
   byteChunk->lines = NULL;
   initValueArray(&byteChunk->constants);
+  byteChunk->cacheCount = 0;
+  byteChunk->cacheCapacity = 0;
+  byteChunk->caches = NULL;
 }
 
 void writeByteChunk(ByteChunk *byteChunk, uint8_t byte, int line) {
@@ -34,9 +38,188 @@ int addConstant(ByteChunk *byteChunk, Value value) {
   return byteChunk->constants.count - 1;
 }
 
+int addInlineCache(ByteChunk *byteChunk) {
+  if (byteChunk->cacheCapacity < byteChunk->cacheCount + 1) {
+    int oldCapacity = byteChunk->cacheCapacity;
+    byteChunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    byteChunk->caches = GROW_ARRAY(InlineCache, byteChunk->caches, oldCapacity,
+                                   byteChunk->cacheCapacity);
+  }
+
+  initInlineCache(&byteChunk->caches[byteChunk->cacheCount]);
+  return byteChunk->cacheCount++;
+}
+
 void freeByteChunk(ByteChunk *byteChunk) {
   FREE_ARRAY(uint8_t, byteChunk->code, byteChunk->capacity);
   FREE_ARRAY(int, byteChunk->lines, byteChunk->capacity);
   freeValueArray(&byteChunk->constants);
+  FREE_ARRAY(InlineCache, byteChunk->caches, byteChunk->cacheCapacity);
   initByteChunk(byteChunk);
 }
+
+int instructionLength(ByteChunk *byteChunk, int offset) {
+  switch (byteChunk->code[offset]) {
+    case OP_NAH:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INHERIT:
+    case OP_GET_INDEX:
+    case OP_SET_INDEX:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_LESS_NUM:
+      return 1;
+    case OP_R_LOAD_NAH:
+    case OP_R_LOAD_TRUE:
+    case OP_R_LOAD_FALSE:
+    case OP_R_PRINT:
+    case OP_R_CLOSE_UPVALUE:
+    case OP_R_RETURN:
+      return 2;
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_SET_LOCAL_POP:
+    case OP_CALL_CLOSURE:
+    case OP_CALL_NATIVE:
+    case OP_LIST:
+    case OP_MAP:
+      return 2;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_SUPER_INVOKE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_ADD_LOCAL_LOCAL:
+    case OP_R_MOVE:
+    case OP_R_LOAD_CONSTANT:
+    case OP_R_GET_UPVALUE:
+    case OP_R_SET_UPVALUE:
+    case OP_R_NOT:
+    case OP_R_NEGATE:
+    case OP_R_JUMP:
+    case OP_R_LOOP:
+    case OP_R_CALL:
+    case OP_R_TAIL_CALL:
+    case OP_R_CLASS:
+    case OP_R_INHERIT:
+    case OP_R_LIST:
+    case OP_R_MAP:
+      return 3;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_R_GET_GLOBAL:
+    case OP_R_SET_GLOBAL:
+    case OP_R_DEFINE_GLOBAL:
+    case OP_R_EQUAL:
+    case OP_R_GREATER:
+    case OP_R_LESS:
+    case OP_R_ADD:
+    case OP_R_SUBTRACT:
+    case OP_R_MULTIPLY:
+    case OP_R_DIVIDE:
+    case OP_R_JUMP_IF_FALSE:
+    case OP_R_METHOD:
+    case OP_R_GET_INDEX:
+    case OP_R_SET_INDEX:
+      return 4;
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_R_GET_SUPER:
+    case OP_R_JUMP_IF_NOT_LESS:
+    case OP_R_JUMP_IF_NOT_GREATER:
+    case OP_R_JUMP_IF_LESS:
+    case OP_R_JUMP_IF_GREATER:
+    case OP_R_SUPER_INVOKE:
+      return 5;
+    case OP_R_GET_PROPERTY:
+    case OP_R_SET_PROPERTY:
+    case OP_R_INVOKE:
+    case OP_R_TAIL_INVOKE:
+      return 6;
+    case OP_CLOSURE: {
+      uint8_t constant = byteChunk->code[offset + 1];
+      ObjectFunction *function =
+          AS_FUNCTION(byteChunk->constants.values[constant]);
+      // Each upvalue is encoded as an (isLocal, index) pair
+      return 2 + function->upvalueCount * 2;
+    }
+    case OP_R_CLOSURE: {
+      uint8_t constant = byteChunk->code[offset + 2];
+      ObjectFunction *function =
+          AS_FUNCTION(byteChunk->constants.values[constant]);
+      return 3 + function->upvalueCount * 2;
+    }
+  }
+  return 1;
+}
+
+bool isJump(uint8_t instruction) {
+  switch (instruction) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_GREATER:
+      return true;
+    default:
+      return false;
+  }
+}
+
+int jumpTarget(ByteChunk *byteChunk, int offset) {
+  uint16_t jump = (uint16_t)(byteChunk->code[offset + 1] << 8) |
+                  byteChunk->code[offset + 2];
+  if (byteChunk->code[offset] == OP_LOOP)
+    return offset + 3 - jump;
+  return offset + 3 + jump;
+}
+
+bool hasInlineCache(uint8_t instruction) {
+  switch (instruction) {
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_R_GET_PROPERTY:
+    case OP_R_SET_PROPERTY:
+    case OP_R_INVOKE:
+    case OP_R_TAIL_INVOKE:
+      return true;
+    default:
+      return false;
+  }
+}
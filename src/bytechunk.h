@@ -2,6 +2,7 @@
 #define MEKVM_BYTECHUNK_H
 
 #include "common.h"
+#include "inlinecache.h"
 #include "value.h"
 
 typedef enum {
@@ -36,12 +37,86 @@ typedef enum {
   OP_CALL,
   OP_INVOKE,
   OP_SUPER_INVOKE,
+  // Calls in tail position reuse the caller's frame when they can. The
+  // OP_RETURN after them returns the result of any other call.
+  OP_TAIL_CALL,
+  OP_TAIL_INVOKE,
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
   OP_CLASS,
   OP_INHERIT,
   OP_METHOD,
+  OP_GET_INDEX, // Stack: array, index -> element
+  OP_SET_INDEX, // Stack: array, index, value -> value
+  OP_LIST,      // Stack: N elements -> list
+  OP_MAP,       // Stack: N key, value pairs -> map
+  // Superinstructions produced by fuseSuperinstructions()
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_LESS,
+  OP_JUMP_IF_GREATER,
+  OP_ADD_LOCAL_CONSTANT,
+  OP_SUBTRACT_LOCAL_CONSTANT,
+  OP_ADD_LOCAL_LOCAL,
+  OP_GET_LOCAL_PROPERTY,
+  OP_SET_LOCAL_POP,
+  // Quickened forms the stack interpreter rewrites generic instructions into
+  // once it has seen their operands. Each guards its assumption and turns
+  // back into the generic instruction when the guard fails.
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_LESS_NUM,
+  OP_CALL_CLOSURE,
+  OP_CALL_NATIVE,
+  // Register backend, produced by translateToRegisters(). Operands name
+  // frame slots; operands marked RK may name a constant instead (see
+  // registers.h). G is a 16-bit global slot. Jump offsets always come last.
+  OP_R_MOVE,             // A B       R[A] = R[B]
+  OP_R_LOAD_CONSTANT,    // A K       R[A] = K
+  OP_R_LOAD_NAH,         // A         R[A] = nah
+  OP_R_LOAD_TRUE,        // A         R[A] = true
+  OP_R_LOAD_FALSE,       // A         R[A] = false
+  OP_R_GET_GLOBAL,       // A G       R[A] = globals[G]
+  OP_R_SET_GLOBAL,       // G RK      globals[G] = RK
+  OP_R_DEFINE_GLOBAL,    // G RK      define globals[G] = RK
+  OP_R_GET_UPVALUE,      // A U       R[A] = upvalues[U]
+  OP_R_SET_UPVALUE,      // U RK      upvalues[U] = RK
+  OP_R_GET_PROPERTY,     // A B K C   R[A] = R[B].K, C is the cache
+  OP_R_SET_PROPERTY,     // A K RK C  R[A].K = RK
+  OP_R_GET_SUPER,        // A B C K   R[A] = R[C].K bound to R[B]
+  OP_R_EQUAL,            // A RK RK
+  OP_R_GREATER,          // A RK RK
+  OP_R_LESS,             // A RK RK
+  OP_R_ADD,              // A RK RK
+  OP_R_SUBTRACT,         // A RK RK
+  OP_R_MULTIPLY,         // A RK RK
+  OP_R_DIVIDE,           // A RK RK
+  OP_R_NOT,              // A B
+  OP_R_NEGATE,           // A B
+  OP_R_PRINT,            // RK
+  OP_R_JUMP,             // offset
+  OP_R_JUMP_IF_FALSE,    // A offset
+  OP_R_LOOP,             // offset
+  OP_R_JUMP_IF_NOT_LESS, // RK RK offset
+  OP_R_JUMP_IF_NOT_GREATER,
+  OP_R_JUMP_IF_LESS,
+  OP_R_JUMP_IF_GREATER,
+  OP_R_CALL,             // A N       R[A] = R[A](R[A+1] .. R[A+N])
+  OP_R_INVOKE,           // A K N C   R[A] = R[A].K(R[A+1] .. R[A+N])
+  OP_R_SUPER_INVOKE,     // A K N C   R[A] = R[C].K bound to R[A](...)
+  OP_R_TAIL_CALL,        // A N       OP_R_CALL reusing the frame
+  OP_R_TAIL_INVOKE,      // A K N C   OP_R_INVOKE reusing the frame
+  OP_R_CLOSURE,          // A K (isLocal, index)*
+  OP_R_CLOSE_UPVALUE,    // A         close upvalues from R[A] up
+  OP_R_RETURN,           // RK
+  OP_R_CLASS,            // A K       R[A] = class K
+  OP_R_INHERIT,          // A B       copy methods of R[A] into R[B]
+  OP_R_METHOD,           // A K B     R[A].methods[K] = R[B]
+  OP_R_GET_INDEX,        // A B RK    R[A] = R[B][RK]
+  OP_R_SET_INDEX,        // A RK RK   R[A][RK] = RK
+  OP_R_LIST,             // A N       R[A] = [R[A] .. R[A+N-1]]
+  OP_R_MAP,              // A N       R[A] = {R[A]: R[A+1] .. R[A+2N-1]}
 } OpCode;
 
 typedef struct {
@@ -50,11 +125,21 @@ typedef struct {
   uint8_t *code;
   int *lines;
   ValueArray constants;
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache *caches; // Indexed by the cache operand of property accesses
 } ByteChunk;
 
 void initByteChunk(ByteChunk *byteChunk);
 void writeByteChunk(ByteChunk *byteChunk, uint8_t byte, int line);
 int addConstant(ByteChunk *byteChunk, Value value);
+int addInlineCache(ByteChunk *byteChunk);
 void freeByteChunk(ByteChunk *byteChunk);
+int instructionLength(ByteChunk *byteChunk, int offset);
+// Stack bytecode jumps: a 16-bit offset right after the opcode
+bool isJump(uint8_t instruction);
+int jumpTarget(ByteChunk *byteChunk, int offset);
+// Instructions whose last two bytes index byteChunk->caches
+bool hasInlineCache(uint8_t instruction);
 
 #endif /* MEKVM_BYTECHUNK_H */
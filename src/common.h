@@ -10,6 +10,15 @@
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_PROFILE_OPCODES
+// #define DEBUG_PROFILE_CACHES
+// #define DEBUG_LOG_JIT
+
+// Threaded dispatch through a label table needs the GNU labels-as-values
+// extension. Build with `make dispatch=switch` to force the switch loop.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
@@ -8,6 +8,8 @@
 #include "compiler.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
+#include "registers.h"
 #include "scanner.h"
 #include "value.h"
 
@@ -71,6 +73,7 @@ typedef struct Compiler {
   int localCount;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  int lastCall; // Offset of the latest OP_CALL or OP_INVOKE, -1 if none
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -181,6 +184,7 @@ static void emitReturn() {
 
 static uint8_t makeConstant(Value value) {
   int constant = addConstant(currentByteChunk(), value);
+  writeBarrier((Object *)current->function, value);
   if (constant > UINT8_MAX) {
     error("Too many constant in one byte chunk.");
     return 0;
@@ -189,6 +193,24 @@ static uint8_t makeConstant(Value value) {
   return (uint8_t)constant;
 }
 
+static void emitGlobal(uint8_t instruction, uint16_t global) {
+  emitByte(instruction);
+  emitByte((global >> 8) & 0xff);
+  emitByte(global & 0xff);
+}
+
+// Every property access gets its own inline cache
+static void emitInlineCache() {
+  int cache = addInlineCache(currentByteChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+    return;
+  }
+
+  emitByte((cache >> 8) & 0xff);
+  emitByte(cache & 0xff);
+}
+
 static void emitConstant(Value value) {
   emitBytes(OP_CONSTANT, makeConstant(value));
 }
@@ -210,12 +232,15 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->lastCall = -1;
   compiler->function = newFunction();
   current = compiler;
 
   if (type != FUNCTION_TYPE_SCRIPT) {
     current->function->name =
         copyString(parser.previous.start, parser.previous.length);
+    writeBarrier((Object *)current->function,
+                 CREATE_OBJECT_VALUE(current->function->name));
   }
 
   Local *local = &current->locals[current->localCount++];
@@ -233,6 +258,12 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
 static ObjectFunction *endCompiler() {
   emitReturn();
   ObjectFunction *function = current->function;
+  if (!parser.hadError) {
+    // A function the register backend can't translate, e.g. one with more
+    // live values than RK operands can name, stays on stack bytecode
+    if (!vm.registerBackend || !translateToRegisters(function))
+      fuseSuperinstructions(currentByteChunk());
+  }
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleByteChunk(currentByteChunk(), function->name != NULL
@@ -265,6 +296,8 @@ static void statement();
 static void declaration();
 static uint8_t argumentList();
 static uint8_t identifierConstant(Token *name);
+static uint8_t selectorConstant(Token *name);
+static uint16_t globalVariable(Token *name);
 static int resolveLocal(Compiler *compiler, Token *name);
 static int resolveUpvalue(Compiler *compiler, Token *name);
 static ParseRule *getRule(TokenType type);
@@ -319,6 +352,7 @@ static void binary(bool canAssign) {
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
   // Call stack: argument values
+  current->lastCall = currentByteChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
@@ -339,19 +373,71 @@ static void literal(bool canAssign) {
   }
 }
 
+static void list(bool canAssign) {
+  int count = 0;
+  if (!check(TOKEN_RIGHT_BRACKET)) {
+    do {
+      if (check(TOKEN_RIGHT_BRACKET))
+        break; // Trailing comma
+      expression();
+      if (count == UINT8_MAX)
+        error("Can't have more than 255 elements in a list literal.");
+      count++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+  emitBytes(OP_LIST, count);
+}
+
+// A '{' that starts a statement is a block, so map literals only appear
+// inside expressions
+static void map(bool canAssign) {
+  int count = 0;
+  if (!check(TOKEN_RIGHT_BRACE)) {
+    do {
+      if (check(TOKEN_RIGHT_BRACE))
+        break; // Trailing comma
+      expression();
+      consume(TOKEN_COLON, "Expect ':' after map key.");
+      expression();
+      if (count == UINT8_MAX)
+        error("Can't have more than 255 entries in a map literal.");
+      count++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  emitBytes(OP_MAP, count);
+}
+
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+  uint8_t name = selectorConstant(&parser.previous);
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression(); // Value expression comes before the SET
     emitBytes(OP_SET_PROPERTY, name);
+    emitInlineCache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
+    current->lastCall = currentByteChunk()->count;
     emitBytes(OP_INVOKE, name);
     emitByte(argCount);
+    emitInlineCache();
   } else {
     emitBytes(OP_GET_PROPERTY, name);
+    emitInlineCache();
+  }
+}
+
+static void subscript(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_SET_INDEX);
+  } else {
+    emitByte(OP_GET_INDEX);
   }
 }
 
@@ -393,6 +479,7 @@ static void string(bool canAssign) {
 static void namedVariable(Token name, bool canAssign) {
   uint8_t getOp, setOp;
   int arg = resolveLocal(current, &name);
+  bool global = false;
 
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
@@ -401,16 +488,22 @@ static void namedVariable(Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = globalVariable(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
+    global = true;
   }
 
+  uint8_t op = getOp;
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, arg);
+    op = setOp;
+  }
+
+  if (global) {
+    emitGlobal(op, arg);
   } else {
-    emitBytes(getOp, arg);
+    emitBytes(op, arg);
   }
 }
 
@@ -434,7 +527,7 @@ static void super_(bool canAssign) {
 
   consume(TOKEN_DOT, "Expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
+  uint8_t name = selectorConstant(&parser.previous);
 
   namedVariable(syntheticToken("this"), false);
   if (match(TOKEN_LEFT_PAREN)) {
@@ -478,8 +571,11 @@ static void unary(bool canAssign) {
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {map, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
     [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
@@ -545,6 +641,25 @@ static uint8_t identifierConstant(Token *name) {
       CREATE_OBJECT_VALUE(copyString(name->start, name->length)));
 }
 
+// Property and method names may name a method, which is looked up by
+// selector rather than by name at runtime
+static uint8_t selectorConstant(Token *name) {
+  ObjectString *string = copyString(name->start, name->length);
+  methodSelector(string);
+  return makeConstant(CREATE_OBJECT_VALUE(string));
+}
+
+// Globals are looked up by slot rather than by name at runtime
+static uint16_t globalVariable(Token *name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+
+  return (uint16_t)slot;
+}
+
 static bool identifiersEqual(Token *a, Token *b) {
   if (a->length != b->length)
     return false;
@@ -651,14 +766,14 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char *errorMessage) {
+static uint16_t parseVariable(const char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable();
   if (current->scopeDepth > 0)
     return 0;
 
-  return identifierConstant(&parser.previous);
+  return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -667,12 +782,12 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -711,7 +826,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Cannot have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      uint16_t constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -729,7 +844,7 @@ static void function(FunctionType type) {
 
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+  uint8_t constant = selectorConstant(&parser.previous);
   FunctionType type = FUNCTION_TYPE_METHOD;
 
   if (parser.previous.length == 4 &&
@@ -745,9 +860,12 @@ static void classDeclaration() {
   Token className = parser.previous;
   uint8_t nameConstant = identifierConstant(&parser.previous);
   declareVariable();
+  uint16_t global = 0;
+  if (current->scopeDepth == 0)
+    global = globalVariable(&className);
 
   emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  defineVariable(global);
 
   ClassCompiler classCompiler;
   classCompiler.enclosing = currentClass;
@@ -790,14 +908,14 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  uint16_t global = parseVariable("Expect function name.");
   markInitialized();
   function(FUNCTION_TYPE_FUNCTION);
   defineVariable(global);
 }
 
 static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name");
+  uint16_t global = parseVariable("Expect variable name");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -899,6 +1017,15 @@ static void returnStatement() {
     }
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+    // A call the returned expression ends with is in tail position
+    ByteChunk *byteChunk = currentByteChunk();
+    int call = current->lastCall;
+    if (call != -1 &&
+        call + instructionLength(byteChunk, call) == byteChunk->count) {
+      byteChunk->code[call] =
+          byteChunk->code[call] == OP_CALL ? OP_TAIL_CALL : OP_TAIL_INVOKE;
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -1,10 +1,122 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "bytechunk.h"
 #include "debug.h"
 #include "object.h"
+#include "registers.h"
 #include "value.h"
+#include "vm.h"
+
+static const char *opcodeNames[UINT8_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NAH] = "OP_NAH",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_TAIL_INVOKE] = "OP_TAIL_INVOKE",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_GET_INDEX] = "OP_GET_INDEX",
+    [OP_SET_INDEX] = "OP_SET_INDEX",
+    [OP_LIST] = "OP_LIST",
+    [OP_MAP] = "OP_MAP",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_JUMP_IF_LESS] = "OP_JUMP_IF_LESS",
+    [OP_JUMP_IF_GREATER] = "OP_JUMP_IF_GREATER",
+    [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+    [OP_SUBTRACT_LOCAL_CONSTANT] = "OP_SUBTRACT_LOCAL_CONSTANT",
+    [OP_ADD_LOCAL_LOCAL] = "OP_ADD_LOCAL_LOCAL",
+    [OP_GET_LOCAL_PROPERTY] = "OP_GET_LOCAL_PROPERTY",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_CALL_CLOSURE] = "OP_CALL_CLOSURE",
+    [OP_CALL_NATIVE] = "OP_CALL_NATIVE",
+    [OP_R_MOVE] = "OP_R_MOVE",
+    [OP_R_LOAD_CONSTANT] = "OP_R_LOAD_CONSTANT",
+    [OP_R_LOAD_NAH] = "OP_R_LOAD_NAH",
+    [OP_R_LOAD_TRUE] = "OP_R_LOAD_TRUE",
+    [OP_R_LOAD_FALSE] = "OP_R_LOAD_FALSE",
+    [OP_R_GET_GLOBAL] = "OP_R_GET_GLOBAL",
+    [OP_R_SET_GLOBAL] = "OP_R_SET_GLOBAL",
+    [OP_R_DEFINE_GLOBAL] = "OP_R_DEFINE_GLOBAL",
+    [OP_R_GET_UPVALUE] = "OP_R_GET_UPVALUE",
+    [OP_R_SET_UPVALUE] = "OP_R_SET_UPVALUE",
+    [OP_R_GET_PROPERTY] = "OP_R_GET_PROPERTY",
+    [OP_R_SET_PROPERTY] = "OP_R_SET_PROPERTY",
+    [OP_R_GET_SUPER] = "OP_R_GET_SUPER",
+    [OP_R_EQUAL] = "OP_R_EQUAL",
+    [OP_R_GREATER] = "OP_R_GREATER",
+    [OP_R_LESS] = "OP_R_LESS",
+    [OP_R_ADD] = "OP_R_ADD",
+    [OP_R_SUBTRACT] = "OP_R_SUBTRACT",
+    [OP_R_MULTIPLY] = "OP_R_MULTIPLY",
+    [OP_R_DIVIDE] = "OP_R_DIVIDE",
+    [OP_R_NOT] = "OP_R_NOT",
+    [OP_R_NEGATE] = "OP_R_NEGATE",
+    [OP_R_PRINT] = "OP_R_PRINT",
+    [OP_R_JUMP] = "OP_R_JUMP",
+    [OP_R_JUMP_IF_FALSE] = "OP_R_JUMP_IF_FALSE",
+    [OP_R_LOOP] = "OP_R_LOOP",
+    [OP_R_JUMP_IF_NOT_LESS] = "OP_R_JUMP_IF_NOT_LESS",
+    [OP_R_JUMP_IF_NOT_GREATER] = "OP_R_JUMP_IF_NOT_GREATER",
+    [OP_R_JUMP_IF_LESS] = "OP_R_JUMP_IF_LESS",
+    [OP_R_JUMP_IF_GREATER] = "OP_R_JUMP_IF_GREATER",
+    [OP_R_CALL] = "OP_R_CALL",
+    [OP_R_INVOKE] = "OP_R_INVOKE",
+    [OP_R_SUPER_INVOKE] = "OP_R_SUPER_INVOKE",
+    [OP_R_TAIL_CALL] = "OP_R_TAIL_CALL",
+    [OP_R_TAIL_INVOKE] = "OP_R_TAIL_INVOKE",
+    [OP_R_CLOSURE] = "OP_R_CLOSURE",
+    [OP_R_CLOSE_UPVALUE] = "OP_R_CLOSE_UPVALUE",
+    [OP_R_RETURN] = "OP_R_RETURN",
+    [OP_R_CLASS] = "OP_R_CLASS",
+    [OP_R_INHERIT] = "OP_R_INHERIT",
+    [OP_R_METHOD] = "OP_R_METHOD",
+    [OP_R_GET_INDEX] = "OP_R_GET_INDEX",
+    [OP_R_SET_INDEX] = "OP_R_SET_INDEX",
+    [OP_R_LIST] = "OP_R_LIST",
+    [OP_R_MAP] = "OP_R_MAP",
+};
+
+const char *opcodeName(uint8_t opcode) {
+  return opcodeNames[opcode] != NULL ? opcodeNames[opcode] : "OP_UNKNOWN";
+}
 
 void disassembleByteChunk(ByteChunk *byteChunk, const char *name) {
   printf("==== %s ====\n", name);
@@ -14,13 +126,35 @@ void disassembleByteChunk(ByteChunk *byteChunk, const char *name) {
   }
 }
 
+// Prints the inline cache index that ends an instruction, if it has one
+static int cacheOperand(ByteChunk *byteChunk, int instruction, int offset) {
+  if (!hasInlineCache(byteChunk->code[instruction]))
+    return offset;
+  uint16_t cache = (uint16_t)(byteChunk->code[offset] << 8);
+  cache |= byteChunk->code[offset + 1];
+  printf(" ic%d", cache);
+  return offset + 2;
+}
+
 static int constantInstruction(const char *name, ByteChunk *byteChunk,
                                int offset) {
   uint8_t constant = byteChunk->code[offset + 1];
   printf("%-16s %4d '", name, constant);
   printValue(byteChunk->constants.values[constant]);
+  printf("'");
+  int next = cacheOperand(byteChunk, offset, offset + 2);
+  printf("\n");
+  return next;
+}
+
+static int globalInstruction(const char *name, ByteChunk *byteChunk,
+                             int offset) {
+  uint16_t slot = (uint16_t)(byteChunk->code[offset + 1] << 8);
+  slot |= byteChunk->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
   printf("'\n");
-  return offset + 2;
+  return offset + 3;
 }
 
 static int invokeInstruction(const char *name, ByteChunk *byteChunk,
@@ -29,8 +163,9 @@ static int invokeInstruction(const char *name, ByteChunk *byteChunk,
   uint8_t argCount = byteChunk->code[offset + 2];
   printf("%-16s (%d args) %4d", name, argCount, constant);
   printValue(byteChunk->constants.values[constant]);
+  int next = cacheOperand(byteChunk, offset, offset + 3);
   printf("\n");
-  return offset + 3;
+  return next;
 }
 
 static int simpleInstruction(const char *name, int offset) {
@@ -44,6 +179,26 @@ static int byteInstruction(const char *name, ByteChunk *byteChunk, int offset) {
   return offset + 2;
 }
 
+static int localConstantInstruction(const char *name, ByteChunk *byteChunk,
+                                    int offset) {
+  uint8_t slot = byteChunk->code[offset + 1];
+  uint8_t constant = byteChunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(byteChunk->constants.values[constant]);
+  printf("'");
+  int next = cacheOperand(byteChunk, offset, offset + 3);
+  printf("\n");
+  return next;
+}
+
+static int twoByteInstruction(const char *name, ByteChunk *byteChunk,
+                              int offset) {
+  uint8_t first = byteChunk->code[offset + 1];
+  uint8_t second = byteChunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, first, second);
+  return offset + 3;
+}
+
 static int jumpInstruction(const char *name, int sign, ByteChunk *byteChunk,
                            int offset) {
   uint16_t jump = (uint16_t)(byteChunk->code[offset + 1] << 8);
@@ -53,6 +208,63 @@ static int jumpInstruction(const char *name, int sign, ByteChunk *byteChunk,
   return offset + 3;
 }
 
+static void printConstant(ByteChunk *byteChunk, int constant) {
+  printf(" k%d '", constant);
+  printValue(byteChunk->constants.values[constant]);
+  printf("'");
+}
+
+// Operand layout of register instructions, one letter per operand:
+//   r register, k constant, x register or constant (RK), n plain number,
+//   j forward jump offset, l backward jump offset, c inline cache,
+//   g global slot
+static int registerInstruction(const char *name, const char *operands,
+                               ByteChunk *byteChunk, int offset) {
+  printf("%-24s", name);
+  int start = offset;
+  offset++;
+  for (const char *operand = operands; *operand != '\0'; operand++) {
+    uint8_t byte = byteChunk->code[offset++];
+    switch (*operand) {
+      case 'r':
+        printf(" r%d", byte);
+        break;
+      case 'k':
+        printConstant(byteChunk, byte);
+        break;
+      case 'x':
+        if (IS_RK_CONSTANT(byte)) {
+          printConstant(byteChunk, RK_INDEX(byte));
+        } else {
+          printf(" r%d", byte);
+        }
+        break;
+      case 'n':
+        printf(" %d", byte);
+        break;
+      case 'j':
+      case 'l': {
+        uint16_t jump = (uint16_t)(byte << 8) | byteChunk->code[offset++];
+        int sign = *operand == 'j' ? 1 : -1;
+        printf(" %d -> %d", start, offset + sign * jump);
+        break;
+      }
+      case 'c':
+        printf(" ic%d", (uint16_t)(byte << 8) | byteChunk->code[offset++]);
+        break;
+      case 'g': {
+        uint16_t slot = (uint16_t)(byte << 8) | byteChunk->code[offset++];
+        printf(" g%d '", slot);
+        printValue(vm.globalNames.values[slot]);
+        printf("'");
+        break;
+      }
+    }
+  }
+  printf("\n");
+  return offset;
+}
+
 int disassembleInstruction(ByteChunk *byteChunk, int offset) {
   printf("%04d ", offset);
 
@@ -77,13 +289,13 @@ int disassembleInstruction(ByteChunk *byteChunk, int offset) {
     case OP_GET_LOCAL:
       return byteInstruction("OP_GET_LOCAL", byteChunk, offset);
     case OP_SET_LOCAL:
-      return byteInstruction("OP_GET_LOCAL", byteChunk, offset);
+      return byteInstruction("OP_SET_LOCAL", byteChunk, offset);
     case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", byteChunk, offset);
+      return globalInstruction("OP_GET_GLOBAL", byteChunk, offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", byteChunk, offset);
+      return globalInstruction("OP_SET_GLOBAL", byteChunk, offset);
     case OP_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", byteChunk, offset);
+      return globalInstruction("OP_DEFINE_GLOBAL", byteChunk, offset);
     case OP_GET_UPVALUE:
       return byteInstruction("OP_GET_UPVALUE", byteChunk, offset);
     case OP_SET_UPVALUE:
@@ -126,6 +338,10 @@ int disassembleInstruction(ByteChunk *byteChunk, int offset) {
       return invokeInstruction("OP_INVOKE", byteChunk, offset);
     case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", byteChunk, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", byteChunk, offset);
+    case OP_TAIL_INVOKE:
+      return invokeInstruction("OP_TAIL_INVOKE", byteChunk, offset);
     case OP_CLOSURE: {
       offset++;
       uint8_t constant = byteChunk->code[offset++];
@@ -157,8 +373,257 @@ int disassembleInstruction(ByteChunk *byteChunk, int offset) {
       return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:
       return constantInstruction("OP_METHOD", byteChunk, offset);
+    case OP_GET_INDEX:
+      return simpleInstruction("OP_GET_INDEX", offset);
+    case OP_SET_INDEX:
+      return simpleInstruction("OP_SET_INDEX", offset);
+    case OP_LIST:
+      return byteInstruction("OP_LIST", byteChunk, offset);
+    case OP_MAP:
+      return byteInstruction("OP_MAP", byteChunk, offset);
+    case OP_JUMP_IF_NOT_LESS:
+      return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, byteChunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:
+      return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, byteChunk, offset);
+    case OP_JUMP_IF_LESS:
+      return jumpInstruction("OP_JUMP_IF_LESS", 1, byteChunk, offset);
+    case OP_JUMP_IF_GREATER:
+      return jumpInstruction("OP_JUMP_IF_GREATER", 1, byteChunk, offset);
+    case OP_ADD_LOCAL_CONSTANT:
+      return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", byteChunk,
+                                      offset);
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+      return localConstantInstruction("OP_SUBTRACT_LOCAL_CONSTANT", byteChunk,
+                                      offset);
+    case OP_ADD_LOCAL_LOCAL:
+      return twoByteInstruction("OP_ADD_LOCAL_LOCAL", byteChunk, offset);
+    case OP_GET_LOCAL_PROPERTY:
+      return localConstantInstruction("OP_GET_LOCAL_PROPERTY", byteChunk,
+                                      offset);
+    case OP_SET_LOCAL_POP:
+      return byteInstruction("OP_SET_LOCAL_POP", byteChunk, offset);
+    case OP_ADD_NUM:
+      return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+      return simpleInstruction("OP_ADD_STR", offset);
+    case OP_LESS_NUM:
+      return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_CALL_CLOSURE:
+      return byteInstruction("OP_CALL_CLOSURE", byteChunk, offset);
+    case OP_CALL_NATIVE:
+      return byteInstruction("OP_CALL_NATIVE", byteChunk, offset);
+    case OP_R_MOVE:
+      return registerInstruction("OP_R_MOVE", "rr", byteChunk, offset);
+    case OP_R_LOAD_CONSTANT:
+      return registerInstruction("OP_R_LOAD_CONSTANT", "rk", byteChunk, offset);
+    case OP_R_LOAD_NAH:
+      return registerInstruction("OP_R_LOAD_NAH", "r", byteChunk, offset);
+    case OP_R_LOAD_TRUE:
+      return registerInstruction("OP_R_LOAD_TRUE", "r", byteChunk, offset);
+    case OP_R_LOAD_FALSE:
+      return registerInstruction("OP_R_LOAD_FALSE", "r", byteChunk, offset);
+    case OP_R_GET_GLOBAL:
+      return registerInstruction("OP_R_GET_GLOBAL", "rg", byteChunk, offset);
+    case OP_R_SET_GLOBAL:
+      return registerInstruction("OP_R_SET_GLOBAL", "gx", byteChunk, offset);
+    case OP_R_DEFINE_GLOBAL:
+      return registerInstruction("OP_R_DEFINE_GLOBAL", "gx", byteChunk, offset);
+    case OP_R_GET_UPVALUE:
+      return registerInstruction("OP_R_GET_UPVALUE", "rn", byteChunk, offset);
+    case OP_R_SET_UPVALUE:
+      return registerInstruction("OP_R_SET_UPVALUE", "nx", byteChunk, offset);
+    case OP_R_GET_PROPERTY:
+      return registerInstruction("OP_R_GET_PROPERTY", "rrkc", byteChunk, offset);
+    case OP_R_SET_PROPERTY:
+      return registerInstruction("OP_R_SET_PROPERTY", "rkxc", byteChunk, offset);
+    case OP_R_GET_SUPER:
+      return registerInstruction("OP_R_GET_SUPER", "rrrk", byteChunk, offset);
+    case OP_R_EQUAL:
+      return registerInstruction("OP_R_EQUAL", "rxx", byteChunk, offset);
+    case OP_R_GREATER:
+      return registerInstruction("OP_R_GREATER", "rxx", byteChunk, offset);
+    case OP_R_LESS:
+      return registerInstruction("OP_R_LESS", "rxx", byteChunk, offset);
+    case OP_R_ADD:
+      return registerInstruction("OP_R_ADD", "rxx", byteChunk, offset);
+    case OP_R_SUBTRACT:
+      return registerInstruction("OP_R_SUBTRACT", "rxx", byteChunk, offset);
+    case OP_R_MULTIPLY:
+      return registerInstruction("OP_R_MULTIPLY", "rxx", byteChunk, offset);
+    case OP_R_DIVIDE:
+      return registerInstruction("OP_R_DIVIDE", "rxx", byteChunk, offset);
+    case OP_R_NOT:
+      return registerInstruction("OP_R_NOT", "rr", byteChunk, offset);
+    case OP_R_NEGATE:
+      return registerInstruction("OP_R_NEGATE", "rr", byteChunk, offset);
+    case OP_R_PRINT:
+      return registerInstruction("OP_R_PRINT", "x", byteChunk, offset);
+    case OP_R_JUMP:
+      return registerInstruction("OP_R_JUMP", "j", byteChunk, offset);
+    case OP_R_JUMP_IF_FALSE:
+      return registerInstruction("OP_R_JUMP_IF_FALSE", "rj", byteChunk, offset);
+    case OP_R_LOOP:
+      return registerInstruction("OP_R_LOOP", "l", byteChunk, offset);
+    case OP_R_JUMP_IF_NOT_LESS:
+      return registerInstruction("OP_R_JUMP_IF_NOT_LESS", "xxj", byteChunk, offset);
+    case OP_R_JUMP_IF_NOT_GREATER:
+      return registerInstruction("OP_R_JUMP_IF_NOT_GREATER", "xxj", byteChunk, offset);
+    case OP_R_JUMP_IF_LESS:
+      return registerInstruction("OP_R_JUMP_IF_LESS", "xxj", byteChunk, offset);
+    case OP_R_JUMP_IF_GREATER:
+      return registerInstruction("OP_R_JUMP_IF_GREATER", "xxj", byteChunk, offset);
+    case OP_R_CALL:
+      return registerInstruction("OP_R_CALL", "rn", byteChunk, offset);
+    case OP_R_INVOKE:
+      return registerInstruction("OP_R_INVOKE", "rknc", byteChunk, offset);
+    case OP_R_SUPER_INVOKE:
+      return registerInstruction("OP_R_SUPER_INVOKE", "rknr", byteChunk, offset);
+    case OP_R_TAIL_CALL:
+      return registerInstruction("OP_R_TAIL_CALL", "rn", byteChunk, offset);
+    case OP_R_TAIL_INVOKE:
+      return registerInstruction("OP_R_TAIL_INVOKE", "rknc", byteChunk, offset);
+    case OP_R_CLOSURE: {
+      int start = offset;
+      offset = registerInstruction("OP_R_CLOSURE", "rk", byteChunk, offset);
+      ObjectFunction *function =
+          AS_FUNCTION(byteChunk->constants.values[byteChunk->code[start + 2]]);
+      for (int j = 0; j < function->upvalueCount; j++) {
+        int isLocal = byteChunk->code[offset++];
+        int index = byteChunk->code[offset++];
+        printf("%04d    |                     %s %d\n", offset - 2,
+               isLocal ? "local" : "upvalue", index);
+      }
+      return offset;
+    }
+    case OP_R_CLOSE_UPVALUE:
+      return registerInstruction("OP_R_CLOSE_UPVALUE", "r", byteChunk, offset);
+    case OP_R_RETURN:
+      return registerInstruction("OP_R_RETURN", "x", byteChunk, offset);
+    case OP_R_CLASS:
+      return registerInstruction("OP_R_CLASS", "rk", byteChunk, offset);
+    case OP_R_INHERIT:
+      return registerInstruction("OP_R_INHERIT", "rr", byteChunk, offset);
+    case OP_R_METHOD:
+      return registerInstruction("OP_R_METHOD", "rkr", byteChunk, offset);
+    case OP_R_GET_INDEX:
+      return registerInstruction("OP_R_GET_INDEX", "rrx", byteChunk, offset);
+    case OP_R_SET_INDEX:
+      return registerInstruction("OP_R_SET_INDEX", "rxx", byteChunk, offset);
+    case OP_R_LIST:
+      return registerInstruction("OP_R_LIST", "rn", byteChunk, offset);
+    case OP_R_MAP:
+      return registerInstruction("OP_R_MAP", "rn", byteChunk, offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
   }
 }
+
+typedef struct {
+  uint8_t first;
+  uint8_t second;
+  uint64_t count;
+} OpcodePair;
+
+static int compareOpcodePairs(const void *a, const void *b) {
+  uint64_t countA = ((const OpcodePair *)a)->count;
+  uint64_t countB = ((const OpcodePair *)b)->count;
+  return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+void printOpcodeProfile(uint64_t *counts,
+                        uint64_t (*pairCounts)[UINT8_COUNT]) {
+  uint64_t total = 0;
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    total += counts[i];
+  }
+  if (total == 0)
+    return;
+
+  fprintf(stderr, "==== opcode profile: %llu instructions ====\n",
+          (unsigned long long)total);
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    if (counts[i] == 0)
+      continue;
+    fprintf(stderr, "%-24s %12llu %6.2f%%\n", opcodeName(i),
+            (unsigned long long)counts[i], 100.0 * counts[i] / total);
+  }
+
+  static OpcodePair pairs[UINT8_COUNT * UINT8_COUNT];
+  int pairCount = 0;
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    for (int j = 0; j < UINT8_COUNT; j++) {
+      if (pairCounts[i][j] == 0)
+        continue;
+      pairs[pairCount++] = (OpcodePair){i, j, pairCounts[i][j]};
+    }
+  }
+  qsort(pairs, pairCount, sizeof(OpcodePair), compareOpcodePairs);
+
+  fprintf(stderr, "==== top opcode pairs ====\n");
+  for (int i = 0; i < pairCount && i < 24; i++) {
+    fprintf(stderr, "%-24s %-24s %12llu %6.2f%%\n", opcodeName(pairs[i].first),
+            opcodeName(pairs[i].second), (unsigned long long)pairs[i].count,
+            100.0 * pairs[i].count / total);
+  }
+}
+
+static const char *cacheStateName(CacheState state) {
+  switch (state) {
+    case CACHE_EMPTY:
+      return "empty";
+    case CACHE_MONOMORPHIC:
+      return "monomorphic";
+    case CACHE_POLYMORPHIC:
+      return "polymorphic";
+    case CACHE_MEGAMORPHIC:
+      return "megamorphic";
+  }
+  return "unknown";
+}
+
+static void printFunctionCaches(ObjectFunction *function) {
+  ByteChunk *byteChunk = &function->byteChunk;
+  for (int offset = 0; offset < byteChunk->count;
+       offset += instructionLength(byteChunk, offset)) {
+    uint8_t instruction = byteChunk->code[offset];
+    if (!hasInlineCache(instruction))
+      continue;
+
+    // The cache index ends the instruction
+    int end = offset + instructionLength(byteChunk, offset);
+    InlineCache *cache =
+        &byteChunk->caches[(byteChunk->code[end - 2] << 8) |
+                           byteChunk->code[end - 1]];
+    uint64_t total = cache->hits + cache->misses;
+    if (total == 0)
+      continue;
+
+    int name = offset + 1;
+    if (instruction == OP_R_GET_PROPERTY) {
+      name = offset + 3;
+    } else if (instruction == OP_GET_LOCAL_PROPERTY ||
+               instruction == OP_R_SET_PROPERTY ||
+               instruction == OP_R_INVOKE ||
+               instruction == OP_R_TAIL_INVOKE) {
+      name = offset + 2;
+    }
+
+    fprintf(stderr, "%-12s %5d  %-24s %-12s %-12s %12llu %12llu %6.2f%%\n",
+            function->name != NULL ? function->name->chars : "script",
+            byteChunk->lines[offset], opcodeName(instruction),
+            AS_CSTRING(byteChunk->constants.values[byteChunk->code[name]]),
+            cacheStateName(cache->state), (unsigned long long)cache->hits,
+            (unsigned long long)cache->misses, 100.0 * cache->hits / total);
+  }
+}
+
+void printCacheProfile() {
+  fprintf(stderr, "==== inline cache profile ====\n");
+  fprintf(stderr, "%-12s %5s  %-24s %-12s %-12s %12s %12s %7s\n", "function",
+          "line", "instruction", "name", "state", "hits", "misses", "hit");
+  for (Object *object = vm.objects; object != NULL; object = object->next) {
+    if (object->type == OBJECT_FUNCTION)
+      printFunctionCaches((ObjectFunction *)object);
+  }
+}
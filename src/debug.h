@@ -5,5 +5,8 @@
 
 void disassembleByteChunk(ByteChunk *bytechunk, const char *name);
 int disassembleInstruction(ByteChunk *bytechunk, int offset);
+const char *opcodeName(uint8_t opcode);
+void printOpcodeProfile(uint64_t *counts, uint64_t (*pairCounts)[UINT8_COUNT]);
+void printCacheProfile();
 
 #endif /* MEKVM_DEBUG_H */
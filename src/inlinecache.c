@@ -0,0 +1,117 @@
+#include "inlinecache.h"
+#include "object.h"
+#include "shape.h"
+#include "table.h"
+#include "vm.h"
+
+typedef struct {
+  ObjectShape *shape;
+  ObjectString *name;
+  bool isStore;
+  uint32_t epoch;
+  CacheEntry entry;
+} MegamorphicEntry;
+
+// Shared by every megamorphic site. It holds no GC roots, so each
+// collection empties it rather than keeping shapes and methods alive.
+static MegamorphicEntry megamorphicCache[MEGAMORPHIC_CACHE_SIZE];
+
+void initInlineCache(InlineCache *cache) {
+  cache->state = CACHE_EMPTY;
+  cache->entryCount = 0;
+  cache->epoch = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+}
+
+void clearMegamorphicCache() {
+  for (int i = 0; i < MEGAMORPHIC_CACHE_SIZE; i++) {
+    megamorphicCache[i].shape = NULL;
+  }
+}
+
+static MegamorphicEntry *megamorphicSlot(ObjectShape *shape,
+                                         ObjectString *name, bool isStore) {
+  uint32_t hash = (uint32_t)((uintptr_t)shape >> 4) ^ name->hash ^ isStore;
+  return &megamorphicCache[hash & (MEGAMORPHIC_CACHE_SIZE - 1)];
+}
+
+static CacheEntry *findMegamorphic(ObjectShape *shape, ObjectString *name,
+                                   bool isStore) {
+  MegamorphicEntry *slot = megamorphicSlot(shape, name, isStore);
+  if (slot->shape == shape && slot->name == name &&
+      slot->isStore == isStore && slot->epoch == vm.methodEpoch)
+    return &slot->entry;
+  return NULL;
+}
+
+static CacheEntry *record(InlineCache *cache, CacheEntry entry,
+                          ObjectString *name, bool isStore) {
+  if (cache->state != CACHE_MEGAMORPHIC) {
+    if (cache->entryCount < CACHE_ENTRIES) {
+      CacheEntry *cached = &cache->entries[cache->entryCount++];
+      *cached = entry;
+      cache->state =
+          cache->entryCount == 1 ? CACHE_MONOMORPHIC : CACHE_POLYMORPHIC;
+      return cached;
+    }
+    cache->state = CACHE_MEGAMORPHIC;
+    cache->entryCount = 0;
+  }
+
+  MegamorphicEntry *slot = megamorphicSlot(entry.shape, name, isStore);
+  slot->shape = entry.shape;
+  slot->name = name;
+  slot->isStore = isStore;
+  slot->epoch = vm.methodEpoch;
+  slot->entry = entry;
+  return &slot->entry;
+}
+
+CacheEntry *cacheGetMiss(InlineCache *cache, ObjectShape *shape,
+                         ObjectClass *klass, ObjectString *name) {
+  if (cache->epoch != vm.methodEpoch) {
+    // Method entries may be stale, start over
+    cache->epoch = vm.methodEpoch;
+    cache->entryCount = 0;
+    if (cache->state != CACHE_MEGAMORPHIC)
+      cache->state = CACHE_EMPTY;
+  }
+
+  if (cache->state == CACHE_MEGAMORPHIC) {
+    CacheEntry *shared = findMegamorphic(shape, name, false);
+    if (shared != NULL) {
+      cache->hits++;
+      return shared;
+    }
+  }
+  cache->misses++;
+
+  CacheEntry entry = {shape, NULL, CREATE_NAH_VALUE(), -1};
+  entry.slot = shapeFindSlot(shape, name);
+  if (entry.slot == -1 && !classGetMethod(klass, name, &entry.method))
+    return NULL;
+  return record(cache, entry, name, false);
+}
+
+CacheEntry *cacheSetMiss(InlineCache *cache, ObjectShape *shape,
+                         ObjectString *name) {
+  if (cache->state == CACHE_MEGAMORPHIC) {
+    CacheEntry *shared = findMegamorphic(shape, name, true);
+    if (shared != NULL) {
+      cache->hits++;
+      return shared;
+    }
+  }
+  cache->misses++;
+
+  CacheEntry entry = {shape, NULL, CREATE_NAH_VALUE(), -1};
+  entry.slot = shapeFindSlot(shape, name);
+  if (entry.slot == -1) {
+    if (shape->fieldCount == SHAPE_MAX_FIELDS)
+      return NULL;
+    entry.transition = shapeTransition(shape, name);
+    entry.slot = entry.transition->fieldCount - 1;
+  }
+  return record(cache, entry, name, true);
+}
@@ -0,0 +1,63 @@
+#ifndef MEKVM_INLINECACHE_H
+#define MEKVM_INLINECACHE_H
+
+#include "common.h"
+#include "table.h"
+#include "value.h"
+
+/*
+ * Per-site caches for OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE (and
+ * their fused and register forms). The cache index is a 16-bit operand that
+ * always ends the instruction.
+ *
+ * Entries are keyed on the receiver's shape. Every shape descends from the
+ * root shape of exactly one class, so the shape also pins down the class
+ * whose method an entry may hold. A site starts empty, becomes monomorphic
+ * with its first entry and polymorphic with up to CACHE_ENTRIES of them.
+ * Once that overflows it turns megamorphic for good and goes through a
+ * cache shared by all sites.
+ *
+ * Shapes never change, so field entries stay valid forever. Method entries
+ * depend on method tables, which bump vm.methodEpoch when they change; a
+ * site filled under an older epoch starts over.
+ */
+
+#define CACHE_ENTRIES 4
+#define MEGAMORPHIC_CACHE_SIZE 1024
+
+typedef enum {
+  CACHE_EMPTY,
+  CACHE_MONOMORPHIC,
+  CACHE_POLYMORPHIC,
+  CACHE_MEGAMORPHIC,
+} CacheState;
+
+typedef struct {
+  struct ObjectShape *shape; // Receiver shape the entry was filled for
+  // Stores that add a field move the instance here, NULL if it has the field
+  struct ObjectShape *transition;
+  Value method; // Reads of a method, the field slot is -1 then
+  int slot;
+} CacheEntry;
+
+typedef struct {
+  CacheState state;
+  int entryCount; // Always 0 once megamorphic
+  uint32_t epoch;
+  CacheEntry entries[CACHE_ENTRIES];
+  uint64_t hits;
+  uint64_t misses;
+} InlineCache;
+
+struct ObjectClass;
+
+void initInlineCache(InlineCache *cache);
+// Both return NULL when the access can't be cached: the property doesn't
+// exist, or the instance has too many fields for a shape
+CacheEntry *cacheGetMiss(InlineCache *cache, struct ObjectShape *shape,
+                         struct ObjectClass *klass, ObjectString *name);
+CacheEntry *cacheSetMiss(InlineCache *cache, struct ObjectShape *shape,
+                         ObjectString *name);
+void clearMegamorphicCache();
+
+#endif /* MEKVM_INLINECACHE_H */
@@ -0,0 +1,983 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "memory.h"
+#include "vm.h"
+
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING)
+#define JIT_SUPPORTED
+#endif
+
+#ifdef JIT_SUPPORTED
+
+#include <sys/mman.h>
+
+/*
+ * Baseline template compiler for stack bytecode. Every instruction becomes a
+ * fixed sequence of x86-64 code working on the interpreter's own stack, so
+ * compiled code can be entered and left at any instruction boundary:
+ *
+ *   rbx  stack top (vm.stackTop while compiled code runs)
+ *   r12  frame->slots
+ *   r13  QNAN, for number checks
+ *   r14  the CallFrame
+ *
+ * Numbers, locals, globals, upvalues and jumps run inline. Calls, property
+ * accesses and string concatenation go through the runtime. Whatever the
+ * code doesn't handle, including every runtime error, leaves with frame->ip
+ * on the instruction so the interpreter runs it instead and reports errors
+ * from the right line.
+ */
+
+typedef enum {
+  JIT_BAIL,   // Interpret the top frame from its ip
+  JIT_CALL,   // A frame was pushed, try to run it compiled too
+  JIT_RETURN, // The frame returned, try to resume its caller compiled
+  JIT_ERROR,  // A runtime error was reported
+} JitStatus;
+
+// Returned by helpers that let compiled code carry on
+#define JIT_NEXT -1
+
+typedef int (*JitEntry)(CallFrame *frame, Value *sp, uint8_t *target);
+
+enum {
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+};
+
+// Condition codes
+enum {
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_S = 0x8,
+};
+
+typedef struct {
+  int position; // Of the rel32 to patch
+  int target;   // Bytecode offset
+} Fixup;
+
+typedef struct {
+  int count;
+  int capacity;
+  Fixup *fixups;
+} FixupArray;
+
+typedef struct {
+  ObjectFunction *function;
+  ByteChunk *byteChunk;
+  uint8_t *code;
+  int count;
+  int capacity;
+  int *entries;
+  FixupArray jumps; // To the code of a bytecode offset
+  FixupArray bails; // To the stub leaving at a bytecode offset
+  int bailExit;
+  int epilogue;
+  int offset; // Of the instruction being compiled
+} Assembler;
+
+static void *growBuffer(void *buffer, size_t size) {
+  void *result = realloc(buffer, size);
+  if (result == NULL) {
+    fprintf(stderr, "Not enough memory to compile.\n");
+    exit(1);
+  }
+  return result;
+}
+
+static void emit8(Assembler *as, uint8_t byte) {
+  if (as->count == as->capacity) {
+    as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+    as->code = growBuffer(as->code, as->capacity);
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler *as, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    emit8(as, (uint8_t)(value >> (i * 8)));
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+  emit32(as, (uint32_t)value);
+  emit32(as, (uint32_t)(value >> 32));
+}
+
+static void addFixup(FixupArray *array, int position, int target) {
+  if (array->count == array->capacity) {
+    array->capacity = GROW_CAPACITY(array->capacity);
+    array->fixups =
+        growBuffer(array->fixups, sizeof(Fixup) * array->capacity);
+  }
+  array->fixups[array->count++] = (Fixup){position, target};
+}
+
+static void patch(Assembler *as, int position, int target) {
+  int32_t rel = target - (position + 4);
+  memcpy(as->code + position, &rel, sizeof(rel));
+}
+
+// REX.W prefix for a reg field and an r/m field
+static void rex(Assembler *as, int reg, int rm) {
+  emit8(as, 0x48 | ((reg & 8) >> 1) | ((rm & 8) >> 3));
+}
+
+// op reg, [base + disp]
+static void memoryOperand(Assembler *as, uint8_t opcode, int reg, int base,
+                          int32_t disp) {
+  rex(as, reg, base);
+  emit8(as, opcode);
+  emit8(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP)
+    emit8(as, 0x24); // SIB for rsp and r12 bases
+  emit32(as, (uint32_t)disp);
+}
+
+static void load(Assembler *as, int dst, int base, int32_t disp) {
+  memoryOperand(as, 0x8B, dst, base, disp);
+}
+
+static void store(Assembler *as, int base, int32_t disp, int src) {
+  memoryOperand(as, 0x89, src, base, disp);
+}
+
+static void loadImmediate(Assembler *as, int dst, uint64_t value) {
+  emit8(as, 0x48 | ((dst & 8) >> 3));
+  emit8(as, 0xB8 + (dst & 7));
+  emit64(as, value);
+}
+
+static void loadPointer(Assembler *as, int dst, void *pointer) {
+  loadImmediate(as, dst, (uint64_t)(uintptr_t)pointer);
+}
+
+// op dst, src with the 64-bit ALU opcodes (mov 0x89, or 0x09, and 0x21,
+// xor 0x31, cmp 0x39, test 0x85)
+static void alu(Assembler *as, uint8_t opcode, int dst, int src) {
+  rex(as, src, dst);
+  emit8(as, opcode);
+  emit8(as, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+static void addImmediate(Assembler *as, int dst, int32_t value) {
+  rex(as, 0, dst);
+  emit8(as, 0x81);
+  emit8(as, 0xC0 | (dst & 7));
+  emit32(as, (uint32_t)value);
+}
+
+// movq xmm, gpr and movq gpr, xmm (0x6E / 0x7E)
+static void movq(Assembler *as, uint8_t opcode, int xmm, int gpr) {
+  emit8(as, 0x66);
+  rex(as, xmm, gpr);
+  emit8(as, 0x0F);
+  emit8(as, opcode);
+  emit8(as, 0xC0 | (xmm << 3) | (gpr & 7));
+}
+
+// Scalar double arithmetic and comparisons on xmm registers
+static void sse(Assembler *as, uint8_t prefix, uint8_t opcode, int dst,
+                int src) {
+  emit8(as, prefix);
+  emit8(as, 0x0F);
+  emit8(as, opcode);
+  emit8(as, 0xC0 | (dst << 3) | src);
+}
+
+// Returns the position of the rel32 to patch
+static int jumpIf(Assembler *as, int condition) {
+  emit8(as, 0x0F);
+  emit8(as, 0x80 | condition);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+static int jump(Assembler *as) {
+  emit8(as, 0xE9);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+static void patchHere(Assembler *as, int position) {
+  patch(as, position, as->count);
+}
+
+static void emitCall(Assembler *as, void *function) {
+  loadPointer(as, RAX, function);
+  emit8(as, 0xFF);
+  emit8(as, 0xD0); // call rax
+}
+
+static void emitPush(Assembler *as, int src) {
+  store(as, RBX, 0, src);
+  addImmediate(as, RBX, 8);
+}
+
+static uint8_t *bytecodeAt(Assembler *as, int offset) {
+  return as->byteChunk->code + offset;
+}
+
+// Leaves for the interpreter to run the current instruction
+static void bailIf(Assembler *as, int condition) {
+  addFixup(&as->bails, jumpIf(as, condition), as->offset);
+}
+
+static void bail(Assembler *as) {
+  addFixup(&as->bails, jump(as), as->offset);
+}
+
+static void jumpTo(Assembler *as, int condition, int target) {
+  addFixup(&as->jumps, jumpIf(as, condition), target);
+}
+
+// Bails unless reg holds a number
+static void checkNumber(Assembler *as, int reg) {
+  alu(as, 0x89, R8, reg);
+  alu(as, 0x21, R8, R13);
+  alu(as, 0x39, R8, R13);
+  bailIf(as, CC_E);
+}
+
+// Makes the runtime see the stack, and frame->ip as the interpreter would
+// leave it: past the current instruction, for error traces
+static void syncState(Assembler *as, int next) {
+  loadPointer(as, RAX, bytecodeAt(as, next));
+  store(as, R14, offsetof(CallFrame, ip), RAX);
+  loadPointer(as, RAX, &vm.stackTop);
+  store(as, RAX, 0, RBX);
+}
+
+static void reloadStack(Assembler *as) {
+  loadPointer(as, RAX, &vm.stackTop);
+  load(as, RBX, RAX, 0);
+}
+
+// After helpers returning JIT_NEXT or a status to leave with
+static void leaveUnlessNext(Assembler *as) {
+  emit8(as, 0x3D); // cmp eax, imm32
+  emit32(as, (uint32_t)JIT_NEXT);
+  patch(as, jumpIf(as, CC_NE), as->epilogue);
+}
+
+// rax = (bool)al as a Value
+static void booleanFromFlag(Assembler *as) {
+  emit8(as, 0x0F);
+  emit8(as, 0xB6);
+  emit8(as, 0xC0); // movzx eax, al
+  loadImmediate(as, RCX, CREATE_FALSE_VALUE());
+  alu(as, 0x09, RAX, RCX);
+}
+
+static void setIfAbove(Assembler *as) {
+  emit8(as, 0x0F);
+  emit8(as, 0x90 | CC_A);
+  emit8(as, 0xC0); // seta al
+}
+
+static void testResult(Assembler *as) {
+  emit8(as, 0x84);
+  emit8(as, 0xC0); // test al, al
+}
+
+static void loadGlobals(Assembler *as, int dst) {
+  loadPointer(as, dst, &vm.globalValues.values);
+  load(as, dst, dst, 0);
+}
+
+// rax = the upvalue's location
+static void loadUpvalue(Assembler *as, int slot) {
+  load(as, RAX, R14, offsetof(CallFrame, closure));
+  load(as, RAX, RAX, offsetof(ObjectClosure, upvalues));
+  load(as, RAX, RAX, slot * (int)sizeof(ObjectUpvalue *));
+  load(as, RAX, RAX, offsetof(ObjectUpvalue, location));
+}
+
+// xmm0 = rax, xmm1 = rcx, both checked to be numbers
+static void numberOperands(Assembler *as) {
+  checkNumber(as, RAX);
+  checkNumber(as, RCX);
+  movq(as, 0x6E, 0, RAX);
+  movq(as, 0x6E, 1, RCX);
+}
+
+static void binaryOperands(Assembler *as) {
+  load(as, RAX, RBX, -16);
+  load(as, RCX, RBX, -8);
+  numberOperands(as);
+}
+
+static void replaceOperands(Assembler *as) {
+  store(as, RBX, -16, RAX);
+  addImmediate(as, RBX, -8);
+}
+
+// xmm0 op= xmm1, pushed or written over the operands
+static void arithmetic(Assembler *as, uint8_t opcode) {
+  sse(as, 0xF2, opcode, 0, 1);
+  movq(as, 0x7E, 0, RAX);
+}
+
+static void compare(Assembler *as, bool less) {
+  // Unordered (NaN) comparisons clear "above", both ways round
+  if (less)
+    sse(as, 0x66, 0x2E, 1, 0); // ucomisd xmm1, xmm0
+  else
+    sse(as, 0x66, 0x2E, 0, 1); // ucomisd xmm0, xmm1
+  setIfAbove(as);
+  booleanFromFlag(as);
+  replaceOperands(as);
+}
+
+static void compareJump(Assembler *as, bool less, bool jumpIfTrue) {
+  binaryOperands(as);
+  addImmediate(as, RBX, -16);
+  if (less)
+    sse(as, 0x66, 0x2E, 1, 0);
+  else
+    sse(as, 0x66, 0x2E, 0, 1);
+  jumpTo(as, jumpIfTrue ? CC_A : CC_BE, jumpTarget(as->byteChunk, as->offset));
+}
+
+static void jitSetUpvalue(ObjectUpvalue *upvalue, Value value) {
+  *upvalue->location = value;
+  writeBarrier((Object *)upvalue, value);
+}
+
+static void jitPrint(Value value) {
+  printValue(value);
+  printf("\n");
+}
+
+static bool jitAdd() {
+  Value b = vm.stackTop[-1];
+  Value a = vm.stackTop[-2];
+  if (!IS_STRING(a) || !IS_STRING(b))
+    return false;
+  ObjectString *result = concatenate(AS_STRING(a), AS_STRING(b));
+  vm.stackTop--;
+  vm.stackTop[-1] = CREATE_OBJECT_VALUE(result);
+  return true;
+}
+
+// Counts an entry into the function, compiling it once it gets hot
+static bool isCompiled(ObjectFunction *function) {
+  if (function->jitCode != NULL)
+    return true;
+  // Compilation is tried once, when the count reaches the threshold
+  return function->hotness < JIT_THRESHOLD &&
+         ++function->hotness == JIT_THRESHOLD && jitCompile(function);
+}
+
+static int enter(CallFrame *frame) {
+  ObjectFunction *function = frame->closure->function;
+  JitCode *jit = function->jitCode;
+  int entry = jit->entries[frame->ip - function->byteChunk.code];
+  if (entry == -1)
+    return JIT_BAIL;
+  return ((JitEntry)jit->code)(frame, vm.stackTop, jit->code + entry);
+}
+
+// Compiled calls nested on the C stack, see runCallee()
+static int nesting;
+
+// Runs a frame the caller's compiled code just pushed. Compiled callees run
+// nested on the C stack, and their caller carries on once they return.
+// Anything else leaves both for the interpreter, as do calls nested deeper
+// than the C stack should grow.
+static int runCallee(int frameCount) {
+  if (vm.frameCount == frameCount)
+    return JIT_NEXT; // A native function or a class without init
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  for (;;) {
+    if (nesting == JIT_MAX_NESTING || !isCompiled(frame->closure->function))
+      return JIT_CALL;
+    nesting++;
+    int status = enter(frame);
+    nesting--;
+    if (status == JIT_RETURN)
+      return JIT_NEXT;
+    // Tail calls leave with the callee's frame taken over by another call
+    if (status != JIT_CALL || vm.frameCount != frameCount + 1)
+      return status;
+  }
+}
+
+static int jitCallValue(int argCount) {
+  int frameCount = vm.frameCount;
+  if (!callValue(vm.stackTop[-1 - argCount], argCount))
+    return JIT_ERROR;
+  return runCallee(frameCount);
+}
+
+static int jitInvoke(ObjectString *name, int argCount, InlineCache *cache) {
+  int frameCount = vm.frameCount;
+  if (!invoke(name, argCount, cache))
+    return JIT_ERROR;
+  return runCallee(frameCount);
+}
+
+// A frame taken over by a tail call restarts in jitRun() or runCallee()
+static int finishTailCall(uint8_t *ip, int frameCount) {
+  if (vm.frames[vm.frameCount - 1].ip != ip && vm.frameCount == frameCount)
+    return JIT_CALL;
+  return runCallee(frameCount);
+}
+
+static int jitTailCall(int argCount) {
+  int frameCount = vm.frameCount;
+  uint8_t *ip = vm.frames[frameCount - 1].ip;
+  if (!tailCallValue(vm.stackTop[-1 - argCount], argCount))
+    return JIT_ERROR;
+  return finishTailCall(ip, frameCount);
+}
+
+static int jitTailInvoke(ObjectString *name, int argCount,
+                         InlineCache *cache) {
+  int frameCount = vm.frameCount;
+  uint8_t *ip = vm.frames[frameCount - 1].ip;
+  if (!tailInvoke(name, argCount, cache))
+    return JIT_ERROR;
+  return finishTailCall(ip, frameCount);
+}
+
+// Adds the top two values, concatenating strings through the runtime
+static void add(Assembler *as) {
+  load(as, RAX, RBX, -16);
+  load(as, RCX, RBX, -8);
+  alu(as, 0x89, R8, RAX);
+  alu(as, 0x21, R8, RCX);
+  alu(as, 0x21, R8, R13);
+  alu(as, 0x39, R8, R13);
+  // Both are numbers unless both have every QNAN bit set
+  int strings = jumpIf(as, CC_E);
+  checkNumber(as, RAX);
+  checkNumber(as, RCX);
+  movq(as, 0x6E, 0, RAX);
+  movq(as, 0x6E, 1, RCX);
+  arithmetic(as, 0x58);
+  replaceOperands(as);
+  int done = jump(as);
+
+  patchHere(as, strings);
+  syncState(as, as->offset + 1);
+  emitCall(as, jitAdd);
+  testResult(as);
+  bailIf(as, CC_E);
+  reloadStack(as);
+  patchHere(as, done);
+}
+
+// cmp dword [base + disp], value
+static void compare32(Assembler *as, int base, int32_t disp, int32_t value) {
+  if (base & 8)
+    emit8(as, 0x41);
+  emit8(as, 0x81);
+  emit8(as, 0x80 | (7 << 3) | (base & 7));
+  emit32(as, (uint32_t)disp);
+  emit32(as, (uint32_t)value);
+}
+
+// Reads a field of the instance on top of the stack through the first entry
+// of its site's cache, the usual monomorphic case. Everything else falls
+// through to the code emitted next; returns the jump to patch past it.
+static int cachedFieldRead(Assembler *as, InlineCache *cache) {
+  int misses[6];
+  int missCount = 0;
+
+  load(as, RAX, RBX, -8);
+  loadImmediate(as, RCX, QNAN | SIGN_BIT);
+  alu(as, 0x89, RDX, RAX);
+  alu(as, 0x21, RDX, RCX);
+  alu(as, 0x39, RDX, RCX);
+  misses[missCount++] = jumpIf(as, CC_NE);
+  loadImmediate(as, RDX, ~(QNAN | SIGN_BIT));
+  alu(as, 0x21, RDX, RAX);
+  compare32(as, RDX, offsetof(Object, type), OBJECT_INSTANCE);
+  misses[missCount++] = jumpIf(as, CC_NE);
+
+  loadPointer(as, RSI, cache);
+  compare32(as, RSI, offsetof(InlineCache, entryCount), 0);
+  misses[missCount++] = jumpIf(as, CC_E);
+  load(as, RCX, RDX, offsetof(ObjectInstance, shape));
+  memoryOperand(as, 0x3B, RCX, RSI,
+                offsetof(InlineCache, entries[0].shape)); // cmp rcx, [..]
+  misses[missCount++] = jumpIf(as, CC_NE);
+  memoryOperand(as, 0x63, RAX, RSI,
+                offsetof(InlineCache, entries[0].slot)); // movsxd rax, [..]
+  alu(as, 0x85, RAX, RAX);
+  misses[missCount++] = jumpIf(as, CC_S); // A method, slot -1
+
+  load(as, RCX, RDX, offsetof(ObjectInstance, fields));
+  emit8(as, 0x48);
+  emit8(as, 0x8B);
+  emit8(as, 0x04);
+  emit8(as, 0xC1); // mov rax, [rcx + rax * 8]
+  store(as, RBX, -8, RAX);
+  memoryOperand(as, 0x81, 0, RSI, offsetof(InlineCache, hits));
+  emit32(as, 1); // add qword [..], 1
+  int done = jump(as);
+
+  for (int i = 0; i < missCount; i++)
+    patchHere(as, misses[i]);
+  return done;
+}
+
+static uint16_t readShort(Assembler *as, int offset) {
+  uint8_t *code = bytecodeAt(as, offset);
+  return (uint16_t)((code[0] << 8) | code[1]);
+}
+
+static InlineCache *cacheOperand(Assembler *as, int length) {
+  return &as->byteChunk->caches[readShort(as, as->offset + length - 2)];
+}
+
+static void compileInstruction(Assembler *as, int length) {
+  ByteChunk *byteChunk = as->byteChunk;
+  uint8_t *code = bytecodeAt(as, as->offset);
+  Value *constants = byteChunk->constants.values;
+  int next = as->offset + length;
+
+  switch (code[0]) {
+    case OP_CONSTANT:
+      loadImmediate(as, RAX, constants[code[1]]);
+      emitPush(as, RAX);
+      break;
+    case OP_NAH:
+      loadImmediate(as, RAX, CREATE_NAH_VALUE());
+      emitPush(as, RAX);
+      break;
+    case OP_TRUE:
+      loadImmediate(as, RAX, CREATE_TRUE_VALUE());
+      emitPush(as, RAX);
+      break;
+    case OP_FALSE:
+      loadImmediate(as, RAX, CREATE_FALSE_VALUE());
+      emitPush(as, RAX);
+      break;
+    case OP_POP:
+      addImmediate(as, RBX, -8);
+      break;
+    case OP_GET_LOCAL:
+      load(as, RAX, R12, code[1] * 8);
+      emitPush(as, RAX);
+      break;
+    case OP_SET_LOCAL:
+      load(as, RAX, RBX, -8);
+      store(as, R12, code[1] * 8, RAX);
+      break;
+    case OP_SET_LOCAL_POP:
+      load(as, RAX, RBX, -8);
+      store(as, R12, code[1] * 8, RAX);
+      addImmediate(as, RBX, -8);
+      break;
+    case OP_GET_GLOBAL: {
+      int slot = readShort(as, as->offset + 1);
+      loadGlobals(as, RCX);
+      load(as, RAX, RCX, slot * 8);
+      loadImmediate(as, RDX, CREATE_UNDEFINED_VALUE());
+      alu(as, 0x39, RAX, RDX);
+      bailIf(as, CC_E);
+      emitPush(as, RAX);
+      break;
+    }
+    case OP_SET_GLOBAL: {
+      int slot = readShort(as, as->offset + 1);
+      loadGlobals(as, RCX);
+      load(as, RAX, RCX, slot * 8);
+      loadImmediate(as, RDX, CREATE_UNDEFINED_VALUE());
+      alu(as, 0x39, RAX, RDX);
+      bailIf(as, CC_E);
+      load(as, RAX, RBX, -8);
+      store(as, RCX, slot * 8, RAX);
+      break;
+    }
+    case OP_DEFINE_GLOBAL: {
+      int slot = readShort(as, as->offset + 1);
+      loadGlobals(as, RCX);
+      load(as, RAX, RBX, -8);
+      store(as, RCX, slot * 8, RAX);
+      addImmediate(as, RBX, -8);
+      break;
+    }
+    case OP_GET_UPVALUE:
+      loadUpvalue(as, code[1]);
+      load(as, RAX, RAX, 0);
+      emitPush(as, RAX);
+      break;
+    case OP_SET_UPVALUE:
+      load(as, RDI, R14, offsetof(CallFrame, closure));
+      load(as, RDI, RDI, offsetof(ObjectClosure, upvalues));
+      load(as, RDI, RDI, code[1] * (int)sizeof(ObjectUpvalue *));
+      load(as, RSI, RBX, -8);
+      emitCall(as, jitSetUpvalue);
+      break;
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_GET_PROPERTY: {
+      bool local = code[0] == OP_GET_LOCAL_PROPERTY;
+      if (local) {
+        load(as, RAX, R12, code[1] * 8);
+        emitPush(as, RAX);
+      }
+      InlineCache *cache = cacheOperand(as, length);
+      int done = cachedFieldRead(as, cache);
+      // Nothing changes when the helper fails, the interpreter redoes it
+      syncState(as, next);
+      loadPointer(as, RDI, AS_STRING(constants[code[local ? 2 : 1]]));
+      loadPointer(as, RSI, cache);
+      emitCall(as, tryGetProperty);
+      testResult(as);
+      if (local) {
+        int found = jumpIf(as, CC_NE);
+        addImmediate(as, RBX, -8);
+        bail(as);
+        patchHere(as, found);
+      } else {
+        bailIf(as, CC_E);
+      }
+      patchHere(as, done);
+      break;
+    }
+    case OP_SET_PROPERTY:
+      syncState(as, next);
+      loadPointer(as, RDI, AS_STRING(constants[code[1]]));
+      loadPointer(as, RSI, cacheOperand(as, length));
+      emitCall(as, trySetProperty);
+      testResult(as);
+      bailIf(as, CC_E);
+      addImmediate(as, RBX, -8);
+      break;
+    case OP_EQUAL:
+      load(as, RDI, RBX, -16);
+      load(as, RSI, RBX, -8);
+      emitCall(as, valuesEqual);
+      booleanFromFlag(as);
+      replaceOperands(as);
+      break;
+    case OP_GREATER:
+      binaryOperands(as);
+      compare(as, false);
+      break;
+    case OP_LESS:
+    case OP_LESS_NUM:
+      binaryOperands(as);
+      compare(as, true);
+      break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      add(as);
+      break;
+    case OP_SUBTRACT:
+      binaryOperands(as);
+      arithmetic(as, 0x5C);
+      replaceOperands(as);
+      break;
+    case OP_MULTIPLY:
+      binaryOperands(as);
+      arithmetic(as, 0x59);
+      replaceOperands(as);
+      break;
+    case OP_DIVIDE:
+      binaryOperands(as);
+      arithmetic(as, 0x5E);
+      replaceOperands(as);
+      break;
+    case OP_NOT:
+      load(as, RDI, RBX, -8);
+      emitCall(as, isFalsey);
+      booleanFromFlag(as);
+      store(as, RBX, -8, RAX);
+      break;
+    case OP_NEGATE:
+      load(as, RAX, RBX, -8);
+      checkNumber(as, RAX);
+      loadImmediate(as, RCX, SIGN_BIT);
+      alu(as, 0x31, RAX, RCX); // xor
+      store(as, RBX, -8, RAX);
+      break;
+    case OP_PRINT:
+      load(as, RDI, RBX, -8);
+      emitCall(as, jitPrint);
+      addImmediate(as, RBX, -8);
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      addFixup(&as->jumps, jump(as), jumpTarget(byteChunk, as->offset));
+      break;
+    case OP_JUMP_IF_FALSE:
+      load(as, RDI, RBX, -8);
+      emitCall(as, isFalsey);
+      testResult(as);
+      jumpTo(as, CC_NE, jumpTarget(byteChunk, as->offset));
+      break;
+    case OP_CALL:
+    case OP_CALL_CLOSURE:
+    case OP_CALL_NATIVE:
+    case OP_TAIL_CALL:
+      syncState(as, next);
+      emit8(as, 0xBF); // mov edi, imm32
+      emit32(as, code[1]);
+      emitCall(as, code[0] == OP_TAIL_CALL ? jitTailCall : jitCallValue);
+      leaveUnlessNext(as);
+      reloadStack(as);
+      break;
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+      syncState(as, next);
+      loadPointer(as, RDI, AS_STRING(constants[code[1]]));
+      emit8(as, 0xBE); // mov esi, imm32
+      emit32(as, code[2]);
+      loadPointer(as, RDX, cacheOperand(as, length));
+      emitCall(as, code[0] == OP_INVOKE ? jitInvoke : jitTailInvoke);
+      leaveUnlessNext(as);
+      reloadStack(as);
+      break;
+    case OP_JUMP_IF_NOT_LESS:
+      compareJump(as, true, false);
+      break;
+    case OP_JUMP_IF_NOT_GREATER:
+      compareJump(as, false, false);
+      break;
+    case OP_JUMP_IF_LESS:
+      compareJump(as, true, true);
+      break;
+    case OP_JUMP_IF_GREATER:
+      compareJump(as, false, true);
+      break;
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_ADD_LOCAL_LOCAL:
+      load(as, RAX, R12, code[1] * 8);
+      if (code[0] == OP_ADD_LOCAL_LOCAL)
+        load(as, RCX, R12, code[2] * 8);
+      else
+        loadImmediate(as, RCX, constants[code[2]]);
+      // Strings and errors take the interpreter's path
+      numberOperands(as);
+      arithmetic(as, code[0] == OP_SUBTRACT_LOCAL_CONSTANT ? 0x5C : 0x58);
+      emitPush(as, RAX);
+      break;
+    case OP_RETURN: {
+      // The script's own return ends the run, the interpreter does that
+      if (as->function->name == NULL) {
+        bail(as);
+        break;
+      }
+      loadPointer(as, RAX, &vm.openUpvalues);
+      load(as, RAX, RAX, 0);
+      alu(as, 0x85, RAX, RAX); // test
+      int closed = jumpIf(as, CC_E);
+      alu(as, 0x89, RDI, R12);
+      emitCall(as, closeUpvalues);
+      patchHere(as, closed);
+      loadPointer(as, RAX, &vm.frameCount);
+      emit8(as, 0xFF);
+      emit8(as, 0x08); // dec dword [rax]
+      // The result replaces the callee and its arguments
+      load(as, RAX, RBX, -8);
+      store(as, R12, 0, RAX);
+      alu(as, 0x89, RBX, R12);
+      addImmediate(as, RBX, 8);
+      loadPointer(as, RAX, &vm.stackTop);
+      store(as, RAX, 0, RBX);
+      emit8(as, 0xB8); // mov eax, imm32
+      emit32(as, JIT_RETURN);
+      patch(as, jump(as), as->epilogue);
+      break;
+    }
+    default:
+      // Closures, classes and super calls
+      bail(as);
+      break;
+  }
+}
+
+static void emitPrologue(Assembler *as) {
+  static const uint8_t prologue[] = {
+      0x55,             // push rbp
+      0x48, 0x89, 0xE5, // mov rbp, rsp
+      0x53,             // push rbx
+      0x41, 0x54,       // push r12
+      0x41, 0x55,       // push r13
+      0x41, 0x56,       // push r14
+      0x41, 0x57,       // push r15
+      0x48, 0x83, 0xEC, 0x08, // sub rsp, 8 (keeps calls 16-byte aligned)
+  };
+  for (size_t i = 0; i < sizeof(prologue); i++)
+    emit8(as, prologue[i]);
+
+  alu(as, 0x89, R14, RDI);
+  alu(as, 0x89, RBX, RSI);
+  load(as, R12, R14, offsetof(CallFrame, slots));
+  loadImmediate(as, R13, QNAN);
+  emit8(as, 0xFF);
+  emit8(as, 0xE2); // jmp rdx
+
+  // Bail stubs land here with the bytecode address in rax
+  as->bailExit = as->count;
+  store(as, R14, offsetof(CallFrame, ip), RAX);
+  loadPointer(as, RAX, &vm.stackTop);
+  store(as, RAX, 0, RBX);
+  emit8(as, 0xB8); // mov eax, imm32
+  emit32(as, JIT_BAIL);
+
+  // Leaves with the status in eax
+  as->epilogue = as->count;
+  static const uint8_t epilogue[] = {
+      0x48, 0x83, 0xC4, 0x08, // add rsp, 8
+      0x41, 0x5F,             // pop r15
+      0x41, 0x5E,             // pop r14
+      0x41, 0x5D,             // pop r13
+      0x41, 0x5C,             // pop r12
+      0x5B,                   // pop rbx
+      0x5D,                   // pop rbp
+      0xC3,                   // ret
+  };
+  for (size_t i = 0; i < sizeof(epilogue); i++)
+    emit8(as, epilogue[i]);
+}
+
+static void emitBailStubs(Assembler *as) {
+  int *stubs = growBuffer(NULL, sizeof(int) * as->byteChunk->count);
+  for (int i = 0; i < as->byteChunk->count; i++)
+    stubs[i] = -1;
+
+  for (int i = 0; i < as->bails.count; i++) {
+    Fixup *fixup = &as->bails.fixups[i];
+    if (stubs[fixup->target] == -1) {
+      stubs[fixup->target] = as->count;
+      loadPointer(as, RAX, bytecodeAt(as, fixup->target));
+      patch(as, jump(as), as->bailExit);
+    }
+    patch(as, fixup->position, stubs[fixup->target]);
+  }
+  free(stubs);
+}
+
+static void freeAssembler(Assembler *as) {
+  free(as->code);
+  free(as->entries);
+  free(as->jumps.fixups);
+  free(as->bails.fixups);
+}
+
+bool jitSupported() { return true; }
+
+bool jitCompile(ObjectFunction *function) {
+  // Register code has frames of its own layout
+  if (function->registerCount != 0)
+    return false;
+
+  ByteChunk *byteChunk = &function->byteChunk;
+  Assembler as = {0};
+  as.function = function;
+  as.byteChunk = byteChunk;
+  as.entries = growBuffer(NULL, sizeof(int) * byteChunk->count);
+  for (int i = 0; i < byteChunk->count; i++)
+    as.entries[i] = -1;
+
+  emitPrologue(&as);
+  for (int offset = 0; offset < byteChunk->count;) {
+    int length = instructionLength(byteChunk, offset);
+    as.offset = offset;
+    as.entries[offset] = as.count;
+    compileInstruction(&as, length);
+    offset += length;
+  }
+  emitBailStubs(&as);
+  for (int i = 0; i < as.jumps.count; i++) {
+    Fixup *fixup = &as.jumps.fixups[i];
+    patch(&as, fixup->position, as.entries[fixup->target]);
+  }
+
+  // Written while writable, executable only once finished
+  size_t size = as.count;
+  uint8_t *code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    freeAssembler(&as);
+    return false;
+  }
+  memcpy(code, as.code, size);
+  if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, size);
+    freeAssembler(&as);
+    return false;
+  }
+
+  JitCode *jit = growBuffer(NULL, sizeof(JitCode));
+  jit->code = code;
+  jit->size = size;
+  jit->entries = as.entries;
+  as.entries = NULL;
+  freeAssembler(&as);
+  function->jitCode = jit;
+
+#ifdef DEBUG_LOG_JIT
+  printf("-- jit: compiled %s, %d bytes of bytecode to %zu bytes\n",
+         function->name != NULL ? function->name->chars : "<script>",
+         byteChunk->count, size);
+#endif
+  return true;
+}
+
+bool jitRun() {
+  // Nothing is nested yet, even after a stack overflow jumped out of it
+  nesting = 0;
+  for (;;) {
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    if (!isCompiled(frame->closure->function))
+      return true;
+
+    switch (enter(frame)) {
+      case JIT_BAIL:
+        return true;
+      case JIT_ERROR:
+        return false;
+      default:
+        break; // Try the callee or the caller that is now on top
+    }
+  }
+}
+
+void jitFree(ObjectFunction *function) {
+  JitCode *jit = function->jitCode;
+  if (jit == NULL)
+    return;
+  munmap(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+  function->jitCode = NULL;
+}
+
+#else
+
+bool jitSupported() { return false; }
+
+bool jitCompile(ObjectFunction *function) { return false; }
+
+bool jitRun() { return true; }
+
+void jitFree(ObjectFunction *function) {}
+
+#endif /* JIT_SUPPORTED */
@@ -0,0 +1,28 @@
+#ifndef MEKVM_JIT_H
+#define MEKVM_JIT_H
+
+#include "common.h"
+#include "object.h"
+
+// Calls and loop iterations a function runs interpreted before it is compiled
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif /* JIT_THRESHOLD */
+
+// Compiled calls that run nested on the C stack before deeper ones go back
+// through jitRun()
+#define JIT_MAX_NESTING 1024
+
+// Native code for one function, entered at any instruction boundary
+typedef struct JitCode {
+  uint8_t *code;
+  size_t size;
+  int *entries; // Native offset of each bytecode offset, -1 inside operands
+} JitCode;
+
+bool jitSupported();
+bool jitCompile(ObjectFunction *function);
+bool jitRun();
+void jitFree(ObjectFunction *function);
+
+#endif /* MEKVM_JIT_H */
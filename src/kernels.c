@@ -0,0 +1,329 @@
+#include "kernels.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif /* __x86_64__ && __GNUC__ */
+
+// The scalar loops also finish the elements left over after the vector loops
+
+static double sumScalar(const double *values, int start, int count) {
+  double sum = 0;
+  for (int i = start; i < count; i++) {
+    sum += values[i];
+  }
+  return sum;
+}
+
+static double dotScalar(const double *a, const double *b, int start,
+                        int count) {
+  double sum = 0;
+  for (int i = start; i < count; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+static void scaleScalar(double *values, int start, int count, double factor) {
+  for (int i = start; i < count; i++) {
+    values[i] *= factor;
+  }
+}
+
+static void addScalar(double *a, const double *b, int start, int count) {
+  for (int i = start; i < count; i++) {
+    a[i] += b[i];
+  }
+}
+
+static double minScalar(const double *values, int start, int count,
+                        double min) {
+  for (int i = start; i < count; i++) {
+    if (values[i] < min)
+      min = values[i];
+    else if (values[i] != values[i])
+      return values[i];
+  }
+  return min;
+}
+
+static double maxScalar(const double *values, int start, int count,
+                        double max) {
+  for (int i = start; i < count; i++) {
+    if (values[i] > max)
+      max = values[i];
+    else if (values[i] != values[i])
+      return values[i];
+  }
+  return max;
+}
+
+static void prefixSumScalar(double *values, int start, int count,
+                            double carry) {
+  for (int i = start; i < count; i++) {
+    carry += values[i];
+    values[i] = carry;
+  }
+}
+
+#ifdef KERNELS_X86
+
+static bool hasAvx() {
+  static int avx = -1;
+  if (avx == -1)
+    avx = __builtin_cpu_supports("avx") ? 1 : 0;
+  return avx;
+}
+
+// The vector min and max only note that a NaN went by; it is found again
+// here, so every path returns the same one
+static double firstNan(const double *values, int count) {
+  for (int i = 0; i < count; i++) {
+    if (values[i] != values[i])
+      return values[i];
+  }
+  return 0;
+}
+
+static double horizontalSum2(__m128d sum) {
+  return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+__attribute__((target("avx"))) static double horizontalSum4(__m256d sum) {
+  return horizontalSum2(
+      _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1)));
+}
+
+// Two accumulators per loop hide the latency of the additions
+
+static double sumSse2(const double *values, int count) {
+  __m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    a = _mm_add_pd(a, _mm_loadu_pd(values + i));
+    b = _mm_add_pd(b, _mm_loadu_pd(values + i + 2));
+  }
+  return horizontalSum2(_mm_add_pd(a, b)) + sumScalar(values, i, count);
+}
+
+__attribute__((target("avx"))) static double sumAvx(const double *values,
+                                                    int count) {
+  __m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    a = _mm256_add_pd(a, _mm256_loadu_pd(values + i));
+    b = _mm256_add_pd(b, _mm256_loadu_pd(values + i + 4));
+  }
+  return horizontalSum4(_mm256_add_pd(a, b)) + sumScalar(values, i, count);
+}
+
+static double dotSse2(const double *a, const double *b, int count) {
+  __m128d x = _mm_setzero_pd(), y = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    x = _mm_add_pd(x, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    y = _mm_add_pd(
+        y, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+  }
+  return horizontalSum2(_mm_add_pd(x, y)) + dotScalar(a, b, i, count);
+}
+
+__attribute__((target("avx"))) static double dotAvx(const double *a,
+                                                    const double *b,
+                                                    int count) {
+  __m256d x = _mm256_setzero_pd(), y = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    x = _mm256_add_pd(
+        x, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    y = _mm256_add_pd(y, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                       _mm256_loadu_pd(b + i + 4)));
+  }
+  return horizontalSum4(_mm256_add_pd(x, y)) + dotScalar(a, b, i, count);
+}
+
+static void scaleSse2(double *values, int count, double factor) {
+  __m128d f = _mm_set1_pd(factor);
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(values + i, _mm_mul_pd(_mm_loadu_pd(values + i), f));
+  }
+  scaleScalar(values, i, count, factor);
+}
+
+__attribute__((target("avx"))) static void scaleAvx(double *values,
+                                                    int count, double factor) {
+  __m256d f = _mm256_set1_pd(factor);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(values + i,
+                     _mm256_mul_pd(_mm256_loadu_pd(values + i), f));
+  }
+  scaleScalar(values, i, count, factor);
+}
+
+static void addSse2(double *a, const double *b, int count) {
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(a + i,
+                  _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+  addScalar(a, b, i, count);
+}
+
+__attribute__((target("avx"))) static void addAvx(double *a, const double *b,
+                                                  int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(
+        a + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+  }
+  addScalar(a, b, i, count);
+}
+
+static double minSse2(const double *values, int count) {
+  __m128d min = _mm_set1_pd(values[0]);
+  __m128d nan = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128d next = _mm_loadu_pd(values + i);
+    min = _mm_min_pd(min, next);
+    nan = _mm_or_pd(nan, _mm_cmpunord_pd(next, next));
+  }
+  if (_mm_movemask_pd(nan))
+    return firstNan(values, i);
+  min = _mm_min_sd(min, _mm_unpackhi_pd(min, min));
+  return minScalar(values, i, count, _mm_cvtsd_f64(min));
+}
+
+__attribute__((target("avx"))) static double minAvx(const double *values,
+                                                    int count) {
+  __m256d min = _mm256_set1_pd(values[0]);
+  __m256d nan = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256d next = _mm256_loadu_pd(values + i);
+    min = _mm256_min_pd(min, next);
+    nan = _mm256_or_pd(nan, _mm256_cmp_pd(next, next, _CMP_UNORD_Q));
+  }
+  if (_mm256_movemask_pd(nan))
+    return firstNan(values, i);
+  __m128d half =
+      _mm_min_pd(_mm256_castpd256_pd128(min), _mm256_extractf128_pd(min, 1));
+  half = _mm_min_sd(half, _mm_unpackhi_pd(half, half));
+  return minScalar(values, i, count, _mm_cvtsd_f64(half));
+}
+
+static double maxSse2(const double *values, int count) {
+  __m128d max = _mm_set1_pd(values[0]);
+  __m128d nan = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128d next = _mm_loadu_pd(values + i);
+    max = _mm_max_pd(max, next);
+    nan = _mm_or_pd(nan, _mm_cmpunord_pd(next, next));
+  }
+  if (_mm_movemask_pd(nan))
+    return firstNan(values, i);
+  max = _mm_max_sd(max, _mm_unpackhi_pd(max, max));
+  return maxScalar(values, i, count, _mm_cvtsd_f64(max));
+}
+
+__attribute__((target("avx"))) static double maxAvx(const double *values,
+                                                    int count) {
+  __m256d max = _mm256_set1_pd(values[0]);
+  __m256d nan = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256d next = _mm256_loadu_pd(values + i);
+    max = _mm256_max_pd(max, next);
+    nan = _mm256_or_pd(nan, _mm256_cmp_pd(next, next, _CMP_UNORD_Q));
+  }
+  if (_mm256_movemask_pd(nan))
+    return firstNan(values, i);
+  __m128d half =
+      _mm_max_pd(_mm256_castpd256_pd128(max), _mm256_extractf128_pd(max, 1));
+  half = _mm_max_sd(half, _mm_unpackhi_pd(half, half));
+  return maxScalar(values, i, count, _mm_cvtsd_f64(half));
+}
+
+// Scans each pair in a register, then adds the running total. Wider scans
+// need lane shuffles that cost more than they save, so AVX uses this too.
+static void prefixSumSse2(double *values, int count) {
+  __m128d carry = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128d pair = _mm_loadu_pd(values + i);
+    pair = _mm_add_pd(pair, _mm_unpacklo_pd(_mm_setzero_pd(), pair));
+    pair = _mm_add_pd(pair, carry);
+    _mm_storeu_pd(values + i, pair);
+    carry = _mm_unpackhi_pd(pair, pair);
+  }
+  prefixSumScalar(values, i, count, _mm_cvtsd_f64(carry));
+}
+
+double kernelSum(const double *values, int count) {
+  return hasAvx() ? sumAvx(values, count) : sumSse2(values, count);
+}
+
+double kernelDot(const double *a, const double *b, int count) {
+  return hasAvx() ? dotAvx(a, b, count) : dotSse2(a, b, count);
+}
+
+void kernelScale(double *values, int count, double factor) {
+  if (hasAvx())
+    scaleAvx(values, count, factor);
+  else
+    scaleSse2(values, count, factor);
+}
+
+void kernelAdd(double *a, const double *b, int count) {
+  if (hasAvx())
+    addAvx(a, b, count);
+  else
+    addSse2(a, b, count);
+}
+
+double kernelMin(const double *values, int count) {
+  return hasAvx() ? minAvx(values, count) : minSse2(values, count);
+}
+
+double kernelMax(const double *values, int count) {
+  return hasAvx() ? maxAvx(values, count) : maxSse2(values, count);
+}
+
+void kernelPrefixSum(double *values, int count) {
+  prefixSumSse2(values, count);
+}
+
+#else
+
+double kernelSum(const double *values, int count) {
+  return sumScalar(values, 0, count);
+}
+
+double kernelDot(const double *a, const double *b, int count) {
+  return dotScalar(a, b, 0, count);
+}
+
+void kernelScale(double *values, int count, double factor) {
+  scaleScalar(values, 0, count, factor);
+}
+
+void kernelAdd(double *a, const double *b, int count) {
+  addScalar(a, b, 0, count);
+}
+
+double kernelMin(const double *values, int count) {
+  return minScalar(values, 0, count, values[0]);
+}
+
+double kernelMax(const double *values, int count) {
+  return maxScalar(values, 0, count, values[0]);
+}
+
+void kernelPrefixSum(double *values, int count) {
+  prefixSumScalar(values, 0, count, 0);
+}
+
+#endif /* KERNELS_X86 */
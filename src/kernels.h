@@ -0,0 +1,25 @@
+#ifndef MEKVM_KERNELS_H
+#define MEKVM_KERNELS_H
+
+#include "common.h"
+
+/*
+ * Bulk operations on unboxed doubles, behind the Float64Array natives. On
+ * x86-64 they run on AVX when the CPU has it and on SSE2 otherwise; other
+ * targets get plain loops. Sums and dot products accumulate in several
+ * lanes, so their rounding may differ from a left-to-right loop.
+ */
+
+double kernelSum(const double *values, int count);
+double kernelDot(const double *a, const double *b, int count);
+void kernelScale(double *values, int count, double factor);
+// a[i] += b[i]
+void kernelAdd(double *a, const double *b, int count);
+// Both need at least one value. A NaN anywhere makes the result NaN, the
+// first one in values, whichever path runs.
+double kernelMin(const double *values, int count);
+double kernelMax(const double *values, int count);
+// values[i] becomes the sum of values[0] .. values[i]
+void kernelPrefixSum(double *values, int count);
+
+#endif /* MEKVM_KERNELS_H */
@@ -4,6 +4,9 @@
 
 #include "bytechunk.h"
 #include "debug.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 static void repl() {
@@ -60,18 +63,79 @@ static void runFile(const char *path) {
     exit(70);
 }
 
+static void usage() {
+  fprintf(stderr, "Usage: mkv [--register | --jit] [--max-frames=N] "
+                  "[--max-stack=N] [--hash-seed=N] [--gc-slice[=N]] "
+                  "[--gc-stats] [path]\n");
+  exit(64);
+}
+
+// Parses the N of a --name=N option, which has to be positive
+static int limitOption(const char *arg, const char *name) {
+  char *end;
+  long limit = strtol(arg + strlen(name), &end, 10);
+  if (*end != '\0' || limit <= 0 || limit > INT32_MAX)
+    usage();
+  return (int)limit;
+}
+
 int main(int argc, const char *argv[]) {
-  initVirtualMachine();
+  bool registerBackend = false;
+  bool jitEnabled = false;
+  int frameMax = FRAMES_MAX;
+  int stackMax = STACK_MAX;
+  int gcSliceWork = 0;
+  bool gcStats = false;
+  uint64_t hashSeed = randomHashSeed();
+
+  const char *path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--register") == 0) {
+      registerBackend = true;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      jitEnabled = true;
+    } else if (strcmp(argv[i], "--no-jit") == 0) {
+      jitEnabled = false;
+    } else if (strncmp(argv[i], "--max-frames=", 13) == 0) {
+      frameMax = limitOption(argv[i], "--max-frames=");
+    } else if (strncmp(argv[i], "--max-stack=", 12) == 0) {
+      stackMax = limitOption(argv[i], "--max-stack=");
+    } else if (strcmp(argv[i], "--gc-slice") == 0) {
+      gcSliceWork = GC_SLICE_WORK;
+    } else if (strncmp(argv[i], "--gc-slice=", 11) == 0) {
+      gcSliceWork = limitOption(argv[i], "--gc-slice=");
+    } else if (strcmp(argv[i], "--gc-stats") == 0) {
+      gcStats = true;
+    } else if (strncmp(argv[i], "--hash-seed=", 12) == 0) {
+      char *end;
+      hashSeed = strtoull(argv[i] + 12, &end, 10);
+      if (*end != '\0' || end == argv[i] + 12)
+        usage();
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      usage();
+    }
+  }
+
+  seedStringHash(hashSeed);
+  initVirtualMachine(frameMax, stackMax);
+  vm.registerBackend = registerBackend;
+  vm.jitEnabled = jitEnabled;
+  vm.gcSliceWork = gcSliceWork;
+  if (vm.jitEnabled && !jitSupported()) {
+    fprintf(stderr, "JIT compilation is not supported on this platform.\n");
+    vm.jitEnabled = false;
+  }
 
-  if (argc == 1) {
+  if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: mkv [path]\n");
-    exit(64);
+    runFile(path);
   }
 
+  if (gcStats)
+    printGcStats();
   freeVirtualMachine();
   return 0;
 }
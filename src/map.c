@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+void initMap(Map *map) {
+  map->count = 0;
+  map->tombstones = 0;
+  map->capacity = 0;
+  map->entries = NULL;
+}
+
+void freeMap(Map *map) {
+  FREE_ARRAY(MapEntry, map->entries, map->capacity);
+  initMap(map);
+}
+
+// Spreads the bits of numbers and pointers, whose low bits barely change
+static uint32_t mixBits(uint64_t bits) {
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+static uint32_t hashValue(Value key) {
+  if (IS_STRING(key))
+    return stringHash(AS_STRING(key));
+  if (IS_NUMBER(key)) {
+    // 0 and -0 are equal, so they need the same hash
+    double number = AS_NUMBER(key) == 0 ? 0 : AS_NUMBER(key);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return mixBits(bits);
+  }
+  if (IS_OBJECT(key))
+    return mixBits((uint64_t)(uintptr_t)AS_OBJECT(key));
+  if (IS_BOOLEAN(key))
+    return AS_BOOLEAN(key) ? 3 : 2;
+  return 1; // nah
+}
+
+static MapEntry *findEntry(MapEntry *entries, int capacity, Value key) {
+  uint32_t index = hashValue(key) & (capacity - 1);
+  MapEntry *tombstone = NULL;
+
+  for (;;) {
+    MapEntry *entry = &entries[index];
+    if (IS_UNDEFINED(entry->key)) {
+      if (IS_NAH(entry->value)) {
+        // Empty entry
+        return tombstone != NULL ? tombstone : entry;
+      } else {
+        if (tombstone == NULL)
+          tombstone = entry;
+      }
+    } else if (valuesEqual(entry->key, key)) {
+      return entry;
+    }
+    // Wrapping
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void adjustCapacity(Map *map, int capacity) {
+  MapEntry *entries = ALLOCATE(MapEntry, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = CREATE_UNDEFINED_VALUE();
+    entries[i].value = CREATE_NAH_VALUE();
+  }
+
+  // Rehashing leaves the tombstones behind
+  for (int i = 0; i < map->capacity; i++) {
+    MapEntry *entry = &map->entries[i];
+    if (IS_UNDEFINED(entry->key))
+      continue;
+
+    MapEntry *dest = findEntry(entries, capacity, entry->key);
+    dest->key = entry->key;
+    dest->value = entry->value;
+  }
+
+  FREE_ARRAY(MapEntry, map->entries, map->capacity);
+  map->entries = entries;
+  map->capacity = capacity;
+  map->tombstones = 0;
+}
+
+void mapReserve(Map *map, int count) {
+  if (count + map->tombstones <= map->capacity * MAP_MAX_LOAD)
+    return;
+
+  // Tombstones never count toward the size, so churn cannot grow the map
+  int capacity = map->capacity;
+  while (count > capacity * MAP_MAX_LOAD) {
+    capacity = GROW_CAPACITY(capacity);
+  }
+  // Clearing out tombstones is enough while the map is half full
+  if (capacity == map->capacity && count > capacity * MAP_MAX_LOAD / 2)
+    capacity = GROW_CAPACITY(capacity);
+  adjustCapacity(map, capacity);
+}
+
+bool mapGet(Map *map, Value key, Value *value) {
+  if (map->count == 0)
+    return false;
+
+  MapEntry *entry = findEntry(map->entries, map->capacity, key);
+  if (IS_UNDEFINED(entry->key))
+    return false;
+
+  *value = entry->value;
+  return true;
+}
+
+bool mapSet(Map *map, Value key, Value value) {
+  if (map->capacity == 0)
+    mapReserve(map, 1);
+
+  MapEntry *entry = findEntry(map->entries, map->capacity, key);
+  bool isNewKey = IS_UNDEFINED(entry->key);
+  // Overwriting a key or reusing a tombstone leaves the load unchanged
+  if (isNewKey && IS_NAH(entry->value) &&
+      map->count + map->tombstones + 1 > map->capacity * MAP_MAX_LOAD) {
+    mapReserve(map, map->count + 1);
+    entry = findEntry(map->entries, map->capacity, key);
+  }
+  if (isNewKey) {
+    map->count++;
+    if (!IS_NAH(entry->value))
+      map->tombstones--;
+  }
+
+  entry->key = key;
+  entry->value = value;
+  return isNewKey;
+}
+
+bool mapDelete(Map *map, Value key) {
+  if (map->count == 0)
+    return false;
+
+  MapEntry *entry = findEntry(map->entries, map->capacity, key);
+  if (IS_UNDEFINED(entry->key))
+    return false;
+
+  // Place tombstone
+  entry->key = CREATE_UNDEFINED_VALUE();
+  entry->value = CREATE_BOOLEAN_VALUE(true);
+  map->count--;
+  map->tombstones++;
+  return true;
+}
+
+void markMap(Map *map) {
+  for (int i = 0; i < map->capacity; i++) {
+    MapEntry *entry = &map->entries[i];
+    if (IS_UNDEFINED(entry->key))
+      continue;
+    markValue(entry->key);
+    markValue(entry->value);
+  }
+}
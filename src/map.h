@@ -0,0 +1,35 @@
+#ifndef MEKVM_MAP_H
+#define MEKVM_MAP_H
+
+#include "common.h"
+#include "value.h"
+
+#define MAP_MAX_LOAD 0.75
+
+// Open addressing like Table, but any value except NaN can be a key. Strings
+// made at run time aren't interned, so strings hash and compare by contents;
+// every other object compares by identity.
+typedef struct {
+  Value key; // Undefined in empty entries and tombstones
+  Value value;
+} MapEntry;
+
+typedef struct {
+  int count;      // Live entries
+  int tombstones; // Deleted entries still taking up a slot
+  int capacity;
+  MapEntry *entries;
+} Map;
+
+void initMap(Map *map);
+void freeMap(Map *map);
+// Makes room for count entries without another resize, clearing out
+// tombstones at the same capacity when that is enough
+void mapReserve(Map *map, int count);
+bool mapGet(Map *map, Value key, Value *value);
+// Returns whether the key is new
+bool mapSet(Map *map, Value key, Value value);
+bool mapDelete(Map *map, Value key);
+void markMap(Map *map);
+
+#endif /* MEKVM_MAP_H */
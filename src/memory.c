@@ -1,6 +1,10 @@
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "bytechunk.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
@@ -8,21 +12,40 @@
 
 #ifdef DEBUG_LOG_GC
 #include "debug.h"
-#include <stdio.h>
 #endif /* DEBUG_LOG_GC */
 
 #define GC_HEAP_GROWTH_FACTOR 2
+// Work units for freeing an object in a sweep, against one for keeping it
+#define GC_SWEEP_FREE_COST 8
+
+static void beginCycle();
+static void collectStep();
+static void collectSlice(int budget);
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   vm.bytesAllocated += (newSize - oldSize);
   if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
+    // Minor collections and tiny slices, which are the ones that need the
+    // barriers
+    static int stressCount = 0;
+    if (vm.gcPhase != GC_IDLE)
+      collectSlice(16);
+    else if (++stressCount % 8 == 0)
+      beginCycle();
+    else
+      collectNursery();
 #endif /* DEBUG_STRESS_GC */
-  }
 
-  if (vm.bytesAllocated > vm.gcThreshold) {
-    collectGarbage();
+    vm.nurseryBytes += newSize - oldSize;
+    if (vm.gcPhase != GC_IDLE) {
+      if (vm.nurseryBytes > GC_SLICE_BYTES)
+        collectStep();
+    } else if (vm.bytesAllocated > vm.gcThreshold) {
+      collectStep();
+    } else if (vm.nurseryBytes > vm.nurserySize) {
+      collectNursery();
+    }
   }
 
   if (newSize == 0) {
@@ -38,19 +61,27 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
-void markObject(Object *object) {
-  if (object == NULL || object->isMarked)
+// Set during a minor collection, which leaves old objects alone
+static bool collectingNursery = false;
+
+void rememberObject(Object *object) {
+  if (!(object->isOld || object->isMarked) || object->isRemembered)
     return;
+  object->isRemembered = true;
 
-#ifdef DEBUG_LOG_GC
-  // Log the object being marked
-  printf("%p mark ", (void *)object);
-  printValue(CREATE_OBJECT_VALUE(object));
-  printf("\n");
-#endif /* DEBUG_LOG_GC */
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.remembered = (Object **)realloc(
+        vm.remembered, sizeof(Object *) * vm.rememberedCapacity);
 
-  object->isMarked = true;
+    if (vm.remembered == NULL)
+      exit(1);
+  }
+
+  vm.remembered[vm.rememberedCount++] = object;
+}
 
+static void pushGray(Object *object) {
   if (vm.grayCapacity < vm.grayCount + 1) {
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
     vm.grayStack =
@@ -63,6 +94,34 @@ void markObject(Object *object) {
   vm.grayStack[vm.grayCount++] = object;
 }
 
+void writeBarrierBack(Object *owner) {
+  rememberObject(owner);
+  // Scanning it again is simpler than finding what changed
+  if (vm.gcPhase == GC_MARK && owner->isMarked)
+    pushGray(owner);
+}
+
+void markObject(Object *object) {
+  if (object == NULL || object->isMarked)
+    return;
+  if (collectingNursery && object->isOld)
+    return;
+
+#ifdef DEBUG_LOG_GC
+  // Log the object being marked
+  printf("%p mark ", (void *)object);
+  printValue(CREATE_OBJECT_VALUE(object));
+  printf("\n");
+#endif /* DEBUG_LOG_GC */
+
+  object->isMarked = true;
+  // Numeric arrays are leaves, however large they are
+  if (object->type == OBJECT_FLOAT64_ARRAY)
+    return;
+
+  pushGray(object);
+}
+
 static void freeObject(Object *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void *)object, object->type);
@@ -74,7 +133,7 @@ static void freeObject(Object *object) {
     }
     case OBJECT_CLASS: {
       ObjectClass *klass = (ObjectClass *)object;
-      freeTable(&klass->methods);
+      freeValueArray(&klass->methods);
       FREE(ObjectClass, object);
       break;
     }
@@ -91,6 +150,7 @@ static void freeObject(Object *object) {
     case OBJECT_FUNCTION: {
       ObjectFunction *function = (ObjectFunction *)object;
       freeByteChunk(&function->byteChunk);
+      jitFree(function);
       FREE(ObjectFunction, object);
       break;
     }
@@ -98,15 +158,47 @@ static void freeObject(Object *object) {
       FREE(ObjectNativeFunction, object);
       break;
     }
+    case OBJECT_FLOAT64_ARRAY: {
+      ObjectFloat64Array *array = (ObjectFloat64Array *)object;
+      FREE_ARRAY(double, array->values, array->count);
+      FREE(ObjectFloat64Array, object);
+      break;
+    }
+    case OBJECT_LIST: {
+      freeValueArray(&((ObjectList *)object)->items);
+      FREE(ObjectList, object);
+      break;
+    }
+    case OBJECT_MAP: {
+      freeMap(&((ObjectMap *)object)->table);
+      FREE(ObjectMap, object);
+      break;
+    }
     case OBJECT_INSTANCE: {
       ObjectInstance *instance = (ObjectInstance *)object;
-      freeTable(&instance->fields);
+      FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+      if (instance->dictionary != NULL) {
+        freeTable(instance->dictionary);
+        FREE(Table, instance->dictionary);
+      }
       FREE(ObjectInstance, object);
       break;
     }
+    case OBJECT_SHAPE: {
+      ObjectShape *shape = (ObjectShape *)object;
+      FREE_ARRAY(ObjectString *, shape->keys, shape->fieldCount);
+      freeTable(&shape->transitions);
+      FREE(ObjectShape, object);
+      break;
+    }
     case OBJECT_STRING: {
       ObjectString *string = (ObjectString *)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
+      if (string->chars == STRING_INLINE_CHARS(string)) {
+        reallocate(object, sizeof(ObjectString) + string->length + 1, 0);
+        break;
+      }
+      if (string->chars != NULL)
+        FREE_ARRAY(char, string->chars, string->length + 1);
       FREE(ObjectString, object);
       break;
     }
@@ -124,7 +216,20 @@ static void markArray(ValueArray *array) {
   }
 }
 
-static void blackenObject(Object *object) {
+// Cached shapes and methods stay alive as long as the code caching them
+static void markInlineCaches(ByteChunk *byteChunk) {
+  for (int i = 0; i < byteChunk->cacheCount; i++) {
+    InlineCache *cache = &byteChunk->caches[i];
+    for (int j = 0; j < cache->entryCount; j++) {
+      markObject((Object *)cache->entries[j].shape);
+      markObject((Object *)cache->entries[j].transition);
+      markValue(cache->entries[j].method);
+    }
+  }
+}
+
+// Returns the work done, one unit for the object and one per reference
+static int blackenObject(Object *object) {
 #ifdef DEBUG_LOG_GC
 
   printf("%p blacken ", (void *)object);
@@ -137,13 +242,15 @@ static void blackenObject(Object *object) {
       ObjectBoundMethod *boundMethod = (ObjectBoundMethod *)object;
       markValue(boundMethod->receiver);
       markObject((Object *)boundMethod->method);
-      break;
+      return 3;
     }
     case OBJECT_CLASS: {
       ObjectClass *klass = (ObjectClass *)object;
       markObject((Object *)klass->name);
-      markTable(&klass->methods);
-      break;
+      markArray(&klass->methods);
+      markObject((Object *)klass->rootShape);
+      markObject((Object *)klass->initializer);
+      return 4 + klass->methods.count;
     }
     case OBJECT_CLOSURE: {
       ObjectClosure *closure = (ObjectClosure *)object;
@@ -151,27 +258,62 @@ static void blackenObject(Object *object) {
       for (int i = 0; i < closure->upvalueCount; i++) {
         markObject((Object *)closure->upvalues[i]);
       }
-      break;
+      return 2 + closure->upvalueCount;
     }
     case OBJECT_FUNCTION: {
       ObjectFunction *function = (ObjectFunction *)object;
       markObject((Object *)function->name);
       markArray(&function->byteChunk.constants);
-      break;
+      markInlineCaches(&function->byteChunk);
+      return 2 + function->byteChunk.constants.count +
+             function->byteChunk.cacheCount;
     }
     case OBJECT_UPVALUE:
       markValue(((ObjectUpvalue *)object)->closed);
-      break;
+      return 2;
     case OBJECT_INSTANCE: {
       ObjectInstance *instance = (ObjectInstance *)object;
       markObject((Object *)instance->klass);
-      markTable(&instance->fields);
-      break;
+      markObject((Object *)instance->boundMethod);
+      if (instance->shape != NULL) {
+        markObject((Object *)instance->shape);
+        for (int i = 0; i < instance->shape->fieldCount; i++) {
+          markValue(instance->fields[i]);
+        }
+        return 4 + instance->shape->fieldCount;
+      }
+      markTable(instance->dictionary);
+      return 3 + instance->dictionary->capacity;
+    }
+    case OBJECT_SHAPE: {
+      ObjectShape *shape = (ObjectShape *)object;
+      markObject((Object *)shape->parent);
+      for (int i = 0; i < shape->fieldCount; i++) {
+        markObject((Object *)shape->keys[i]);
+      }
+      markTable(&shape->transitions);
+      return 2 + shape->fieldCount + shape->transitions.capacity;
     }
     case OBJECT_NATIVE_FUNCTION:
-    case OBJECT_STRING:
+      markObject((Object *)((ObjectNativeFunction *)object)->name);
+      return 2;
+    case OBJECT_LIST:
+      markArray(&((ObjectList *)object)->items);
+      return 1 + ((ObjectList *)object)->items.count;
+    case OBJECT_MAP:
+      markMap(&((ObjectMap *)object)->table);
+      return 1 + ((ObjectMap *)object)->table.capacity;
+    case OBJECT_STRING: {
+      // Only ropes that haven't been flattened refer to other strings
+      ObjectString *string = (ObjectString *)object;
+      markObject((Object *)string->left);
+      markObject((Object *)string->right);
+      return 3;
+    }
+    case OBJECT_FLOAT64_ARRAY:
       break;
   }
+  return 1;
 }
 
 static void markRoots() {
@@ -179,7 +321,10 @@ static void markRoots() {
     markValue(*slot);
   }
 
-  markTable(&vm.globals);
+  markTable(&vm.globalSlots);
+  markArray(&vm.globalNames);
+  markArray(&vm.globalValues);
+  markArray(&vm.selectorNames);
 
   for (int i = 0; i < vm.frameCount; i++) {
     markObject((Object *)vm.frames[i].closure);
@@ -196,18 +341,27 @@ static void markRoots() {
 
 static void traceReferences() {
   while (vm.grayCount > 0) {
-    Object *object = vm.grayStack[--vm.grayCount];
-    blackenObject(object);
+    blackenObject(vm.grayStack[--vm.grayCount]);
   }
 }
 
-static void sweep() {
+// The intern set holds its strings weakly, each leaves it as it is freed
+static void freeUnreached(Object *object) {
+  if (object->type == OBJECT_STRING && ((ObjectString *)object)->interned)
+    stringSetRemove(&vm.strings, (ObjectString *)object);
+  freeObject(object);
+}
+
+// Frees the unmarked objects in the list up to end, and unmarks and
+// promotes the others
+static void sweep(Object *end) {
   Object *previous = NULL;
   Object *object = vm.objects;
-  while (object != NULL) {
+  while (object != end) {
     if (object->isMarked) {
       // Unmark and continue on
       object->isMarked = false;
+      object->isOld = true;
       previous = object;
       object = object->next;
     } else {
@@ -219,39 +373,230 @@ static void sweep() {
         vm.objects = object;
       }
 
-      freeObject(unreached);
+      freeUnreached(unreached);
     }
   }
+  // Everything left is old, new objects go in front of it
+  vm.oldObjects = vm.objects;
 }
 
-void collectGarbage() {
+// No old object refers to a young one once the nursery is empty
+static void forgetRemembered() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+  }
+  vm.rememberedCount = 0;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void recordPause(double start) {
+  double pause = now() - start;
+  vm.gcPauses++;
+  vm.gcPauseTotal += pause;
+  if (pause > vm.gcPauseMax)
+    vm.gcPauseMax = pause;
+}
+
+// Grays the roots, the rest of the cycle runs in slices
+static void beginCycle() {
 #ifdef DEBUG_LOG_GC
   printf("---- Begin Garbage Collection ----\n");
+#endif /* DEBUG_LOG_GC */
+  markRoots();
+  vm.gcPhase = GC_MARK;
+  vm.majorCollections++;
+}
+
+// Runs the work owed for the allocation since the last slice
+static void collectStep() {
+  double start = now();
+  if (vm.gcPhase == GC_IDLE) {
+    beginCycle();
+    // Without --gc-slice the whole cycle runs in this pause
+    if (vm.gcSliceWork == 0)
+      collectSlice(INT_MAX);
+  } else if (vm.bytesAllocated > vm.gcThreshold * GC_HEAP_GROWTH_FACTOR) {
+    // The slices fell behind the allocation
+    collectSlice(INT_MAX);
+  } else {
+    collectSlice(vm.gcSliceWork);
+  }
+  vm.nurseryBytes = 0;
+  recordPause(start);
+}
+
+void collectNursery() {
+#ifdef DEBUG_LOG_GC
+  printf("---- Begin Minor Garbage Collection ----\n");
+#endif /* DEBUG_LOG_GC */
+  double start = now();
   size_t before = vm.bytesAllocated;
+
+  collectingNursery = true;
+  clearMegamorphicCache();
+  markRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    blackenObject(vm.remembered[i]);
+  }
+  forgetRemembered();
+  traceReferences();
+  // Young objects are the ones allocated in front of the old ones
+  sweep(vm.oldObjects);
+  size_t freed = before - vm.bytesAllocated;
+  stringSetCompact(&vm.strings);
+  collectingNursery = false;
+
+  if (freed * 2 < vm.nurseryBytes) {
+    if (vm.nurserySize < NURSERY_MAX_SIZE)
+      vm.nurserySize *= 2;
+  } else if (freed * 8 > vm.nurseryBytes * 7) {
+    if (vm.nurserySize > NURSERY_SIZE)
+      vm.nurserySize /= 2;
+  }
+  vm.nurseryBytes = 0;
+  vm.minorCollections++;
+  recordPause(start);
+
+#ifdef DEBUG_LOG_GC
+  printf("---- Result: Collected %zu bytes (from %zu to %zu), nursery now "
+         "%zu\n",
+         freed, before, before - freed, vm.nurserySize);
+  printf("---- End Minor Garbage Collection ----\n");
 #endif /* DEBUG_LOG_GC */
+}
+
+// The sweep of a full collection starts behind this, so objects allocated
+// meanwhile go in front of it and are left alone
+static Object sweepSentinel;
+// The last object the sweep kept
+static Object *sweepPrevious;
 
+// The roots have no barrier, so marking ends in a pause that rescans them
+static void finishMarking() {
   markRoots();
   traceReferences();
-  tableRemoveWhite(&vm.strings);
-  sweep();
+  clearMegamorphicCache();
+  // Remembered objects may be about to be freed
+  forgetRemembered();
+
+  sweepSentinel.next = vm.objects;
+  vm.objects = &sweepSentinel;
+  sweepPrevious = &sweepSentinel;
+  // Every object has the old flag now, so the unmarked ones that still do
+  // are the ones left to free
+  vm.sweepFlag = !vm.sweepFlag;
+  vm.gcPhase = GC_SWEEP;
+}
+
+// Frees unmarked objects and promotes the others until the budget runs out.
+// Returns whether the sweep reached the end of the list.
+static bool sweepSlice(int budget) {
+  while (sweepPrevious->next != NULL) {
+    if (budget <= 0)
+      return false;
+
+    Object *object = sweepPrevious->next;
+    if (object->isMarked) {
+      object->isMarked = false;
+      object->isOld = true;
+      object->sweepFlag = vm.sweepFlag;
+      sweepPrevious = object;
+      budget--;
+    } else {
+      sweepPrevious->next = object->next;
+      freeUnreached(object);
+      budget -= GC_SWEEP_FREE_COST;
+    }
+  }
+  return true;
+}
+
+static void finishSweep() {
+  // The objects allocated during the sweep are the nursery now, and the
+  // remembered set already covers them
+  Object **link = &vm.objects;
+  while (*link != &sweepSentinel) {
+    link = &(*link)->next;
+  }
+  *link = sweepSentinel.next;
+  vm.oldObjects = sweepSentinel.next;
+  vm.nurseryBytes = 0;
+  vm.gcPhase = GC_IDLE;
+  stringSetCompact(&vm.strings);
 
   vm.gcThreshold = vm.bytesAllocated * GC_HEAP_GROWTH_FACTOR;
+  // A small heap would otherwise be collected every few kilobytes
+  if (vm.gcThreshold < GC_MIN_THRESHOLD)
+    vm.gcThreshold = GC_MIN_THRESHOLD;
 
 #ifdef DEBUG_LOG_GC
-  printf("---- Result: Collected %zu bytes (from %zu to %zu) next threshold at "
-         "%zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated, vm.gcThreshold);
+  printf("---- Result: %zu bytes left, next threshold at %zu\n",
+         vm.bytesAllocated, vm.gcThreshold);
+  printf("---- Bound methods reused instead of allocated so far: %llu\n",
+         (unsigned long long)vm.boundMethodsReused);
   printf("---- End Garbage Collection ----\n");
 #endif /* DEBUG_LOG_GC */
 }
 
+// Does about budget units of work on the running cycle
+static void collectSlice(int budget) {
+  vm.gcSlices++;
+  if (vm.gcPhase == GC_MARK) {
+    while (vm.grayCount > 0 && budget > 0) {
+      budget -= blackenObject(vm.grayStack[--vm.grayCount]);
+    }
+    if (vm.grayCount > 0)
+      return;
+    finishMarking();
+  }
+
+  if (sweepSlice(budget))
+    finishSweep();
+}
+
+void collectGarbage() {
+  double start = now();
+  if (vm.gcPhase == GC_IDLE)
+    beginCycle();
+  collectSlice(INT_MAX);
+  recordPause(start);
+}
+
+void printGcStats() {
+  fprintf(stderr, "==== garbage collector ====\n");
+  fprintf(stderr, "minor collections %10llu\n",
+          (unsigned long long)vm.minorCollections);
+  fprintf(stderr, "full collections  %10llu in %llu slices\n",
+          (unsigned long long)vm.majorCollections,
+          (unsigned long long)vm.gcSlices);
+  fprintf(stderr, "pauses            %10llu\n",
+          (unsigned long long)vm.gcPauses);
+  fprintf(stderr, "total pause       %10.3f ms\n", vm.gcPauseTotal * 1e3);
+  fprintf(stderr, "longest pause     %10.3f ms\n", vm.gcPauseMax * 1e3);
+  fprintf(stderr, "bound methods reused %7llu\n",
+          (unsigned long long)vm.boundMethodsReused);
+}
+
 void freeObjects() {
+#ifdef DEBUG_LOG_GC
+  printf("---- Bound methods reused instead of allocated: %llu\n",
+         (unsigned long long)vm.boundMethodsReused);
+#endif /* DEBUG_LOG_GC */
+
   Object *object = vm.objects;
   while (object != NULL) {
     Object *next = object->next;
-    freeObject(object);
+    // A sweep may still be running
+    if (object != &sweepSentinel)
+      freeObject(object);
     object = next;
   }
 
   free(vm.grayStack);
+  free(vm.remembered);
 }
@@ -5,6 +5,62 @@
 #include "compiler.h"
 #include "value.h"
 
+// Bytes allocated before the first collection, and the least the heap may
+// grow to between collections
+#define GC_MIN_THRESHOLD (1024 * 1024)
+
+/*
+ * Objects start young and become old by surviving a collection. Nothing
+ * moves: new objects go to the front of vm.objects, so the young ones are
+ * those before vm.oldObjects. A minor collection runs once vm.nurserySize
+ * bytes have been allocated. It marks from the roots and the remembered set
+ * without entering old objects, frees the dead young ones and promotes the
+ * rest. A full collection still runs when the whole heap outgrows
+ * gcThreshold.
+ *
+ * While most of the nursery survives, minor collections only delay the
+ * promotion, so the nursery doubles up to NURSERY_MAX_SIZE. It shrinks back
+ * towards NURSERY_SIZE once they free most of it.
+ *
+ * Old objects are only scanned by a minor collection while remembered, so
+ * every store of a reference into an object that may be old goes through
+ * writeBarrier(). The stack, globals and other roots need no barrier.
+ */
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (256 * 1024)
+#endif /* NURSERY_SIZE */
+#ifndef NURSERY_MAX_SIZE
+#define NURSERY_MAX_SIZE (8 * 1024 * 1024)
+#endif /* NURSERY_MAX_SIZE */
+
+/*
+ * With --gc-slice, full collections are incremental. Otherwise each one runs
+ * in a single pause, which keeps the heap smaller and costs less in total,
+ * since minor collections never have to wait for a cycle to end.
+ *
+ * An incremental cycle starts with a pause that only grays the roots.
+ * After that, every GC_SLICE_BYTES of allocation pays for a slice of at most
+ * vm.gcSliceWork units, where scanning an object, following a reference or
+ * sweeping an object is one unit. Minor collections wait for the cycle to
+ * end.
+ *
+ * While marking, writeBarrier() grays whatever is stored into a marked
+ * object, so no black object refers to a white one. Once the gray stack is
+ * empty, one pause rescans the roots, then the sweep runs in slices as
+ * well. Dead strings stay in the intern set until it frees them, but lookups
+ * pass over them, see sweepWillFree(). The sweep promotes the marked
+ * objects, so those are remembered like old ones when a young object is
+ * stored into them. Objects allocated during the sweep stay young. If the
+ * heap doubles before the cycle ends, the rest of it runs in one pause.
+ */
+// Work per slice for --gc-slice without a number
+#ifndef GC_SLICE_WORK
+#define GC_SLICE_WORK 40000
+#endif /* GC_SLICE_WORK */
+#ifndef GC_SLICE_BYTES
+#define GC_SLICE_BYTES (64 * 1024)
+#endif /* GC_SLICE_BYTES */
+
 #define ALLOCATE(type, count)                                                  \
   (type *)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -19,9 +75,35 @@
   reallocate(pointer, sizeof(type) * oldCount, 0)
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+// Adds an old object, or a marked one the sweep will promote, to the
+// remembered set
+void rememberObject(Object *object);
+// Call after changing references in owner that writeBarrier() wasn't given
+void writeBarrierBack(Object *owner);
 void markObject(Object *object);
 void markValue(Value value);
+void collectNursery();
+// Runs a whole full collection, or the rest of the running one, in one pause
 void collectGarbage();
+void printGcStats();
 void freeObjects();
 
+// Whether the running sweep is going to free object. Objects allocated
+// during the sweep and the ones it kept carry the flipped flag.
+static inline bool sweepWillFree(Object *object) {
+  return vm.gcPhase == GC_SWEEP && !object->isMarked &&
+         object->sweepFlag != vm.sweepFlag;
+}
+
+// Call after storing value into owner
+static inline void writeBarrier(Object *owner, Value value) {
+  if (!IS_OBJECT(value))
+    return;
+  Object *object = AS_OBJECT(value);
+  if ((owner->isOld || owner->isMarked) && !object->isOld)
+    rememberObject(owner);
+  if (vm.gcPhase == GC_MARK && owner->isMarked)
+    markObject(object);
+}
+
 #endif /* MEKVM_MEMORY_H */
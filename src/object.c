@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "bytechunk.h"
 #include "memory.h"
@@ -14,6 +16,10 @@
 static Object *allocateObject(size_t size, ObjectType type) {
   Object *object = (Object *)reallocate(NULL, 0, size);
   object->type = type;
+  object->isMarked = false;
+  object->isOld = false;
+  object->isRemembered = false;
+  object->sweepFlag = vm.sweepFlag;
   object->next = vm.objects;
   vm.objects = object;
 
@@ -36,26 +42,148 @@ ObjectClosure *newClosure(ObjectFunction *function) {
   return closure;
 }
 
-static ObjectString *allocateString(char *chars, int length, uint32_t hash) {
-  ObjectString *string = ALLOCATE_OBJECT(ObjectString, OBJECT_STRING);
+// Neither hashed nor interned, with extra bytes allocated after the object
+static ObjectString *newStringObject(char *chars, int length, size_t extra) {
+  ObjectString *string = (ObjectString *)allocateObject(
+      sizeof(ObjectString) + extra, OBJECT_STRING);
   string->length = length;
   string->chars = chars;
-  string->hash = hash;
+  string->left = NULL;
+  string->right = NULL;
+  string->hash = 0;
+  string->selector = -1;
+  string->hashed = false;
+  string->interned = false;
+  return string;
+}
 
-  push(CREATE_OBJECT_VALUE(string));
-  tableSet(&vm.strings, string, CREATE_NAH_VALUE());
-  pop();
+static ObjectString *allocateString(char *chars, int length, uint32_t hash) {
+  ObjectString *string = newStringObject(chars, length, 0);
+  string->hash = hash;
+  string->hashed = true;
+  string->interned = true;
 
+  stringSetAdd(&vm.strings, string);
   return string;
 }
 
-static uint32_t hashString(const char *key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+// Hash keys, set once before the first string is made
+static uint64_t hashKey[2];
+
+void seedStringHash(uint64_t seed) {
+  // Splitmix64 stretches the seed over both halves of the key
+  for (int i = 0; i < 2; i++) {
+    seed += 0x9e3779b97f4a7c15ULL;
+    uint64_t bits = seed;
+    bits = (bits ^ (bits >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    bits = (bits ^ (bits >> 27)) * 0x94d049bb133111ebULL;
+    hashKey[i] = bits ^ (bits >> 31);
+  }
+}
+
+uint64_t randomHashSeed() {
+  uint64_t seed = 0;
+  FILE *random = fopen("/dev/urandom", "rb");
+  if (random != NULL) {
+    if (fread(&seed, sizeof(seed), 1, random) != 1)
+      seed = 0;
+    fclose(random);
+  }
+  if (seed == 0) {
+    // Weaker, but still differs between runs
+    seed = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^
+           (uint64_t)(uintptr_t)&seed;
+  }
+  return seed;
+}
+
+#define ROTATE(x, bits) (((x) << (bits)) | ((x) >> (64 - (bits))))
+
+static inline void sipRound(uint64_t v[4]) {
+  v[0] += v[1];
+  v[1] = ROTATE(v[1], 13) ^ v[0];
+  v[0] = ROTATE(v[0], 32);
+  v[2] += v[3];
+  v[3] = ROTATE(v[3], 16) ^ v[2];
+  v[0] += v[3];
+  v[3] = ROTATE(v[3], 21) ^ v[0];
+  v[2] += v[1];
+  v[1] = ROTATE(v[1], 17) ^ v[2];
+  v[2] = ROTATE(v[2], 32);
+}
+
+#ifdef __SIZEOF_INT128__
+// Folds the 128-bit product of a and b into 64 bits
+static inline uint64_t multiplyMix(uint64_t a, uint64_t b) {
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+// Identifiers and field names are mostly this short. Like wyhash, two keyed
+// 64x64-bit multiplies mix up to 16 bytes, which costs less than SipHash's
+// rounds and still leaves collisions unpredictable without the key.
+static uint32_t hashShort(const char *key, int length) {
+  uint64_t a = 0;
+  uint64_t b = 0;
+  if (length >= 8) {
+    // Two words that overlap below 16 bytes
+    memcpy(&a, key, sizeof(a));
+    memcpy(&b, key + length - 8, sizeof(b));
+  } else if (length >= 4) {
+    uint32_t low, high;
+    memcpy(&low, key, sizeof(low));
+    memcpy(&high, key + length - 4, sizeof(high));
+    a = low;
+    b = high;
+  } else if (length > 0) {
+    a = (uint64_t)(uint8_t)key[0] << 16 |
+        (uint64_t)(uint8_t)key[length >> 1] << 8 | (uint8_t)key[length - 1];
+  }
+
+  uint64_t hash = multiplyMix(a ^ hashKey[0], b ^ hashKey[1]);
+  hash = multiplyMix(hash ^ (uint64_t)length ^ 0x9e3779b97f4a7c15ULL,
+                     hashKey[1] ^ 0xa0761d6478bd642fULL);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+#endif /* __SIZEOF_INT128__ */
+
+// SipHash-1-3 reads eight bytes per round, and without the key nobody can
+// pick strings that collide, so scripts can't flood a table with them
+uint32_t hashString(const char *key, int length) {
+#ifdef __SIZEOF_INT128__
+  if (length <= 16)
+    return hashShort(key, length);
+#endif /* __SIZEOF_INT128__ */
+
+  uint64_t v[4] = {hashKey[0] ^ 0x736f6d6570736575ULL,
+                   hashKey[1] ^ 0x646f72616e646f6dULL,
+                   hashKey[0] ^ 0x6c7967656e657261ULL,
+                   hashKey[1] ^ 0x7465646279746573ULL};
+
+  int words = length & ~7;
+  for (int i = 0; i < words; i += 8) {
+    uint64_t word;
+    memcpy(&word, key + i, sizeof(word));
+    v[3] ^= word;
+    sipRound(v);
+    v[0] ^= word;
+  }
+
+  // The last word holds the leftover bytes and the length
+  uint64_t last = (uint64_t)length << 56;
+  for (int i = words; i < length; i++) {
+    last |= (uint64_t)(uint8_t)key[i] << (8 * (i - words));
   }
-  return hash;
+  v[3] ^= last;
+  sipRound(v);
+  v[0] ^= last;
+
+  v[2] ^= 0xff;
+  sipRound(v);
+  sipRound(v);
+  sipRound(v);
+  uint64_t hash = v[0] ^ v[1] ^ v[2] ^ v[3];
+  return (uint32_t)(hash ^ (hash >> 32));
 }
 
 ObjectBoundMethod *newBoundMethod(Value receiver, ObjectClosure *method) {
@@ -66,10 +194,43 @@ ObjectBoundMethod *newBoundMethod(Value receiver, ObjectClosure *method) {
   return bound;
 }
 
+void classSetMethod(ObjectClass *klass, ObjectString *name, Value method) {
+  while (klass->methods.count <= name->selector) {
+    writeValueArray(&klass->methods, CREATE_UNDEFINED_VALUE());
+  }
+  klass->methods.values[name->selector] = method;
+  writeBarrier((Object *)klass, method);
+}
+
+// The subclass has no methods of its own yet
+void classInherit(ObjectClass *subclass, ObjectClass *superclass) {
+  for (int i = 0; i < superclass->methods.count; i++) {
+    writeValueArray(&subclass->methods, superclass->methods.values[i]);
+    writeBarrier((Object *)subclass, superclass->methods.values[i]);
+  }
+  subclass->initializer = superclass->initializer;
+}
+
+ObjectBoundMethod *bindInstanceMethod(ObjectInstance *instance,
+                                      ObjectClosure *method) {
+  ObjectBoundMethod *bound = instance->boundMethod;
+  if (bound != NULL && bound->method == method) {
+    vm.boundMethodsReused++;
+    return bound;
+  }
+  bound = newBoundMethod(CREATE_OBJECT_VALUE(instance), method);
+  instance->boundMethod = bound;
+  writeBarrier((Object *)instance, CREATE_OBJECT_VALUE(bound));
+  return bound;
+}
+
 ObjectClass *newClass(ObjectString *name) {
   ObjectClass *klass = ALLOCATE_OBJECT(ObjectClass, OBJECT_CLASS);
   klass->name = name;
-  initTable(&klass->methods);
+  initValueArray(&klass->methods);
+  klass->rootShape = NULL;
+  klass->initializer = NULL;
+  klass->fieldCount = 0;
   return klass;
 }
 
@@ -77,28 +238,181 @@ ObjectFunction *newFunction() {
   ObjectFunction *function = ALLOCATE_OBJECT(ObjectFunction, OBJECT_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->registerCount = 0;
   function->name = NULL;
+  function->hotness = 0;
+  function->jitCode = NULL;
   initByteChunk(&function->byteChunk);
   return function;
 }
 
-ObjectNativeFunction *newNativeFunction(NativeFn function) {
+ObjectNativeFunction *newNativeFunction(NativeFn function, ObjectString *name,
+                                        int arity, const uint16_t *argTypes) {
   ObjectNativeFunction *native =
       ALLOCATE_OBJECT(ObjectNativeFunction, OBJECT_NATIVE_FUNCTION);
   native->function = function;
+  native->name = name;
+  native->arity = arity;
+  native->argTypes = argTypes;
   return native;
 }
 
+ObjectFloat64Array *newFloat64Array(int count) {
+  // The values are allocated first so a collection can't free the array
+  double *values = ALLOCATE(double, count);
+  for (int i = 0; i < count; i++) {
+    values[i] = 0;
+  }
+
+  ObjectFloat64Array *array =
+      ALLOCATE_OBJECT(ObjectFloat64Array, OBJECT_FLOAT64_ARRAY);
+  array->count = count;
+  array->values = values;
+  return array;
+}
+
+ObjectList *newList(int capacity) {
+  // The items are allocated first so a collection can't free the list
+  Value *items = ALLOCATE(Value, capacity);
+
+  ObjectList *list = ALLOCATE_OBJECT(ObjectList, OBJECT_LIST);
+  list->items.values = items;
+  list->items.capacity = capacity;
+  list->items.count = 0;
+  return list;
+}
+
+ObjectMap *newMap(int count) {
+  // The entries are allocated first so a collection can't free the map
+  Map table;
+  initMap(&table);
+  mapReserve(&table, count);
+
+  ObjectMap *map = ALLOCATE_OBJECT(ObjectMap, OBJECT_MAP);
+  map->table = table;
+  return map;
+}
+
 ObjectInstance *newInstance(ObjectClass *klass) {
+  if (klass->rootShape == NULL) {
+    klass->rootShape = newShape(NULL, NULL);
+    writeBarrier((Object *)klass, CREATE_OBJECT_VALUE(klass->rootShape));
+  }
+
+  // The slots are allocated first so a collection can't free the instance
+  Value *fields = ALLOCATE(Value, klass->fieldCount);
+
   ObjectInstance *instance = ALLOCATE_OBJECT(ObjectInstance, OBJECT_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = klass->rootShape;
+  instance->fields = fields;
+  instance->fieldCapacity = klass->fieldCount;
+  instance->dictionary = NULL;
+  instance->boundMethod = NULL;
   return instance;
 }
 
+ObjectShape *newShape(ObjectShape *parent, ObjectString *key) {
+  // The key array is allocated first so a collection can't free the shape
+  // before it is linked into the tree
+  int fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  ObjectString **keys = ALLOCATE(ObjectString *, fieldCount);
+  for (int i = 0; i < fieldCount - 1; i++) {
+    keys[i] = parent->keys[i];
+  }
+  if (fieldCount > 0) {
+    keys[fieldCount - 1] = key;
+  }
+
+  ObjectShape *shape = ALLOCATE_OBJECT(ObjectShape, OBJECT_SHAPE);
+  shape->parent = parent;
+  shape->keys = keys;
+  shape->fieldCount = fieldCount;
+  initTable(&shape->transitions);
+  return shape;
+}
+
+ObjectString *newRope(ObjectString *left, ObjectString *right) {
+  ObjectString *rope = newStringObject(NULL, left->length + right->length, 0);
+  rope->left = left;
+  rope->right = right;
+  return rope;
+}
+
+ObjectString *newRuntimeString(int length) {
+  // One allocation for the object and its characters
+  ObjectString *string = newStringObject(NULL, length, length + 1);
+  string->chars = STRING_INLINE_CHARS(string);
+  string->chars[length] = '\0';
+  return string;
+}
+
+void flattenRope(ObjectString *rope) {
+  // Counted like any allocation, but without a chance to collect: strings
+  // are read in places where the stack hasn't been synced
+  char *chars = (char *)malloc(rope->length + 1);
+  if (chars == NULL)
+    exit(1);
+  vm.bytesAllocated += rope->length + 1;
+
+  // Ropes built in a loop are as deep as the loop is long, so the parts
+  // are copied from the right with an explicit stack instead of recursion
+  int capacity = 8, count = 0;
+  ObjectString **pending =
+      (ObjectString **)malloc(sizeof(*pending) * capacity);
+  if (pending == NULL)
+    exit(1);
+  pending[count++] = rope;
+  int end = rope->length;
+  while (count > 0) {
+    ObjectString *part = pending[--count];
+    if (part->chars != NULL) {
+      end -= part->length;
+      memcpy(chars + end, part->chars, part->length);
+      continue;
+    }
+    if (count + 2 > capacity) {
+      capacity *= 2;
+      pending = (ObjectString **)realloc(pending, sizeof(*pending) * capacity);
+      if (pending == NULL)
+        exit(1);
+    }
+    pending[count++] = part->left;
+    pending[count++] = part->right;
+  }
+  free(pending);
+  chars[rope->length] = '\0';
+
+  rope->chars = chars;
+  rope->left = NULL;
+  rope->right = NULL;
+}
+
+uint32_t stringHash(ObjectString *string) {
+  if (!string->hashed) {
+    flatString(string);
+    string->hash = hashString(string->chars, string->length);
+    string->hashed = true;
+  }
+  return string->hash;
+}
+
+bool stringsEqual(ObjectString *a, ObjectString *b) {
+  if (a == b)
+    return true;
+  if ((a->interned && b->interned) || a->length != b->length)
+    return false;
+  // Hashes only rule strings out once something else needed them
+  if (a->hashed && b->hashed && a->hash != b->hash)
+    return false;
+  flatString(a);
+  flatString(b);
+  return memcmp(a->chars, b->chars, a->length) == 0;
+}
+
 ObjectString *takeString(char *chars, int length) {
   uint32_t hash = hashString(chars, length);
-  ObjectString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjectString *interned = stringSetFind(&vm.strings, chars, length, hash);
 
   if (interned != NULL) {
     FREE_ARRAY(char, chars, length + 1);
@@ -110,7 +424,7 @@ ObjectString *takeString(char *chars, int length) {
 
 ObjectString *copyString(const char *chars, int length) {
   uint32_t hash = hashString(chars, length);
-  ObjectString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjectString *interned = stringSetFind(&vm.strings, chars, length, hash);
 
   if (interned != NULL)
     return interned;
@@ -144,6 +458,23 @@ void printMethod(ObjectBoundMethod *method) {
          function->name->chars);
 }
 
+// Containers being printed, innermost last. One that contains itself prints
+// as [...] or {...}, and so does nesting deeper than the C stack should grow.
+#define PRINT_MAX_DEPTH 256
+static Object *printing[PRINT_MAX_DEPTH];
+static int printingCount = 0;
+
+static bool beginPrinting(Object *container) {
+  if (printingCount == PRINT_MAX_DEPTH)
+    return false;
+  for (int i = 0; i < printingCount; i++) {
+    if (printing[i] == container)
+      return false;
+  }
+  printing[printingCount++] = container;
+  return true;
+}
+
 void printObject(Value value) {
   switch (OBJECT_TYPE(value)) {
     case OBJECT_BOUND_METHOD: {
@@ -171,8 +502,59 @@ void printObject(Value value) {
     case OBJECT_INSTANCE:
       printf("Instance of %s", AS_INSTANCE(value)->klass->name->chars);
       break;
+    case OBJECT_SHAPE:
+      printf("<shape %d>", AS_SHAPE(value)->fieldCount);
+      break;
     case OBJECT_STRING:
-      printf("%s", AS_CSTRING(value));
+      printf("%s", flatString(AS_STRING(value))->chars);
+      break;
+    case OBJECT_FLOAT64_ARRAY: {
+      ObjectFloat64Array *array = AS_FLOAT64_ARRAY(value);
+      printf("Float64Array[");
+      for (int i = 0; i < array->count; i++) {
+        printf(i == 0 ? "%g" : ", %g", array->values[i]);
+      }
+      printf("]");
       break;
+    }
+    case OBJECT_MAP: {
+      Map *table = &AS_MAP(value)->table;
+      if (!beginPrinting(AS_OBJECT(value))) {
+        printf("{...}");
+        break;
+      }
+      bool first = true;
+      printf("{");
+      for (int i = 0; i < table->capacity; i++) {
+        MapEntry *entry = &table->entries[i];
+        if (IS_UNDEFINED(entry->key))
+          continue;
+        if (!first)
+          printf(", ");
+        first = false;
+        printValue(entry->key);
+        printf(": ");
+        printValue(entry->value);
+      }
+      printf("}");
+      printingCount--;
+      break;
+    }
+    case OBJECT_LIST: {
+      ObjectList *list = AS_LIST(value);
+      if (!beginPrinting(AS_OBJECT(value))) {
+        printf("[...]");
+        break;
+      }
+      printf("[");
+      for (int i = 0; i < list->items.count; i++) {
+        if (i > 0)
+          printf(", ");
+        printValue(list->items.values[i]);
+      }
+      printf("]");
+      printingCount--;
+      break;
+    }
   }
 }
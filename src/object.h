@@ -3,6 +3,7 @@
 
 #include "bytechunk.h"
 #include "common.h"
+#include "map.h"
 #include "table.h"
 #include "value.h"
 
@@ -15,14 +16,21 @@
 #define IS_NATIVE_FUNCTION(value) isObjectType(value, OBJECT_NATIVE_FUNCTION)
 #define IS_STRING(value) isObjectType(value, OBJECT_STRING)
 #define IS_INSTANCE(value) isObjectType(value, OBJECT_INSTANCE)
+#define IS_SHAPE(value) isObjectType(value, OBJECT_SHAPE)
+#define IS_FLOAT64_ARRAY(value) isObjectType(value, OBJECT_FLOAT64_ARRAY)
+#define IS_LIST(value) isObjectType(value, OBJECT_LIST)
+#define IS_MAP(value) isObjectType(value, OBJECT_MAP)
 
 #define AS_BOUND_METHOD(value) ((ObjectBoundMethod *)AS_OBJECT(value))
 #define AS_CLASS(value) ((ObjectClass *)AS_OBJECT(value))
 #define AS_CLOSURE(value) ((ObjectClosure *)AS_OBJECT(value))
 #define AS_FUNCTION(value) ((ObjectFunction *)AS_OBJECT(value))
 #define AS_INSTANCE(value) ((ObjectInstance *)AS_OBJECT(value))
-#define AS_NATIVE_FUNCTION(value)                                              \
-  (((ObjectNativeFunction *)AS_OBJECT(value))->function)
+#define AS_SHAPE(value) ((ObjectShape *)AS_OBJECT(value))
+#define AS_FLOAT64_ARRAY(value) ((ObjectFloat64Array *)AS_OBJECT(value))
+#define AS_LIST(value) ((ObjectList *)AS_OBJECT(value))
+#define AS_MAP(value) ((ObjectMap *)AS_OBJECT(value))
+#define AS_NATIVE_FUNCTION(value) ((ObjectNativeFunction *)AS_OBJECT(value))
 #define AS_STRING(value) ((ObjectString *)AS_OBJECT(value))
 #define AS_CSTRING(value) (((ObjectString *)AS_OBJECT(value))->chars)
 
@@ -35,11 +43,18 @@ typedef enum {
   OBJECT_CLOSURE,
   OBJECT_UPVALUE,
   OBJECT_INSTANCE,
+  OBJECT_SHAPE,
+  OBJECT_FLOAT64_ARRAY,
+  OBJECT_LIST,
+  OBJECT_MAP,
 } ObjectType;
 
 struct Object {
   ObjectType type;
   bool isMarked;
+  bool isOld;        // Survived a collection, see memory.h
+  bool isRemembered; // Old and in the remembered set
+  bool sweepFlag;    // Equal to vm.sweepFlag unless a sweep may free it
   struct Object *next;
 };
 
@@ -47,22 +62,65 @@ typedef struct {
   Object object;
   int arity; // Number of parameters
   int upvalueCount;
+  int registerCount; // Frame size of register code, 0 for stack bytecode
   ByteChunk byteChunk;
   ObjectString *name;
+  int hotness;             // Calls and loop iterations counted for the JIT
+  struct JitCode *jitCode; // NULL until compiled, see jit.h
 } ObjectFunction;
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+struct VirtualMachine;
+
+// Natives write their result over the callee in args[-1]. One that fails
+// reports it through runtimeError() and returns false.
+typedef bool (*NativeFn)(struct VirtualMachine *vm, int argCount,
+                         Value *args);
+
+// Argument types a native accepts, checked by the VM before calling it
+typedef enum {
+  NATIVE_NAH = 1 << 0,
+  NATIVE_BOOLEAN = 1 << 1,
+  NATIVE_NUMBER = 1 << 2,
+  NATIVE_STRING = 1 << 3,
+  NATIVE_INSTANCE = 1 << 4,
+  NATIVE_FLOAT64_ARRAY = 1 << 5,
+  NATIVE_LIST = 1 << 6,
+  NATIVE_MAP = 1 << 7,
+  NATIVE_OBJECT = 1 << 8, // Any other object
+  NATIVE_ANY = 0x1ff,
+} NativeType;
+
+// Natives that take any number of arguments of any type
+#define NATIVE_VARIADIC -1
 
 typedef struct {
   Object object;
   NativeFn function;
+  ObjectString *name;
+  int arity;               // NATIVE_VARIADIC skips both checks
+  const uint16_t *argTypes; // A NativeType mask per parameter, or NULL
 } ObjectNativeFunction;
 
+// Concatenations at least this long build a rope instead of copying
+#define ROPE_MIN_LENGTH 64
+// Where newRuntimeString() puts the characters, right after the object
+#define STRING_INLINE_CHARS(string) ((char *)((string) + 1))
+
 struct ObjectString {
   Object object;
   int length;
+  // NULL in a rope that hasn't been flattened, whose contents are left
+  // followed by right. Flattening fills it in and drops both.
   char *chars;
-  uint32_t hash;
+  struct ObjectString *left;
+  struct ObjectString *right;
+  uint32_t hash; // Computed on first use by strings made at run time
+  int selector;  // Index into class method arrays, -1 if never a method name
+  bool hashed;
+  // In vm.strings, so equal to another interned string only if identical.
+  // Only compile-time strings and the names of natives are, strings made at
+  // run time compare by contents.
+  bool interned;
 };
 
 typedef struct ObjectUpvalue {
@@ -79,30 +137,112 @@ typedef struct {
   int upvalueCount;
 } ObjectClosure;
 
-typedef struct {
+// Hidden class: the field layout shared by instances that had the same
+// fields added in the same order. Shapes form a transition tree rooted at
+// their class; adding a field moves an instance to a child shape.
+typedef struct ObjectShape {
+  Object object;
+  struct ObjectShape *parent;
+  ObjectString **keys; // Field names indexed by slot
+  int fieldCount;
+  Table transitions; // Field name -> child shape
+} ObjectShape;
+
+typedef struct ObjectClass {
   Object object;
   ObjectString *name;
-  Table methods;
+  // Indexed by selector, undefined where the class has no such method. Each
+  // class has its own copy of what it inherits.
+  ValueArray methods;
+  ObjectShape *rootShape; // Created with the first instance
+  // Kept in step with methods so construction skips the lookup, NULL
+  // without an init method
+  ObjectClosure *initializer;
+  // Most fields any instance has had, new instances start with that many
+  // slots
+  int fieldCount;
 } ObjectClass;
 
 typedef struct {
   Object object;
   ObjectClass *klass;
-  Table fields;
+  ObjectShape *shape; // NULL once the instance is in dictionary mode
+  Value *fields;      // Slots indexed through the shape
+  int fieldCapacity;
+  Table *dictionary; // Fields of an instance in dictionary mode
+  struct ObjectBoundMethod *boundMethod; // The last method bound to it
 } ObjectInstance;
 
+// Unboxed doubles, see kernels.h for the bulk operations on them. The
+// values hold no references, so the GC never traces into them.
 typedef struct {
+  Object object;
+  int count;
+  double *values;
+} ObjectFloat64Array;
+
+// A growable array of values, appends double the capacity when it is full
+typedef struct {
+  Object object;
+  ValueArray items;
+} ObjectList;
+
+typedef struct {
+  Object object;
+  Map table;
+} ObjectMap;
+
+typedef struct ObjectBoundMethod {
   Object object;
   Value receiver;
   ObjectClosure *method;
 } ObjectBoundMethod;
 
+// A bounds-checked index into the class's methods
+static inline bool classGetMethod(ObjectClass *klass, ObjectString *name,
+                                  Value *method) {
+  if ((unsigned)name->selector >= (unsigned)klass->methods.count)
+    return false;
+  *method = klass->methods.values[name->selector];
+  return !IS_UNDEFINED(*method);
+}
+
+// The name needs a selector already, the method has to stay reachable
+void classSetMethod(ObjectClass *klass, ObjectString *name, Value method);
+void classInherit(ObjectClass *subclass, ObjectClass *superclass);
 ObjectBoundMethod *newBoundMethod(Value receiver, ObjectClosure *method);
+// Binds a method to the instance, reusing its last bound method when that
+// binds the same one. Bound methods never change, so they can be shared.
+ObjectBoundMethod *bindInstanceMethod(ObjectInstance *instance,
+                                      ObjectClosure *method);
 ObjectClass *newClass(ObjectString *name);
 ObjectClosure *newClosure(ObjectFunction *function);
 ObjectFunction *newFunction();
+// The values start out as zeros
+ObjectFloat64Array *newFloat64Array(int count);
 ObjectInstance *newInstance(ObjectClass *klass);
-ObjectNativeFunction *newNativeFunction(NativeFn function);
+// An empty list with room for capacity items
+ObjectList *newList(int capacity);
+// An empty map sized for count entries
+ObjectMap *newMap(int count);
+ObjectNativeFunction *newNativeFunction(NativeFn function, ObjectString *name,
+                                        int arity, const uint16_t *argTypes);
+ObjectShape *newShape(ObjectShape *parent, ObjectString *key);
+// Both parts have to stay reachable until the rope is created
+ObjectString *newRope(ObjectString *left, ObjectString *right);
+// Never collects, so a string can be read wherever it is reachable from
+void flattenRope(ObjectString *rope);
+// A string for length characters that the caller fills in, neither hashed
+// nor interned. The characters live in the same allocation.
+ObjectString *newRuntimeString(int length);
+// The string hash is keyed. Seed it before making any string: a fixed seed
+// makes runs repeatable, a random one keeps scripts from forcing collisions.
+void seedStringHash(uint64_t seed);
+uint64_t randomHashSeed();
+uint32_t stringHash(ObjectString *string);
+// The same hash for characters that aren't a string object yet
+uint32_t hashString(const char *key, int length);
+bool stringsEqual(ObjectString *a, ObjectString *b);
 ObjectString *takeString(char *chars, int length);
 ObjectString *copyString(const char *chars, int length);
 ObjectUpvalue *newUpvalue(Value *slot);
@@ -112,4 +252,11 @@ static inline bool isObjectType(Value value, ObjectType type) {
   return IS_OBJECT(value) && AS_OBJECT(value)->type == type;
 }
 
+// Flattens a rope first
+static inline ObjectString *flatString(ObjectString *string) {
+  if (string->chars == NULL)
+    flattenRope(string);
+  return string;
+}
+
 #endif /* MEKVM_OBJECT_H */
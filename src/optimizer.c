@@ -0,0 +1,200 @@
+#include <stdlib.h>
+
+#include "bytechunk.h"
+#include "memory.h"
+#include "optimizer.h"
+
+/*
+ * Peephole pass that rewrites the hottest opcode sequences into
+ * superinstructions. The patterns come from DEBUG_PROFILE_OPCODES pair and
+ * triple counts on the sample programs:
+ *
+ *   LESS|GREATER [NOT] JUMP_IF_FALSE POP   every loop and if condition
+ *   GET_LOCAL CONSTANT ADD|SUBTRACT         `i + 1`, `n - 1`
+ *   GET_LOCAL GET_LOCAL ADD                 `sum + i`
+ *   GET_LOCAL GET_PROPERTY                  `this.x`, `other.x`
+ *   SET_LOCAL POP                           every local assignment statement
+ *
+ * Fused instructions are shorter than the sequences they replace, so the
+ * chunk is re-emitted and every jump is relocated afterwards.
+ */
+
+typedef struct {
+  int operand;   // New offset of the 16-bit jump operand
+  int end;       // New offset right after the jump instruction
+  int target;    // Old offset the jump lands on
+  bool backward; // OP_LOOP
+} JumpFixup;
+
+typedef struct {
+  ByteChunk *source;
+  ByteChunk output;
+  bool *isTarget;
+  int *newOffsets;
+  JumpFixup *fixups;
+  int fixupCount;
+} Fuser;
+
+static void emit(Fuser *fuser, uint8_t byte, int line) {
+  writeByteChunk(&fuser->output, byte, line);
+}
+
+static void emitJump(Fuser *fuser, uint8_t instruction, int target, int line) {
+  emit(fuser, instruction, line);
+  JumpFixup *fixup = &fuser->fixups[fuser->fixupCount++];
+  fixup->operand = fuser->output.count;
+  fixup->end = fuser->output.count + 2;
+  fixup->target = target;
+  fixup->backward = instruction == OP_LOOP;
+  emit(fuser, 0xff, line);
+  emit(fuser, 0xff, line);
+}
+
+// Returns whether the instruction at offset has the given opcode and can be
+// folded into the instruction before it
+static bool follows(Fuser *fuser, int offset, uint8_t instruction) {
+  return offset < fuser->source->count && !fuser->isTarget[offset] &&
+         fuser->source->code[offset] == instruction;
+}
+
+static int fuseCompareJump(Fuser *fuser, int offset) {
+  ByteChunk *source = fuser->source;
+  uint8_t compare = source->code[offset];
+  if (compare != OP_LESS && compare != OP_GREATER)
+    return 0;
+
+  int next = offset + 1;
+  bool negated = follows(fuser, next, OP_NOT);
+  if (negated)
+    next++;
+
+  if (!follows(fuser, next, OP_JUMP_IF_FALSE) ||
+      !follows(fuser, next + 3, OP_POP))
+    return 0;
+
+  // The condition is popped on both paths: by the POP after the jump and
+  // by the POP at the jump target. The fused instruction never pushes it,
+  // so it has to land just after that second POP.
+  int target = jumpTarget(source, next);
+  if (source->code[target] != OP_POP)
+    return 0;
+
+  uint8_t fused;
+  if (compare == OP_LESS) {
+    fused = negated ? OP_JUMP_IF_LESS : OP_JUMP_IF_NOT_LESS;
+  } else {
+    fused = negated ? OP_JUMP_IF_GREATER : OP_JUMP_IF_NOT_GREATER;
+  }
+  emitJump(fuser, fused, target + 1, source->lines[offset]);
+  return next + 4 - offset;
+}
+
+static int fuseLocalOperation(Fuser *fuser, int offset) {
+  ByteChunk *source = fuser->source;
+  uint8_t *code = source->code;
+  int line = source->lines[offset];
+
+  switch (code[offset]) {
+    case OP_GET_LOCAL: {
+      uint8_t fused;
+      if (follows(fuser, offset + 2, OP_CONSTANT) &&
+          follows(fuser, offset + 4, OP_ADD)) {
+        fused = OP_ADD_LOCAL_CONSTANT;
+      } else if (follows(fuser, offset + 2, OP_CONSTANT) &&
+                 follows(fuser, offset + 4, OP_SUBTRACT)) {
+        fused = OP_SUBTRACT_LOCAL_CONSTANT;
+      } else if (follows(fuser, offset + 2, OP_GET_LOCAL) &&
+                 follows(fuser, offset + 4, OP_ADD)) {
+        fused = OP_ADD_LOCAL_LOCAL;
+      } else if (follows(fuser, offset + 2, OP_GET_PROPERTY)) {
+        emit(fuser, OP_GET_LOCAL_PROPERTY, line);
+        emit(fuser, code[offset + 1], line);
+        emit(fuser, code[offset + 3], line);
+        emit(fuser, code[offset + 4], line);
+        emit(fuser, code[offset + 5], line);
+        return 6;
+      } else {
+        return 0;
+      }
+
+      emit(fuser, fused, line);
+      emit(fuser, code[offset + 1], line);
+      emit(fuser, code[offset + 3], line);
+      return 5;
+    }
+    case OP_SET_LOCAL: {
+      if (!follows(fuser, offset + 2, OP_POP))
+        return 0;
+      emit(fuser, OP_SET_LOCAL_POP, line);
+      emit(fuser, code[offset + 1], line);
+      return 3;
+    }
+    default:
+      return 0;
+  }
+}
+
+void fuseSuperinstructions(ByteChunk *byteChunk) {
+  Fuser fuser;
+  fuser.source = byteChunk;
+  fuser.fixupCount = 0;
+  initByteChunk(&fuser.output);
+
+  int count = byteChunk->count;
+  fuser.isTarget = (bool *)calloc(count + 1, sizeof(bool));
+  fuser.newOffsets = (int *)malloc(sizeof(int) * (count + 1));
+  fuser.fixups = (JumpFixup *)malloc(sizeof(JumpFixup) * (count / 3 + 1));
+  if (fuser.isTarget == NULL || fuser.newOffsets == NULL ||
+      fuser.fixups == NULL)
+    exit(1);
+
+  for (int offset = 0; offset < count;
+       offset += instructionLength(byteChunk, offset)) {
+    if (isJump(byteChunk->code[offset])) {
+      fuser.isTarget[jumpTarget(byteChunk, offset)] = true;
+    }
+  }
+
+  for (int offset = 0; offset < count;) {
+    fuser.newOffsets[offset] = fuser.output.count;
+
+    int consumed = fuseCompareJump(&fuser, offset);
+    if (consumed == 0)
+      consumed = fuseLocalOperation(&fuser, offset);
+
+    if (consumed == 0) {
+      uint8_t instruction = byteChunk->code[offset];
+      consumed = instructionLength(byteChunk, offset);
+      if (isJump(instruction)) {
+        emitJump(&fuser, instruction, jumpTarget(byteChunk, offset),
+                 byteChunk->lines[offset]);
+      } else {
+        for (int i = 0; i < consumed; i++) {
+          emit(&fuser, byteChunk->code[offset + i],
+               byteChunk->lines[offset + i]);
+        }
+      }
+    }
+    offset += consumed;
+  }
+  fuser.newOffsets[count] = fuser.output.count;
+
+  for (int i = 0; i < fuser.fixupCount; i++) {
+    JumpFixup *fixup = &fuser.fixups[i];
+    int target = fuser.newOffsets[fixup->target];
+    int jump = fixup->backward ? fixup->end - target : target - fixup->end;
+    fuser.output.code[fixup->operand] = (jump >> 8) & 0xff;
+    fuser.output.code[fixup->operand + 1] = jump & 0xff;
+  }
+
+  FREE_ARRAY(uint8_t, byteChunk->code, byteChunk->capacity);
+  FREE_ARRAY(int, byteChunk->lines, byteChunk->capacity);
+  byteChunk->code = fuser.output.code;
+  byteChunk->lines = fuser.output.lines;
+  byteChunk->count = fuser.output.count;
+  byteChunk->capacity = fuser.output.capacity;
+
+  free(fuser.isTarget);
+  free(fuser.newOffsets);
+  free(fuser.fixups);
+}
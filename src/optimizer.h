@@ -0,0 +1,8 @@
+#ifndef MEKVM_OPTIMIZER_H
+#define MEKVM_OPTIMIZER_H
+
+#include "bytechunk.h"
+
+void fuseSuperinstructions(ByteChunk *byteChunk);
+
+#endif /* MEKVM_OPTIMIZER_H */
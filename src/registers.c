@@ -0,0 +1,836 @@
+#include <stdlib.h>
+
+#include "bytechunk.h"
+#include "memory.h"
+#include "registers.h"
+
+/*
+ * Translates the stack bytecode of a function into register code for the
+ * register backend. Every stack slot of a frame is a register: the value at
+ * depth d lives in R[d], so locals keep their slots and temporaries use the
+ * slots above them, and calls still pass arguments in consecutive slots.
+ *
+ * The translator replays the stack effect of each instruction on a virtual
+ * stack. Pushing a local or a constant emits nothing; the entry remembers
+ * where the value already is and the instruction consuming it reads that
+ * register or constant directly, so most stack traffic disappears:
+ *
+ *   GET_LOCAL 1, GET_LOCAL 2, ADD, SET_LOCAL 1, POP    ADD r1 r1 r2
+ *   GET_LOCAL 1, CONSTANT 0, LESS, JUMP_IF_FALSE, POP  JUMP_IF_NOT_LESS r1 k0
+ *
+ * An entry that only refers to another register is loaded into its own
+ * register before that register is written, before calls (the callee
+ * clobbers the registers above its base and may assign captured locals) and
+ * at every jump and jump target, so all paths into a join agree on where
+ * each value lives.
+ */
+
+typedef enum {
+  ENTRY_REGISTER, // Value is in the register of its own stack slot
+  ENTRY_ALIAS,    // Value is the current content of another register
+  ENTRY_CONSTANT, // Value is a constant that has not been loaded yet
+} EntryKind;
+
+typedef struct {
+  EntryKind kind;
+  int index;
+} StackEntry;
+
+typedef struct {
+  int operand;   // New offset of the 16-bit jump operand
+  int end;       // New offset right after the jump instruction
+  int target;    // Old offset the jump lands on
+  bool backward; // OP_R_LOOP
+} JumpFixup;
+
+typedef struct {
+  ByteChunk *source;
+  ByteChunk output;
+  int line;
+
+  StackEntry stack[UINT8_COUNT];
+  int depth;
+  int registerCount;
+  bool captured[UINT8_COUNT];
+
+  bool *isLabel;
+  int *depths; // Stack depth before each instruction, -1 for dead code
+  int *newOffsets;
+  JumpFixup *fixups;
+  int fixupCount;
+
+  // Output offset of the destination operand of the last instruction if it
+  // wrote a fresh temporary, so an assignment can retarget it; -1 otherwise
+  int lastWrite;
+  bool reachable;
+  bool failed;
+} Translator;
+
+static void emit(Translator *t, uint8_t byte) {
+  writeByteChunk(&t->output, byte, t->line);
+}
+
+static void emitOp(Translator *t, uint8_t instruction) {
+  t->lastWrite = -1;
+  emit(t, instruction);
+}
+
+static void emitDestination(Translator *t, int reg) {
+  t->lastWrite = t->output.count;
+  emit(t, reg);
+}
+
+static void prepareWrite(Translator *t, int reg);
+
+// Loads entry i into its own register
+static void materialize(Translator *t, int i) {
+  StackEntry *entry = &t->stack[i];
+  if (entry->kind == ENTRY_REGISTER)
+    return;
+
+  prepareWrite(t, i);
+  emitOp(t, entry->kind == ENTRY_ALIAS ? OP_R_MOVE : OP_R_LOAD_CONSTANT);
+  emit(t, i);
+  emit(t, entry->index);
+  entry->kind = ENTRY_REGISTER;
+  entry->index = i;
+}
+
+// Entries still referring to reg get their own copy before it is written
+static void prepareWrite(Translator *t, int reg) {
+  for (int i = 0; i < t->depth; i++) {
+    StackEntry *entry = &t->stack[i];
+    if (i != reg && entry->kind == ENTRY_ALIAS && entry->index == reg)
+      materialize(t, i);
+  }
+  if (reg >= t->registerCount)
+    t->registerCount = reg + 1;
+}
+
+static void materializeAll(Translator *t) {
+  for (int i = 0; i < t->depth; i++) {
+    materialize(t, i);
+  }
+}
+
+static bool isAliased(Translator *t, int reg) {
+  for (int i = 0; i < t->depth; i++) {
+    if (t->stack[i].kind == ENTRY_ALIAS && t->stack[i].index == reg)
+      return true;
+  }
+  return false;
+}
+
+static void pushEntry(Translator *t, EntryKind kind, int index) {
+  if (t->depth == UINT8_COUNT) {
+    t->failed = true;
+    return;
+  }
+  prepareWrite(t, t->depth);
+  t->stack[t->depth++] = (StackEntry){kind, index};
+}
+
+// Pushes an entry whose value the next instruction computes into its own
+// register, and returns that register
+static int pushRegister(Translator *t) {
+  pushEntry(t, ENTRY_REGISTER, t->depth);
+  return t->depth - 1;
+}
+
+// Loads the constants among the top count entries that the consuming
+// instruction cannot read directly
+static void loadOperands(Translator *t, int count, bool allowConstants) {
+  for (int i = t->depth - count; i < t->depth; i++) {
+    StackEntry *entry = &t->stack[i];
+    if (entry->kind == ENTRY_CONSTANT &&
+        (!allowConstants || entry->index > RK_MAX))
+      materialize(t, i);
+  }
+}
+
+static int registerOperand(Translator *t, int i) {
+  StackEntry *entry = &t->stack[i];
+  return entry->kind == ENTRY_ALIAS ? entry->index : i;
+}
+
+static int rkOperand(Translator *t, int i) {
+  StackEntry *entry = &t->stack[i];
+  if (entry->kind == ENTRY_CONSTANT)
+    return RK_CONSTANT | entry->index;
+
+  int reg = registerOperand(t, i);
+  if (reg > RK_MAX)
+    t->failed = true;
+  return reg;
+}
+
+static void emitJumpOffset(Translator *t, int target, bool backward) {
+  JumpFixup *fixup = &t->fixups[t->fixupCount++];
+  fixup->operand = t->output.count;
+  fixup->end = t->output.count + 2;
+  fixup->target = target;
+  fixup->backward = backward;
+  emit(t, 0xff);
+  emit(t, 0xff);
+  if (t->depths[target] != t->depth)
+    t->failed = true;
+}
+
+static void enterLabel(Translator *t, int offset) {
+  if (t->reachable) {
+    materializeAll(t);
+  } else {
+    t->depth = t->depths[offset];
+    for (int i = 0; i < t->depth; i++) {
+      t->stack[i] = (StackEntry){ENTRY_REGISTER, i};
+    }
+    t->reachable = true;
+  }
+  if (t->depth != t->depths[offset])
+    t->failed = true;
+  t->newOffsets[offset] = t->output.count;
+  t->lastWrite = -1;
+}
+
+static int stackEffect(ByteChunk *byteChunk, int offset) {
+  uint8_t *code = byteChunk->code;
+  switch (code[offset]) {
+    case OP_CONSTANT:
+    case OP_NAH:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+      return 1;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_GET_INDEX:
+      return -1;
+    case OP_SET_INDEX:
+      return -2;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return -code[offset + 1];
+    case OP_LIST:
+      return 1 - code[offset + 1];
+    case OP_MAP:
+      return 1 - 2 * code[offset + 1];
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+      return -code[offset + 2];
+    case OP_SUPER_INVOKE:
+      return -code[offset + 2] - 1;
+    default:
+      return 0;
+  }
+}
+
+// Static stack depth analysis: the stack effect of every instruction is
+// fixed, so each reachable offset has one depth however it is reached
+static bool computeDepths(Translator *t, int initialDepth) {
+  ByteChunk *byteChunk = t->source;
+  int *worklist = (int *)malloc(sizeof(int) * (byteChunk->count + 1));
+  if (worklist == NULL)
+    exit(1);
+
+  int pending = 0;
+  t->depths[0] = initialDepth;
+  worklist[pending++] = 0;
+  bool consistent = true;
+
+  while (pending > 0 && consistent) {
+    int offset = worklist[--pending];
+    uint8_t instruction = byteChunk->code[offset];
+    int depth = t->depths[offset] + stackEffect(byteChunk, offset);
+    if (depth < 0 || depth > UINT8_COUNT) {
+      consistent = false;
+      break;
+    }
+
+    int successors[2];
+    int successorCount = 0;
+    if (instruction != OP_JUMP && instruction != OP_LOOP &&
+        instruction != OP_RETURN)
+      successors[successorCount++] =
+          offset + instructionLength(byteChunk, offset);
+    if (isJump(instruction))
+      successors[successorCount++] = jumpTarget(byteChunk, offset);
+
+    for (int i = 0; i < successorCount; i++) {
+      int successor = successors[i];
+      if (successor >= byteChunk->count) {
+        consistent = false;
+      } else if (t->depths[successor] == -1) {
+        t->depths[successor] = depth;
+        worklist[pending++] = successor;
+      } else if (t->depths[successor] != depth) {
+        consistent = false;
+      }
+    }
+  }
+
+  free(worklist);
+  return consistent;
+}
+
+// Arguments have to sit in consecutive registers from base. The callee
+// clobbers every register from base up and may assign captured locals.
+static void prepareCall(Translator *t, int base) {
+  for (int i = base; i < t->depth; i++) {
+    materialize(t, i);
+  }
+  for (int i = 0; i < base; i++) {
+    StackEntry *entry = &t->stack[i];
+    if (entry->kind == ENTRY_ALIAS &&
+        (entry->index >= base || t->captured[entry->index]))
+      materialize(t, i);
+  }
+}
+
+static void assignLocal(Translator *t, int slot) {
+  int top = t->depth - 1;
+  StackEntry value = t->stack[top];
+
+  if (slot == top || (value.kind == ENTRY_ALIAS && value.index == slot))
+    return;
+
+  if (value.kind == ENTRY_REGISTER && t->lastWrite != -1 &&
+      t->output.code[t->lastWrite] == top && !isAliased(t, slot)) {
+    // Let the instruction that computed the value write the local itself
+    t->output.code[t->lastWrite] = slot;
+    t->stack[top] = (StackEntry){ENTRY_ALIAS, slot};
+  } else {
+    prepareWrite(t, slot);
+    if (value.kind == ENTRY_CONSTANT) {
+      emitOp(t, OP_R_LOAD_CONSTANT);
+      emit(t, slot);
+      emit(t, value.index);
+    } else {
+      emitOp(t, OP_R_MOVE);
+      emit(t, slot);
+      emit(t, registerOperand(t, top));
+    }
+  }
+  t->stack[slot] = (StackEntry){ENTRY_REGISTER, slot};
+  t->lastWrite = -1;
+}
+
+// Returns whether the instruction at offset has the given opcode and can be
+// folded into the instruction before it
+static bool follows(Translator *t, int offset, uint8_t instruction) {
+  return offset < t->source->count && !t->isLabel[offset] &&
+         t->source->code[offset] == instruction;
+}
+
+static int translateCompareJump(Translator *t, int offset) {
+  uint8_t *code = t->source->code;
+  uint8_t compare = code[offset];
+  int next = offset + 1;
+  bool negated = follows(t, next, OP_NOT);
+  if (negated)
+    next++;
+
+  if (!follows(t, next, OP_JUMP_IF_FALSE) || !follows(t, next + 3, OP_POP))
+    return 0;
+
+  // The condition is popped on both paths, so it is never stored and the
+  // jump lands after the POP at its target
+  int target = jumpTarget(t->source, next);
+  if (code[target] != OP_POP)
+    return 0;
+
+  uint8_t instruction;
+  if (compare == OP_LESS) {
+    instruction = negated ? OP_R_JUMP_IF_LESS : OP_R_JUMP_IF_NOT_LESS;
+  } else {
+    instruction = negated ? OP_R_JUMP_IF_GREATER : OP_R_JUMP_IF_NOT_GREATER;
+  }
+
+  int top = t->depth - 1;
+  loadOperands(t, 2, true);
+  int a = rkOperand(t, top - 1);
+  int b = rkOperand(t, top);
+  t->depth -= 2;
+  materializeAll(t);
+
+  emitOp(t, instruction);
+  emit(t, a);
+  emit(t, b);
+  emitJumpOffset(t, target + 1, false);
+  return next + 4 - offset;
+}
+
+static uint8_t registerOpcode(uint8_t instruction) {
+  switch (instruction) {
+    case OP_NAH:
+      return OP_R_LOAD_NAH;
+    case OP_TRUE:
+      return OP_R_LOAD_TRUE;
+    case OP_FALSE:
+      return OP_R_LOAD_FALSE;
+    case OP_EQUAL:
+      return OP_R_EQUAL;
+    case OP_GREATER:
+      return OP_R_GREATER;
+    case OP_LESS:
+      return OP_R_LESS;
+    case OP_ADD:
+      return OP_R_ADD;
+    case OP_SUBTRACT:
+      return OP_R_SUBTRACT;
+    case OP_MULTIPLY:
+      return OP_R_MULTIPLY;
+    case OP_DIVIDE:
+      return OP_R_DIVIDE;
+    case OP_NOT:
+      return OP_R_NOT;
+    case OP_NEGATE:
+      return OP_R_NEGATE;
+    default:
+      return instruction;
+  }
+}
+
+static int translateInstruction(Translator *t, int offset) {
+  ByteChunk *source = t->source;
+  uint8_t *code = source->code;
+  uint8_t instruction = code[offset];
+  int top = t->depth - 1;
+
+  switch (instruction) {
+    case OP_CONSTANT:
+      pushEntry(t, ENTRY_CONSTANT, code[offset + 1]);
+      return 2;
+    case OP_NAH:
+    case OP_TRUE:
+    case OP_FALSE: {
+      int dst = pushRegister(t);
+      emitOp(t, registerOpcode(instruction));
+      emitDestination(t, dst);
+      return 1;
+    }
+    case OP_POP:
+      t->depth--;
+      return 1;
+    case OP_GET_LOCAL: {
+      int slot = code[offset + 1];
+      materialize(t, slot);
+      pushEntry(t, ENTRY_ALIAS, slot);
+      return 2;
+    }
+    case OP_SET_LOCAL:
+      assignLocal(t, code[offset + 1]);
+      return 2;
+    case OP_GET_GLOBAL: {
+      int dst = pushRegister(t);
+      emitOp(t, OP_R_GET_GLOBAL);
+      emitDestination(t, dst);
+      emit(t, code[offset + 1]);
+      emit(t, code[offset + 2]);
+      return 3;
+    }
+    case OP_GET_UPVALUE: {
+      int dst = pushRegister(t);
+      emitOp(t, OP_R_GET_UPVALUE);
+      emitDestination(t, dst);
+      emit(t, code[offset + 1]);
+      return 2;
+    }
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_DEFINE_GLOBAL: {
+      loadOperands(t, 1, true);
+      int value = rkOperand(t, top);
+      emitOp(t, instruction == OP_SET_GLOBAL    ? OP_R_SET_GLOBAL
+                : instruction == OP_SET_UPVALUE ? OP_R_SET_UPVALUE
+                                                : OP_R_DEFINE_GLOBAL);
+      emit(t, code[offset + 1]);
+      if (instruction == OP_SET_UPVALUE) {
+        emit(t, value);
+        return 2;
+      }
+
+      emit(t, code[offset + 2]);
+      emit(t, value);
+      if (instruction == OP_DEFINE_GLOBAL)
+        t->depth--;
+      return 3;
+    }
+    case OP_GET_PROPERTY: {
+      loadOperands(t, 1, false);
+      int object = registerOperand(t, top);
+      t->depth--;
+      int dst = pushRegister(t);
+      emitOp(t, OP_R_GET_PROPERTY);
+      emitDestination(t, dst);
+      emit(t, object);
+      emit(t, code[offset + 1]);
+      emit(t, code[offset + 2]);
+      emit(t, code[offset + 3]);
+      return 4;
+    }
+    case OP_SET_PROPERTY: {
+      loadOperands(t, 1, true);
+      if (t->stack[top - 1].kind == ENTRY_CONSTANT)
+        materialize(t, top - 1);
+      int object = registerOperand(t, top - 1);
+      int value = rkOperand(t, top);
+      emitOp(t, OP_R_SET_PROPERTY);
+      emit(t, object);
+      emit(t, code[offset + 1]);
+      emit(t, value);
+      emit(t, code[offset + 2]);
+      emit(t, code[offset + 3]);
+
+      // The assigned value replaces the instance
+      StackEntry result = t->stack[top];
+      if (result.kind == ENTRY_REGISTER)
+        result = (StackEntry){ENTRY_ALIAS, top};
+      t->depth -= 2;
+      pushEntry(t, result.kind, result.index);
+      return 4;
+    }
+    case OP_GET_INDEX: {
+      loadOperands(t, 2, true);
+      if (t->stack[top - 1].kind == ENTRY_CONSTANT)
+        materialize(t, top - 1);
+      int array = registerOperand(t, top - 1);
+      int index = rkOperand(t, top);
+      t->depth -= 2;
+      int dst = pushRegister(t);
+      emitOp(t, OP_R_GET_INDEX);
+      emitDestination(t, dst);
+      emit(t, array);
+      emit(t, index);
+      return 1;
+    }
+    case OP_SET_INDEX: {
+      loadOperands(t, 2, true);
+      if (t->stack[top - 2].kind == ENTRY_CONSTANT)
+        materialize(t, top - 2);
+      int array = registerOperand(t, top - 2);
+      int index = rkOperand(t, top - 1);
+      int value = rkOperand(t, top);
+      emitOp(t, OP_R_SET_INDEX);
+      emit(t, array);
+      emit(t, index);
+      emit(t, value);
+
+      // The assigned value replaces the array, as for OP_SET_PROPERTY
+      StackEntry result = t->stack[top];
+      if (result.kind == ENTRY_REGISTER)
+        result = (StackEntry){ENTRY_ALIAS, top};
+      t->depth -= 3;
+      pushEntry(t, result.kind, result.index);
+      return 1;
+    }
+    case OP_LIST:
+    case OP_MAP: {
+      // The elements have to sit in consecutive registers, the collection
+      // replaces the first
+      int count = code[offset + 1];
+      int base = t->depth - (code[offset] == OP_MAP ? 2 * count : count);
+      for (int i = base; i < t->depth; i++) {
+        materialize(t, i);
+      }
+      t->depth = base;
+      int dst = pushRegister(t);
+      emitOp(t, code[offset] == OP_MAP ? OP_R_MAP : OP_R_LIST);
+      emit(t, dst); // Not retargetable, the elements are read from there
+      emit(t, count);
+      return 2;
+    }
+    case OP_GET_SUPER: {
+      loadOperands(t, 2, false);
+      int receiver = registerOperand(t, top - 1);
+      int superclass = registerOperand(t, top);
+      t->depth -= 2;
+      int dst = pushRegister(t);
+      emitOp(t, OP_R_GET_SUPER);
+      emitDestination(t, dst);
+      emit(t, receiver);
+      emit(t, superclass);
+      emit(t, code[offset + 1]);
+      return 2;
+    }
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE: {
+      loadOperands(t, 2, true);
+      int a = rkOperand(t, top - 1);
+      int b = rkOperand(t, top);
+      t->depth -= 2;
+      int dst = pushRegister(t);
+      emitOp(t, registerOpcode(instruction));
+      emitDestination(t, dst);
+      emit(t, a);
+      emit(t, b);
+      return 1;
+    }
+    case OP_NOT:
+    case OP_NEGATE: {
+      loadOperands(t, 1, false);
+      int operand = registerOperand(t, top);
+      t->depth--;
+      int dst = pushRegister(t);
+      emitOp(t, registerOpcode(instruction));
+      emitDestination(t, dst);
+      emit(t, operand);
+      return 1;
+    }
+    case OP_PRINT: {
+      loadOperands(t, 1, true);
+      emitOp(t, OP_R_PRINT);
+      emit(t, rkOperand(t, top));
+      t->depth--;
+      return 1;
+    }
+    case OP_JUMP:
+    case OP_LOOP: {
+      materializeAll(t);
+      emitOp(t, instruction == OP_JUMP ? OP_R_JUMP : OP_R_LOOP);
+      emitJumpOffset(t, jumpTarget(source, offset), instruction == OP_LOOP);
+      t->reachable = false;
+      return 3;
+    }
+    case OP_JUMP_IF_FALSE: {
+      int target = jumpTarget(source, offset);
+      if (follows(t, offset + 3, OP_POP) && code[target] == OP_POP) {
+        // The condition is popped on both paths, see translateCompareJump
+        loadOperands(t, 1, false);
+        int condition = registerOperand(t, top);
+        t->depth--;
+        materializeAll(t);
+        emitOp(t, OP_R_JUMP_IF_FALSE);
+        emit(t, condition);
+        emitJumpOffset(t, target + 1, false);
+        return 4;
+      }
+
+      materializeAll(t);
+      emitOp(t, OP_R_JUMP_IF_FALSE);
+      emit(t, top);
+      emitJumpOffset(t, target, false);
+      return 3;
+    }
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      int argCount = code[offset + 1];
+      int base = t->depth - argCount - 1;
+      prepareCall(t, base);
+      emitOp(t, code[offset] == OP_CALL ? OP_R_CALL : OP_R_TAIL_CALL);
+      emit(t, base);
+      emit(t, argCount);
+      t->depth = base + 1;
+      return 2;
+    }
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE: {
+      int argCount = code[offset + 2];
+      int base = t->depth - argCount - 1;
+      prepareCall(t, base);
+      emitOp(t, code[offset] == OP_INVOKE ? OP_R_INVOKE : OP_R_TAIL_INVOKE);
+      emit(t, base);
+      emit(t, code[offset + 1]);
+      emit(t, argCount);
+      emit(t, code[offset + 3]);
+      emit(t, code[offset + 4]);
+      t->depth = base + 1;
+      return 5;
+    }
+    case OP_SUPER_INVOKE: {
+      int argCount = code[offset + 2];
+      loadOperands(t, 1, false);
+      int superclass = registerOperand(t, top);
+      t->depth--;
+      int base = t->depth - argCount - 1;
+      prepareCall(t, base);
+      emitOp(t, OP_R_SUPER_INVOKE);
+      emit(t, base);
+      emit(t, code[offset + 1]);
+      emit(t, argCount);
+      emit(t, superclass);
+      t->depth = base + 1;
+      return 3;
+    }
+    case OP_CLOSURE: {
+      int length = instructionLength(source, offset);
+      for (int i = offset + 2; i < offset + length; i += 2) {
+        if (code[i])
+          materialize(t, code[i + 1]);
+      }
+      int dst = pushRegister(t);
+      emitOp(t, OP_R_CLOSURE);
+      emit(t, dst);
+      for (int i = offset + 1; i < offset + length; i++) {
+        emit(t, code[i]);
+      }
+      return length;
+    }
+    case OP_CLOSE_UPVALUE:
+      materialize(t, top);
+      emitOp(t, OP_R_CLOSE_UPVALUE);
+      emit(t, top);
+      t->depth--;
+      return 1;
+    case OP_RETURN:
+      loadOperands(t, 1, true);
+      emitOp(t, OP_R_RETURN);
+      emit(t, rkOperand(t, top));
+      t->reachable = false;
+      return 1;
+    case OP_CLASS: {
+      int dst = pushRegister(t);
+      emitOp(t, OP_R_CLASS);
+      emit(t, dst);
+      emit(t, code[offset + 1]);
+      return 2;
+    }
+    case OP_INHERIT:
+    case OP_METHOD: {
+      loadOperands(t, 2, false);
+      int first = registerOperand(t, top - 1);
+      int second = registerOperand(t, top);
+      if (instruction == OP_INHERIT) {
+        emitOp(t, OP_R_INHERIT);
+        emit(t, first);
+        emit(t, second);
+      } else {
+        emitOp(t, OP_R_METHOD);
+        emit(t, first);
+        emit(t, code[offset + 1]);
+        emit(t, second);
+      }
+      t->depth--;
+      return instructionLength(source, offset);
+    }
+    default:
+      // Superinstructions never reach the translator
+      t->failed = true;
+      return instructionLength(source, offset);
+  }
+}
+
+bool translateToRegisters(ObjectFunction *function) {
+  ByteChunk *byteChunk = &function->byteChunk;
+  int count = byteChunk->count;
+
+  Translator t;
+  t.source = byteChunk;
+  initByteChunk(&t.output);
+  t.line = 0;
+  t.depth = function->arity + 1;
+  for (int i = 0; i < t.depth; i++) {
+    t.stack[i] = (StackEntry){ENTRY_REGISTER, i};
+  }
+  t.registerCount = t.depth;
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    t.captured[i] = false;
+  }
+  t.fixupCount = 0;
+  t.lastWrite = -1;
+  t.reachable = true;
+  t.failed = false;
+
+  t.isLabel = (bool *)calloc(count + 1, sizeof(bool));
+  t.depths = (int *)malloc(sizeof(int) * (count + 1));
+  t.newOffsets = (int *)malloc(sizeof(int) * (count + 1));
+  t.fixups = (JumpFixup *)malloc(sizeof(JumpFixup) * (count / 3 + 1));
+  if (t.isLabel == NULL || t.depths == NULL || t.newOffsets == NULL ||
+      t.fixups == NULL)
+    exit(1);
+
+  for (int offset = 0; offset <= count; offset++) {
+    t.depths[offset] = -1;
+    t.newOffsets[offset] = -1;
+  }
+
+  for (int offset = 0; offset < count;
+       offset += instructionLength(byteChunk, offset)) {
+    uint8_t instruction = byteChunk->code[offset];
+    if (isJump(instruction)) {
+      int target = jumpTarget(byteChunk, offset);
+      t.isLabel[target] = true;
+      // Conditions popped on both paths jump past the POP at the target
+      if (instruction == OP_JUMP_IF_FALSE && byteChunk->code[target] == OP_POP)
+        t.isLabel[target + 1] = true;
+    } else if (instruction == OP_CLOSURE) {
+      int length = instructionLength(byteChunk, offset);
+      for (int i = offset + 2; i < offset + length; i += 2) {
+        if (byteChunk->code[i])
+          t.captured[byteChunk->code[i + 1]] = true;
+      }
+    }
+  }
+
+  t.failed = !computeDepths(&t, t.depth);
+
+  for (int offset = 0; offset < count && !t.failed;) {
+    if (t.depths[offset] == -1) {
+      // Dead code, e.g. statements after a return
+      offset += instructionLength(byteChunk, offset);
+      continue;
+    }
+    if (t.isLabel[offset] || !t.reachable)
+      enterLabel(&t, offset);
+
+    t.line = byteChunk->lines[offset];
+    int consumed = 0;
+    uint8_t instruction = byteChunk->code[offset];
+    if (instruction == OP_LESS || instruction == OP_GREATER)
+      consumed = translateCompareJump(&t, offset);
+    if (consumed == 0)
+      consumed = translateInstruction(&t, offset);
+    offset += consumed;
+  }
+
+  for (int i = 0; i < t.fixupCount && !t.failed; i++) {
+    JumpFixup *fixup = &t.fixups[i];
+    int target = t.newOffsets[fixup->target];
+    int jump = fixup->backward ? fixup->end - target : target - fixup->end;
+    if (target == -1 || jump > UINT16_MAX) {
+      t.failed = true;
+      break;
+    }
+    t.output.code[fixup->operand] = (jump >> 8) & 0xff;
+    t.output.code[fixup->operand + 1] = jump & 0xff;
+  }
+
+  if (t.failed) {
+    freeByteChunk(&t.output);
+  } else {
+    FREE_ARRAY(uint8_t, byteChunk->code, byteChunk->capacity);
+    FREE_ARRAY(int, byteChunk->lines, byteChunk->capacity);
+    byteChunk->code = t.output.code;
+    byteChunk->lines = t.output.lines;
+    byteChunk->count = t.output.count;
+    byteChunk->capacity = t.output.capacity;
+    function->registerCount = t.registerCount;
+  }
+
+  free(t.isLabel);
+  free(t.depths);
+  free(t.newOffsets);
+  free(t.fixups);
+  return !t.failed;
+}
@@ -0,0 +1,14 @@
+#ifndef MEKVM_REGISTERS_H
+#define MEKVM_REGISTERS_H
+
+#include "object.h"
+
+// An RK operand names a register, or a constant when the high bit is set
+#define RK_CONSTANT 0x80
+#define RK_MAX 0x7f
+#define IS_RK_CONSTANT(operand) ((operand)&RK_CONSTANT)
+#define RK_INDEX(operand) ((operand) & ~RK_CONSTANT)
+
+bool translateToRegisters(ObjectFunction *function);
+
+#endif /* MEKVM_REGISTERS_H */
@@ -213,8 +213,14 @@ Token scanToken() {
       return makeToken(TOKEN_LEFT_BRACE);
     case '}':
       return makeToken(TOKEN_RIGHT_BRACE);
+    case '[':
+      return makeToken(TOKEN_LEFT_BRACKET);
+    case ']':
+      return makeToken(TOKEN_RIGHT_BRACKET);
     case ';':
       return makeToken(TOKEN_SEMICOLON);
+    case ':':
+      return makeToken(TOKEN_COLON);
     case ',':
       return makeToken(TOKEN_COMMA);
     case '.':
@@ -7,6 +7,9 @@ typedef enum {
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON,
   TOKEN_COMMA,
   TOKEN_DOT,
   TOKEN_MINUS,
@@ -0,0 +1,90 @@
+#include "memory.h"
+#include "object.h"
+#include "shape.h"
+#include "table.h"
+#include "vm.h"
+
+ObjectShape *shapeTransition(ObjectShape *shape, ObjectString *key) {
+  Value child;
+  if (tableGet(&shape->transitions, key, &child))
+    return AS_SHAPE(child);
+
+  ObjectShape *next = newShape(shape, key);
+  push(CREATE_OBJECT_VALUE(next));
+  tableSet(&shape->transitions, key, CREATE_OBJECT_VALUE(next));
+  writeBarrier((Object *)shape, CREATE_OBJECT_VALUE(key));
+  writeBarrier((Object *)shape, CREATE_OBJECT_VALUE(next));
+  pop();
+  return next;
+}
+
+// Moves the fields of an instance with too many of them into its own table
+static void convertToDictionary(ObjectInstance *instance) {
+  Table *dictionary = ALLOCATE(Table, 1);
+  initTable(dictionary);
+
+  // The slots stay in place and keep the values reachable until the table
+  // holds all of them
+  ObjectShape *shape = instance->shape;
+  for (int i = 0; i < shape->fieldCount; i++) {
+    tableSet(dictionary, shape->keys[i], instance->fields[i]);
+  }
+
+  FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+  instance->fields = NULL;
+  instance->fieldCapacity = 0;
+  instance->shape = NULL;
+  instance->dictionary = dictionary;
+}
+
+void instanceAddField(ObjectInstance *instance, ObjectShape *shape,
+                      Value value) {
+  if (shape->fieldCount > instance->fieldCapacity) {
+    int oldCapacity = instance->fieldCapacity;
+    instance->fieldCapacity = GROW_CAPACITY(oldCapacity);
+    instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity,
+                                  instance->fieldCapacity);
+  }
+  instance->fields[shape->fieldCount - 1] = value;
+  instance->shape = shape;
+  writeBarrier((Object *)instance, value);
+  writeBarrier((Object *)instance, CREATE_OBJECT_VALUE(shape));
+  if (shape->fieldCount > instance->klass->fieldCount)
+    instance->klass->fieldCount = shape->fieldCount;
+}
+
+bool instanceGetField(ObjectInstance *instance, ObjectString *key,
+                      Value *value) {
+  if (instance->shape == NULL)
+    return tableGet(instance->dictionary, key, value);
+
+  int slot = shapeFindSlot(instance->shape, key);
+  if (slot == -1)
+    return false;
+  *value = instance->fields[slot];
+  return true;
+}
+
+void instanceSetField(ObjectInstance *instance, ObjectString *key,
+                      Value value) {
+  if (instance->shape != NULL) {
+    int slot = shapeFindSlot(instance->shape, key);
+    if (slot != -1) {
+      instance->fields[slot] = value;
+      writeBarrier((Object *)instance, value);
+      return;
+    }
+
+    if (instance->shape->fieldCount == SHAPE_MAX_FIELDS) {
+      convertToDictionary(instance);
+    } else {
+      instanceAddField(instance, shapeTransition(instance->shape, key),
+                       value);
+      return;
+    }
+  }
+
+  tableSet(instance->dictionary, key, value);
+  writeBarrier((Object *)instance, CREATE_OBJECT_VALUE(key));
+  writeBarrier((Object *)instance, value);
+}
@@ -0,0 +1,28 @@
+#ifndef MEKVM_SHAPE_H
+#define MEKVM_SHAPE_H
+
+#include "object.h"
+
+// An instance that would get more fields than this switches to a table
+#define SHAPE_MAX_FIELDS 32
+
+// Field names are interned, so the slot is found by pointer comparison
+static inline int shapeFindSlot(ObjectShape *shape, ObjectString *key) {
+  for (int i = shape->fieldCount - 1; i >= 0; i--) {
+    if (shape->keys[i] == key)
+      return i;
+  }
+  return -1;
+}
+
+ObjectShape *shapeTransition(ObjectShape *shape, ObjectString *key);
+// Moves an instance to shape, a child of its current one, and stores value
+// in the new slot
+void instanceAddField(ObjectInstance *instance, ObjectShape *shape,
+                      Value value);
+bool instanceGetField(ObjectInstance *instance, ObjectString *key,
+                      Value *value);
+void instanceSetField(ObjectInstance *instance, ObjectString *key,
+                      Value value);
+
+#endif /* MEKVM_SHAPE_H */
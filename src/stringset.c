@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "stringset.h"
+#include "vm.h"
+
+void initStringSet(StringSet *set) {
+  set->count = 0;
+  set->deleted = 0;
+  set->capacity = 0;
+  set->control = NULL;
+  set->keys = NULL;
+}
+
+void freeStringSet(StringSet *set) {
+  FREE_ARRAY(uint8_t, set->control, set->capacity);
+  FREE_ARRAY(ObjectString *, set->keys, set->capacity);
+  initStringSet(set);
+}
+
+// Counted like any allocation, but never collects
+static void *allocateSlots(size_t size) {
+  void *slots = malloc(size);
+  if (slots == NULL)
+    exit(1);
+  vm.bytesAllocated += size;
+  return slots;
+}
+
+static void adjustCapacity(StringSet *set, int capacity) {
+  uint8_t *control = (uint8_t *)allocateSlots(capacity);
+  ObjectString **keys =
+      (ObjectString **)allocateSlots(sizeof(ObjectString *) * capacity);
+  memset(control, TABLE_EMPTY, capacity);
+
+  for (int i = 0; i < set->capacity; i++) {
+    if (TABLE_IS_FREE(set->control[i]))
+      continue;
+
+    ObjectString *key = set->keys[i];
+    int index = tableFindFree(control, capacity, key->hash);
+    control[index] = set->control[i];
+    keys[index] = key;
+  }
+
+  FREE_ARRAY(uint8_t, set->control, set->capacity);
+  FREE_ARRAY(ObjectString *, set->keys, set->capacity);
+  set->control = control;
+  set->keys = keys;
+  set->capacity = capacity;
+  set->deleted = 0;
+}
+
+// The smallest capacity that holds count strings at half the maximum load
+static int fittingCapacity(int count) {
+  int capacity = TABLE_GROUP_SIZE;
+  while (count > capacity * TABLE_MAX_LOAD / 2) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+void stringSetAdd(StringSet *set, ObjectString *string) {
+  if (set->count + set->deleted + 1 > set->capacity * TABLE_MAX_LOAD)
+    adjustCapacity(set, fittingCapacity(set->count + 1));
+
+  int index = tableFindFree(set->control, set->capacity, string->hash);
+  if (set->control[index] == TABLE_DELETED)
+    set->deleted--;
+  set->control[index] = TABLE_TAG(string->hash);
+  set->keys[index] = string;
+  set->count++;
+}
+
+ObjectString *stringSetFind(StringSet *set, const char *chars, int length,
+                            uint32_t hash) {
+  if (set->count == 0)
+    return NULL;
+
+  uint32_t groupMask = set->capacity / TABLE_GROUP_SIZE - 1;
+  uint32_t group = TABLE_GROUP(hash) & groupMask;
+  uint8_t tag = TABLE_TAG(hash);
+
+  for (uint32_t step = 1;; step++) {
+    uint8_t *control = &set->control[group * TABLE_GROUP_SIZE];
+    for (uint32_t match = tableMatchByte(control, tag); match != 0;
+         match &= match - 1) {
+      ObjectString *key =
+          set->keys[group * TABLE_GROUP_SIZE + __builtin_ctz(match)];
+      // A dead string is only waiting for the sweep to free it
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0 &&
+          !sweepWillFree((Object *)key))
+        return key;
+    }
+    if (tableMatchByte(control, TABLE_EMPTY) != 0)
+      return NULL;
+    group = (group + step) & groupMask;
+  }
+}
+
+// Finds the string by identity, so its characters are never read
+void stringSetRemove(StringSet *set, ObjectString *string) {
+  uint32_t groupMask = set->capacity / TABLE_GROUP_SIZE - 1;
+  uint32_t group = TABLE_GROUP(string->hash) & groupMask;
+  uint8_t tag = TABLE_TAG(string->hash);
+
+  for (uint32_t step = 1;; step++) {
+    uint8_t *control = &set->control[group * TABLE_GROUP_SIZE];
+    for (uint32_t match = tableMatchByte(control, tag); match != 0;
+         match &= match - 1) {
+      int index = group * TABLE_GROUP_SIZE + __builtin_ctz(match);
+      if (set->keys[index] == string) {
+        if (tableFreeSlot(set->control, index))
+          set->deleted++;
+        set->count--;
+        return;
+      }
+    }
+    if (tableMatchByte(control, TABLE_EMPTY) != 0)
+      return;
+    group = (group + step) & groupMask;
+  }
+}
+
+void stringSetCompact(StringSet *set) {
+  if (set->capacity == 0)
+    return;
+
+  // Deleted slots make misses probe further, and a set that shrank to a
+  // quarter of its capacity is mostly empty groups
+  int capacity = fittingCapacity(set->count);
+  if (set->deleted * 8 > set->capacity || capacity * 4 <= set->capacity)
+    adjustCapacity(set, capacity);
+}
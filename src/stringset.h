@@ -0,0 +1,32 @@
+#ifndef MEKVM_STRINGSET_H
+#define MEKVM_STRINGSET_H
+
+#include "common.h"
+#include "table.h"
+
+/*
+ * The intern set behind vm.strings. It probes like Table but keeps only the
+ * keys, and its references are weak: a collection removes each dead string
+ * as it frees it, and a lookup during a sweep passes over the ones it hasn't
+ * freed yet. The set is rebuilt once deleted slots pile up. It never triggers a
+ * collection, so it can be resized in the middle of one.
+ */
+
+typedef struct {
+  int count;
+  int deleted;
+  int capacity;
+  uint8_t *control;
+  ObjectString **keys;
+} StringSet;
+
+void initStringSet(StringSet *set);
+void freeStringSet(StringSet *set);
+void stringSetAdd(StringSet *set, ObjectString *string);
+ObjectString *stringSetFind(StringSet *set, const char *chars, int length,
+                            uint32_t hash);
+void stringSetRemove(StringSet *set, ObjectString *string);
+// Rebuilds the set after a sweep if deleted slots or unused capacity grew
+void stringSetCompact(StringSet *set);
+
+#endif /* MEKVM_STRINGSET_H */
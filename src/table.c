@@ -8,145 +8,133 @@
 
 void initTable(Table *table) {
   table->count = 0;
+  table->deleted = 0;
   table->capacity = 0;
+  table->control = NULL;
   table->entries = NULL;
 }
 
 void freeTable(Table *table) {
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
   FREE_ARRAY(Entry, table->entries, table->capacity);
   initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjectString *key) {
-  uint32_t index = key->hash & (capacity - 1);
-  Entry *tombstone = NULL;
-
-  for (;;) {
-    Entry *entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NAH(entry->value)) {
-        // Empty entry
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        if (tombstone == NULL)
-          tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      return entry;
+static int findSlot(Table *table, ObjectString *key) {
+  uint32_t groupMask = table->capacity / TABLE_GROUP_SIZE - 1;
+  uint32_t group = TABLE_GROUP(key->hash) & groupMask;
+  uint8_t tag = TABLE_TAG(key->hash);
+
+  for (uint32_t step = 1;; step++) {
+    uint8_t *control = &table->control[group * TABLE_GROUP_SIZE];
+    for (uint32_t match = tableMatchByte(control, tag); match != 0;
+         match &= match - 1) {
+      int index = group * TABLE_GROUP_SIZE + __builtin_ctz(match);
+      if (table->entries[index].key == key)
+        return index;
     }
-    // Wrapping
-    index = (index + 1) & (capacity - 1);
+    if (tableMatchByte(control, TABLE_EMPTY) != 0)
+      return -1;
+    group = (group + step) & groupMask;
   }
 }
 
 static void adjustCapacity(Table *table, int capacity) {
+  uint8_t *control = ALLOCATE(uint8_t, capacity);
   Entry *entries = ALLOCATE(Entry, capacity);
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = CREATE_NAH_VALUE();
-  }
+  memset(control, TABLE_EMPTY, capacity);
 
-  table->count = 0;
+  // Rehashing leaves the deleted slots behind
   for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    if (entry->key == NULL)
+    if (TABLE_IS_FREE(table->control[i]))
       continue;
 
-    Entry *dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
+    ObjectString *key = table->entries[i].key;
+    int index = tableFindFree(control, capacity, key->hash);
+    control[index] = TABLE_TAG(key->hash);
+    entries[index] = table->entries[i];
   }
 
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
   FREE_ARRAY(Entry, table->entries, table->capacity);
+  table->control = control;
   table->entries = entries;
   table->capacity = capacity;
+  table->deleted = 0;
+}
+
+static void eraseSlot(Table *table, int index) {
+  if (tableFreeSlot(table->control, index))
+    table->deleted++;
+  table->count--;
 }
 
 bool tableGet(Table *table, ObjectString *key, Value *value) {
   if (table->count == 0)
     return false;
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL)
+  int index = findSlot(table, key);
+  if (index < 0)
     return false;
 
-  *value = entry->value;
+  *value = table->entries[index].value;
   return true;
 }
 
 bool tableSet(Table *table, ObjectString *key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+  if (table->count > 0) {
+    int index = findSlot(table, key);
+    if (index >= 0) {
+      table->entries[index].value = value;
+      return false;
+    }
   }
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NAH(entry->value))
-    table->count++;
+  if (table->count + table->deleted + 1 > table->capacity * TABLE_MAX_LOAD) {
+    // Clearing out deleted slots is enough while the table is half full
+    int capacity = table->capacity;
+    if (capacity == 0)
+      capacity = TABLE_GROUP_SIZE;
+    else if (table->count + 1 > capacity * TABLE_MAX_LOAD / 2)
+      capacity *= 2;
+    adjustCapacity(table, capacity);
+  }
 
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  int index = tableFindFree(table->control, table->capacity, key->hash);
+  if (table->control[index] == TABLE_DELETED)
+    table->deleted--;
+  table->control[index] = TABLE_TAG(key->hash);
+  table->entries[index].key = key;
+  table->entries[index].value = value;
+  table->count++;
+  return true;
 }
 
 bool tableDelete(Table *table, ObjectString *key) {
   if (table->count == 0)
     return false;
 
-  // Find
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL)
+  int index = findSlot(table, key);
+  if (index < 0)
     return false;
 
-  // Place tombstone
-  entry->key = NULL;
-  entry->value = CREATE_BOOLEAN_VALUE(true);
+  eraseSlot(table, index);
   return true;
 }
 
 void tableAddAll(Table *from, Table *to) {
   for (int i = 0; i < from->capacity; i++) {
-    Entry *entry = &from->entries[i];
-    if (entry->key != NULL) {
+    if (!TABLE_IS_FREE(from->control[i])) {
+      Entry *entry = &from->entries[i];
       tableSet(to, entry->key, entry->value);
     }
   }
 }
 
-ObjectString *tableFindString(Table *table, const char *chars, int length,
-                              uint32_t hash) {
-  if (table->count == 0)
-    return NULL;
-
-  uint32_t index = hash & (table->capacity - 1);
-
-  for (;;) {
-    Entry *entry = &table->entries[index];
-    if (entry->key == NULL) {
-      if (IS_NAH(entry->value))
-        return NULL;
-    } else if (entry->key->length == length && entry->key->hash == hash &&
-               memcmp(entry->key->chars, chars, length) == 0) {
-      return entry->key;
-    }
-
-    index = (index + 1) % table->capacity;
-  }
-}
-
-void tableRemoveWhite(Table *table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->object.isMarked) {
-      tableDelete(table, entry->key);
-    }
-  }
-}
-
 void markTable(Table *table) {
   for (int i = 0; i < table->capacity; i++) {
+    if (TABLE_IS_FREE(table->control[i]))
+      continue;
     Entry *entry = &table->entries[i];
     markObject((Object *)entry->key);
     markValue(entry->value);
@@ -1,10 +1,30 @@
 #ifndef MEKVM_TABLE_H
 #define MEKVM_TABLE_H
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
 #include "common.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#define TABLE_MAX_LOAD 0.875
+#define TABLE_GROUP_SIZE 16
+
+/*
+ * Swiss-table layout: one control byte per slot says whether it is empty,
+ * deleted or full, and a full slot keeps the low 7 bits of its key's hash
+ * there. Lookups compare a whole group of 16 control bytes at once and only
+ * read the entries whose bits match.
+ */
+
+// Full slots hold a 7-bit hash tag, so only free slots have the top bit set
+#define TABLE_EMPTY 0x80
+#define TABLE_DELETED 0xfe
+#define TABLE_IS_FREE(control) (((control) & 0x80) != 0)
+
+#define TABLE_TAG(hash) ((uint8_t)((hash) & 0x7f))
+#define TABLE_GROUP(hash) ((hash) >> 7)
 
 typedef struct {
   ObjectString *key;
@@ -12,20 +32,78 @@ typedef struct {
 } Entry;
 
 typedef struct {
-  int count;
-  int capacity;
-  Entry *entries;
+  int count;     // Live entries
+  int deleted;   // Deleted slots still breaking up probe sequences
+  int capacity;  // 0 or a power of two, at least one group
+  uint8_t *control;
+  Entry *entries; // Only full slots have a meaningful entry
 } Table;
 
+// Bit i is set when control byte i of the group equals byte
+static inline uint32_t tableMatchByte(const uint8_t *group, uint8_t byte) {
+#ifdef __SSE2__
+  __m128i bytes = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+    if (group[i] == byte)
+      mask |= 1u << i;
+  }
+  return mask;
+#endif /* __SSE2__ */
+}
+
+// Bit i is set when slot i of the group is empty or deleted
+static inline uint32_t tableMatchFree(const uint8_t *group) {
+#ifdef __SSE2__
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+    if (TABLE_IS_FREE(group[i]))
+      mask |= 1u << i;
+  }
+  return mask;
+#endif /* __SSE2__ */
+}
+
+/*
+ * Probing goes group by group with growing steps, which visits every group
+ * of a power-of-two table. It stops at the first group with an empty slot,
+ * because an insert would have used that slot before moving on.
+ */
+
+// The first empty or deleted slot on the probe sequence of hash
+static inline int tableFindFree(const uint8_t *control, int capacity,
+                                uint32_t hash) {
+  uint32_t groupMask = capacity / TABLE_GROUP_SIZE - 1;
+  uint32_t group = TABLE_GROUP(hash) & groupMask;
+
+  for (uint32_t step = 1;; step++) {
+    uint32_t match = tableMatchFree(&control[group * TABLE_GROUP_SIZE]);
+    if (match != 0)
+      return group * TABLE_GROUP_SIZE + __builtin_ctz(match);
+    group = (group + step) & groupMask;
+  }
+}
+
+// Frees a slot, as empty when no probe sequence can run past its group.
+// Returns whether it had to be marked deleted instead.
+static inline bool tableFreeSlot(uint8_t *control, int index) {
+  uint8_t *group = &control[index & ~(TABLE_GROUP_SIZE - 1)];
+  bool deleted = tableMatchByte(group, TABLE_EMPTY) == 0;
+  control[index] = deleted ? TABLE_DELETED : TABLE_EMPTY;
+  return deleted;
+}
+
 void initTable(Table *table);
 void freeTable(Table *table);
 bool tableGet(Table *table, ObjectString *key, Value *value);
 bool tableSet(Table *table, ObjectString *key, Value value);
 bool tableDelete(Table *table, ObjectString *key);
 void tableAddAll(Table *from, Table *to);
-ObjectString *tableFindString(Table *table, const char *chars, int length,
-                              uint32_t hash);
-void tableRemoveWhite(Table *table);
 void markTable(Table *table);
 
 #endif /* MEKVM_TABLE_H */
@@ -55,6 +55,9 @@ void printValue(Value value) {
     case VALUE_OBJECT:
       printObject(value);
       break;
+    default:
+      printf("Unidentified value");
+      break;
   }
 #endif
 }
@@ -64,7 +67,11 @@ bool valuesEqual(Value a, Value b) {
   if (IS_NUMBER(a) && IS_NUMBER(b)) {
     return AS_NUMBER(a) == AS_NUMBER(b);
   }
-  return a == b;
+  if (a == b)
+    return true;
+  // A rope can equal a string it isn't
+  return IS_STRING(a) && IS_STRING(b) &&
+         stringsEqual(AS_STRING(a), AS_STRING(b));
 #else
   if (a.type != b.type)
     return false;
@@ -76,7 +83,10 @@ bool valuesEqual(Value a, Value b) {
     case VALUE_NUMBER:
       return AS_NUMBER(a) == AS_NUMBER(b);
     case VALUE_OBJECT: {
-      return AS_OBJECT(a) == AS_OBJECT(b);
+      if (AS_OBJECT(a) == AS_OBJECT(b))
+        return true;
+      return IS_STRING(a) && IS_STRING(b) &&
+             stringsEqual(AS_STRING(a), AS_STRING(b));
     }
     default:
       fprintf(stderr, "Unreachable code reached in valuesEqual()\n");
@@ -15,11 +15,14 @@ typedef struct ObjectString ObjectString;
 #define TAG_NAH 1   // 01
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE 3  // 11
+// Marks global slots that haven't been defined, never seen by programs
+#define TAG_UNDEFINED 4 // 100
 
 typedef uint64_t Value;
 
 #define IS_BOOLEAN(value) (((value) | 1) == CREATE_TRUE_VALUE())
 #define IS_NAH(value) ((value) == CREATE_NAH_VALUE())
+#define IS_UNDEFINED(value) ((value) == CREATE_UNDEFINED_VALUE())
 #define IS_NUMBER(value) (((value) & QNAN) != QNAN)
 #define IS_OBJECT(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
@@ -33,6 +36,7 @@ typedef uint64_t Value;
 #define CREATE_FALSE_VALUE() ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define CREATE_TRUE_VALUE() ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define CREATE_NAH_VALUE() ((Value)(uint64_t)(QNAN | TAG_NAH))
+#define CREATE_UNDEFINED_VALUE() ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define CREATE_NUMBER_VALUE(num) numToValue(num)
 #define CREATE_OBJECT_VALUE(object)                                            \
   (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
@@ -56,6 +60,7 @@ typedef enum {
   VALUE_NAH,
   VALUE_NUMBER,
   VALUE_OBJECT,
+  VALUE_UNDEFINED, // Global slots that haven't been defined
 } ValueType;
 
 typedef struct {
@@ -71,6 +76,7 @@ typedef struct {
 #define IS_NAH(value) ((value).type == VALUE_NAH)
 #define IS_NUMBER(value) ((value).type == VALUE_NUMBER)
 #define IS_OBJECT(value) ((value).type == VALUE_OBJECT)
+#define IS_UNDEFINED(value) ((value).type == VALUE_UNDEFINED)
 
 #define AS_BOOLEAN(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -78,6 +84,7 @@ typedef struct {
 
 #define CREATE_BOOLEAN_VALUE(value) ((Value){VALUE_BOOLEAN, {.boolean = value}})
 #define CREATE_NAH_VALUE() ((Value){VALUE_NAH, {.number = 0}})
+#define CREATE_UNDEFINED_VALUE() ((Value){VALUE_UNDEFINED, {.number = 0}})
 #define CREATE_NUMBER_VALUE(value) ((Value){VALUE_NUMBER, {.number = value}})
 #define CREATE_OBJECT_VALUE(obj)                                               \
   ((Value){VALUE_OBJECT, {.object = (Object *)(obj)}})
@@ -1,31 +1,286 @@
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "bytechunk.h"
 #include "compiler.h"
 #include "debug.h"
+#include "inlinecache.h"
+#include "jit.h"
+#include "kernels.h"
 #include "memory.h"
 #include "object.h"
+#include "registers.h"
+#include "shape.h"
 #include "value.h"
 #include "vm.h"
 
 VirtualMachine vm;
 
-static Value clockNative(int argCount, Value *args) {
-  return CREATE_NUMBER_VALUE((double)clock() / CLOCKS_PER_SEC);
+// Where interpret() picks up after a push ran into the guard page
+static sigjmp_buf overflowJump;
+static struct sigaction previousHandler;
+static char *guardPage;
+static size_t pageSize;
+
+#ifdef DEBUG_PROFILE_OPCODES
+static uint64_t opcodeCounts[UINT8_COUNT];
+static uint64_t opcodePairCounts[UINT8_COUNT][UINT8_COUNT];
+#endif /* DEBUG_PROFILE_OPCODES */
+
+static bool clockNative(VirtualMachine *vm, int argCount, Value *args) {
+  args[-1] = CREATE_NUMBER_VALUE((double)clock() / CLOCKS_PER_SEC);
+  return true;
 }
 
-static Value printNative(int argCount, Value *args) {
+static bool printNative(VirtualMachine *vm, int argCount, Value *args) {
   for (int i = 0; i < argCount; i++) {
     printValue(args[i]);
     if (i != argCount - 1)
       printf(" ");
   }
   printf("\n");
-  return CREATE_NAH_VALUE();
+  args[-1] = CREATE_NAH_VALUE();
+  return true;
+}
+
+static const uint16_t numberArgument[] = {NATIVE_NUMBER};
+static const uint16_t arrayArgument[] = {NATIVE_FLOAT64_ARRAY};
+static const uint16_t arrayArguments[] = {NATIVE_FLOAT64_ARRAY,
+                                          NATIVE_FLOAT64_ARRAY};
+static const uint16_t arrayNumberArguments[] = {NATIVE_FLOAT64_ARRAY,
+                                                NATIVE_NUMBER};
+static const uint16_t sizedArgument[] = {NATIVE_FLOAT64_ARRAY | NATIVE_LIST |
+                                         NATIVE_MAP};
+static const uint16_t listArgument[] = {NATIVE_LIST};
+static const uint16_t listValueArguments[] = {NATIVE_LIST, NATIVE_ANY};
+static const uint16_t sliceArguments[] = {NATIVE_LIST, NATIVE_NUMBER,
+                                          NATIVE_NUMBER};
+static const uint16_t mapArgument[] = {NATIVE_MAP};
+static const uint16_t mapValueArguments[] = {NATIVE_MAP, NATIVE_ANY};
+
+static bool float64ArrayNative(VirtualMachine *vm, int argCount,
+                               Value *args) {
+  double count = AS_NUMBER(args[0]);
+  if (!(count >= 0 && count <= INT32_MAX) || count != (int)count) {
+    runtimeError("Array size must be a non-negative integer.");
+    return false;
+  }
+  args[-1] = CREATE_OBJECT_VALUE(newFloat64Array((int)count));
+  return true;
+}
+
+static bool lenNative(VirtualMachine *vm, int argCount, Value *args) {
+  int count;
+  if (IS_LIST(args[0])) {
+    count = AS_LIST(args[0])->items.count;
+  } else if (IS_MAP(args[0])) {
+    count = AS_MAP(args[0])->table.count;
+  } else {
+    count = AS_FLOAT64_ARRAY(args[0])->count;
+  }
+  args[-1] = CREATE_NUMBER_VALUE(count);
+  return true;
+}
+
+static bool sameLength(ObjectFloat64Array *a, ObjectFloat64Array *b) {
+  if (a->count == b->count)
+    return true;
+  runtimeError("Arrays have different lengths, %d and %d.", a->count,
+               b->count);
+  return false;
+}
+
+static bool notEmpty(ObjectFloat64Array *array) {
+  if (array->count > 0)
+    return true;
+  runtimeError("Array is empty.");
+  return false;
+}
+
+static bool arraySumNative(VirtualMachine *vm, int argCount, Value *args) {
+  ObjectFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  args[-1] = CREATE_NUMBER_VALUE(kernelSum(array->values, array->count));
+  return true;
+}
+
+static bool arrayDotNative(VirtualMachine *vm, int argCount, Value *args) {
+  ObjectFloat64Array *a = AS_FLOAT64_ARRAY(args[0]);
+  ObjectFloat64Array *b = AS_FLOAT64_ARRAY(args[1]);
+  if (!sameLength(a, b))
+    return false;
+  args[-1] = CREATE_NUMBER_VALUE(kernelDot(a->values, b->values, a->count));
+  return true;
+}
+
+// The in-place kernels return the array they changed
+
+static bool arrayScaleNative(VirtualMachine *vm, int argCount, Value *args) {
+  ObjectFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  kernelScale(array->values, array->count, AS_NUMBER(args[1]));
+  args[-1] = args[0];
+  return true;
+}
+
+static bool arrayAddNative(VirtualMachine *vm, int argCount, Value *args) {
+  ObjectFloat64Array *a = AS_FLOAT64_ARRAY(args[0]);
+  ObjectFloat64Array *b = AS_FLOAT64_ARRAY(args[1]);
+  if (!sameLength(a, b))
+    return false;
+  kernelAdd(a->values, b->values, a->count);
+  args[-1] = args[0];
+  return true;
+}
+
+static bool arrayMinNative(VirtualMachine *vm, int argCount, Value *args) {
+  ObjectFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  if (!notEmpty(array))
+    return false;
+  args[-1] = CREATE_NUMBER_VALUE(kernelMin(array->values, array->count));
+  return true;
+}
+
+static bool arrayMaxNative(VirtualMachine *vm, int argCount, Value *args) {
+  ObjectFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  if (!notEmpty(array))
+    return false;
+  args[-1] = CREATE_NUMBER_VALUE(kernelMax(array->values, array->count));
+  return true;
+}
+
+static bool arrayPrefixSumNative(VirtualMachine *vm, int argCount,
+                                 Value *args) {
+  ObjectFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  kernelPrefixSum(array->values, array->count);
+  args[-1] = args[0];
+  return true;
+}
+
+// The list natives work on the items in place and return the list, except
+// for slice
+
+static bool appendNative(VirtualMachine *vm, int argCount, Value *args) {
+  writeValueArray(&AS_LIST(args[0])->items, args[1]);
+  writeBarrier(AS_OBJECT(args[0]), args[1]);
+  args[-1] = args[0];
+  return true;
+}
+
+static bool sliceBound(Value bound, int count, int *result) {
+  double number = AS_NUMBER(bound);
+  if (!(number >= 0 && number <= count) || number != (int)number) {
+    runtimeError("Slice bounds must be integers from 0 to %d.", count);
+    return false;
+  }
+  *result = (int)number;
+  return true;
+}
+
+// slice(list, start, end) copies the items from start up to end
+static bool sliceNative(VirtualMachine *vm, int argCount, Value *args) {
+  ValueArray *items = &AS_LIST(args[0])->items;
+  int start, end;
+  if (!sliceBound(args[1], items->count, &start) ||
+      !sliceBound(args[2], items->count, &end))
+    return false;
+  if (end < start)
+    end = start;
+
+  ObjectList *slice = newList(end - start);
+  for (int i = start; i < end; i++) {
+    slice->items.values[i - start] = items->values[i];
+  }
+  slice->items.count = end - start;
+  args[-1] = CREATE_OBJECT_VALUE(slice);
+  return true;
+}
+
+static int compareNumbers(const void *a, const void *b) {
+  double x = AS_NUMBER(*(const Value *)a);
+  double y = AS_NUMBER(*(const Value *)b);
+  return (x > y) - (x < y);
+}
+
+static int compareStrings(const void *a, const void *b) {
+  ObjectString *x = AS_STRING(*(const Value *)a);
+  ObjectString *y = AS_STRING(*(const Value *)b);
+  int length = x->length < y->length ? x->length : y->length;
+  int result = memcmp(x->chars, y->chars, length);
+  return result != 0 ? result : x->length - y->length;
+}
+
+// Sorts a list of numbers or a list of strings in ascending order
+static bool sortNative(VirtualMachine *vm, int argCount, Value *args) {
+  ValueArray *items = &AS_LIST(args[0])->items;
+  bool numbers = true, strings = true;
+  for (int i = 0; i < items->count; i++) {
+    numbers = numbers && IS_NUMBER(items->values[i]);
+    strings = strings && IS_STRING(items->values[i]);
+    if (strings)
+      flatString(AS_STRING(items->values[i]));
+  }
+  if (!numbers && !strings) {
+    runtimeError("Only lists of numbers or of strings can be sorted.");
+    return false;
+  }
+
+  if (items->count > 1)
+    qsort(items->values, items->count, sizeof(Value),
+          numbers ? compareNumbers : compareStrings);
+  args[-1] = args[0];
+  return true;
+}
+
+static bool reverseNative(VirtualMachine *vm, int argCount, Value *args) {
+  ValueArray *items = &AS_LIST(args[0])->items;
+  for (int i = 0, j = items->count - 1; i < j; i++, j--) {
+    Value swap = items->values[i];
+    items->values[i] = items->values[j];
+    items->values[j] = swap;
+  }
+  args[-1] = args[0];
+  return true;
+}
+
+static bool hasNative(VirtualMachine *vm, int argCount, Value *args) {
+  Value value;
+  args[-1] =
+      CREATE_BOOLEAN_VALUE(mapGet(&AS_MAP(args[0])->table, args[1], &value));
+  return true;
+}
+
+static bool removeNative(VirtualMachine *vm, int argCount, Value *args) {
+  args[-1] = CREATE_BOOLEAN_VALUE(mapDelete(&AS_MAP(args[0])->table, args[1]));
+  return true;
+}
+
+// Lists of the keys or the values, in the same order for an unchanged map
+static bool mapEntries(Value *args, bool keys) {
+  Map *table = &AS_MAP(args[0])->table;
+  ObjectList *list = newList(table->count);
+  for (int i = 0; i < table->capacity; i++) {
+    MapEntry *entry = &table->entries[i];
+    if (IS_UNDEFINED(entry->key))
+      continue;
+    list->items.values[list->items.count++] = keys ? entry->key : entry->value;
+  }
+  args[-1] = CREATE_OBJECT_VALUE(list);
+  return true;
+}
+
+static bool keysNative(VirtualMachine *vm, int argCount, Value *args) {
+  return mapEntries(args, true);
+}
+
+static bool valuesNative(VirtualMachine *vm, int argCount, Value *args) {
+  return mapEntries(args, false);
 }
 
 static void resetStack() {
@@ -34,7 +289,7 @@ static void resetStack() {
   vm.frameCount = 0;
 }
 
-static void runtimeError(const char *format, ...) {
+void runtimeError(const char *format, ...) {
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -46,8 +301,11 @@ static void runtimeError(const char *format, ...) {
   for (int i = vm.frameCount - 1; i >= 0; i--) {
     CallFrame *frame = &vm.frames[i];
     ObjectFunction *function = frame->closure->function;
-    // ip always points to the next instruction to execute
-    size_t instruction = frame->ip - function->byteChunk.code - 1;
+    // ip always points to the next instruction to execute, except in a
+    // frame that overflowed the stack before saving it
+    size_t instruction = frame->ip - function->byteChunk.code;
+    if (instruction > 0)
+      instruction--;
     fprintf(stderr, "[line %d] in ", function->byteChunk.lines[instruction]);
     if (function->name == NULL)
       fprintf(stderr, "script\n");
@@ -58,39 +316,174 @@ static void runtimeError(const char *format, ...) {
   resetStack();
 }
 
-static void defineNativeFunction(const char *name, NativeFn function) {
+static void defineNativeFunction(const char *name, NativeFn function,
+                                 int arity, const uint16_t *argTypes) {
   push(CREATE_OBJECT_VALUE(copyString(name, (int)strlen(name))));
-  push(CREATE_OBJECT_VALUE(newNativeFunction(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  push(CREATE_OBJECT_VALUE(
+      newNativeFunction(function, AS_STRING(vm.stack[0]), arity, argTypes)));
+  int slot = globalSlot(AS_STRING(vm.stack[0]));
+  vm.globalValues.values[slot] = vm.stack[1];
   pop();
   pop();
 }
 
-void initVirtualMachine() {
+int globalSlot(ObjectString *name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot))
+    return (int)AS_NUMBER(slot);
+
+  push(CREATE_OBJECT_VALUE(name));
+  writeValueArray(&vm.globalNames, CREATE_OBJECT_VALUE(name));
+  writeValueArray(&vm.globalValues, CREATE_UNDEFINED_VALUE());
+  int index = vm.globalValues.count - 1;
+  tableSet(&vm.globalSlots, name, CREATE_NUMBER_VALUE(index));
+  pop();
+  return index;
+}
+
+int methodSelector(ObjectString *name) {
+  if (name->selector == -1) {
+    push(CREATE_OBJECT_VALUE(name));
+    writeValueArray(&vm.selectorNames, CREATE_OBJECT_VALUE(name));
+    name->selector = vm.selectorNames.count - 1;
+    pop();
+  }
+  return name->selector;
+}
+
+static size_t roundToPage(size_t size) {
+  return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+// Reserves address space without committing memory, the OS backs each page
+// the first time it is touched
+static void *reserve(size_t size) {
+  void *region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED) {
+    fprintf(stderr, "Could not reserve %zu bytes for the stack.\n", size);
+    exit(1);
+  }
+  return region;
+}
+
+static void onSegmentationFault(int signal, siginfo_t *info, void *context) {
+  char *address = info->si_addr;
+  if (address >= guardPage && address < guardPage + pageSize)
+    siglongjmp(overflowJump, 1);
+  // A genuine crash, which faults again under the previous handler
+  sigaction(SIGSEGV, &previousHandler, NULL);
+}
+
+static void initStack(int frameMax, int stackMax) {
+  pageSize = sysconf(_SC_PAGESIZE);
+
+  vm.frameMax = frameMax;
+  vm.frames = reserve(roundToPage(sizeof(CallFrame) * frameMax));
+
+  // The limit is rounded up to a whole page, so the guard page starts right
+  // at the end of the stack and no push gets past the limit
+  size_t stackSize = roundToPage(sizeof(Value) * stackMax);
+  vm.stack = reserve(stackSize + pageSize);
+  vm.stackEnd = vm.stack + stackSize / sizeof(Value);
+  guardPage = (char *)vm.stackEnd;
+  mprotect(guardPage, pageSize, PROT_NONE);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = onSegmentationFault;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &previousHandler);
+}
+
+static void freeStack() {
+  sigaction(SIGSEGV, &previousHandler, NULL);
+  munmap(vm.frames, roundToPage(sizeof(CallFrame) * vm.frameMax));
+  munmap(vm.stack, guardPage + pageSize - (char *)vm.stack);
+  vm.frames = NULL;
+  vm.stack = NULL;
+}
+
+void initVirtualMachine(int frameMax, int stackMax) {
+  initStack(frameMax, stackMax);
   resetStack();
   vm.objects = NULL;
+  vm.oldObjects = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
   vm.bytesAllocated = 0;
-  vm.gcThreshold = 1024 * 1024;
+  vm.gcThreshold = GC_MIN_THRESHOLD;
+  vm.nurseryBytes = 0;
+  vm.nurserySize = NURSERY_SIZE;
+  vm.gcPhase = GC_IDLE;
+  vm.sweepFlag = false;
+  vm.gcSliceWork = 0;
+  vm.minorCollections = 0;
+  vm.majorCollections = 0;
+  vm.gcSlices = 0;
+  vm.gcPauses = 0;
+  vm.gcPauseTotal = 0;
+  vm.gcPauseMax = 0;
+  vm.boundMethodsReused = 0;
+  vm.registerBackend = false;
+  vm.jitEnabled = false;
+  vm.methodEpoch = 0;
 
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
 
-  initTable(&vm.globals);
-  initTable(&vm.strings);
+  initTable(&vm.globalSlots);
+  initValueArray(&vm.globalNames);
+  initValueArray(&vm.globalValues);
+  initValueArray(&vm.selectorNames);
+  initStringSet(&vm.strings);
 
   vm.initString = NULL;
   vm.initString = copyString("init", 4);
+  methodSelector(vm.initString);
 
-  defineNativeFunction("clock", clockNative);
-  defineNativeFunction("printf", printNative);
+  defineNativeFunction("clock", clockNative, 0, NULL);
+  defineNativeFunction("printf", printNative, NATIVE_VARIADIC, NULL);
+  defineNativeFunction("Float64Array", float64ArrayNative, 1, numberArgument);
+  defineNativeFunction("len", lenNative, 1, sizedArgument);
+  defineNativeFunction("arraySum", arraySumNative, 1, arrayArgument);
+  defineNativeFunction("arrayDot", arrayDotNative, 2, arrayArguments);
+  defineNativeFunction("arrayScale", arrayScaleNative, 2,
+                       arrayNumberArguments);
+  defineNativeFunction("arrayAdd", arrayAddNative, 2, arrayArguments);
+  defineNativeFunction("arrayMin", arrayMinNative, 1, arrayArgument);
+  defineNativeFunction("arrayMax", arrayMaxNative, 1, arrayArgument);
+  defineNativeFunction("arrayPrefixSum", arrayPrefixSumNative, 1,
+                       arrayArgument);
+  defineNativeFunction("append", appendNative, 2, listValueArguments);
+  defineNativeFunction("slice", sliceNative, 3, sliceArguments);
+  defineNativeFunction("sort", sortNative, 1, listArgument);
+  defineNativeFunction("reverse", reverseNative, 1, listArgument);
+  defineNativeFunction("has", hasNative, 2, mapValueArguments);
+  defineNativeFunction("remove", removeNative, 2, mapValueArguments);
+  defineNativeFunction("keys", keysNative, 1, mapArgument);
+  defineNativeFunction("values", valuesNative, 1, mapArgument);
 }
 
 void freeVirtualMachine() {
-  freeTable(&vm.globals);
-  freeTable(&vm.strings);
+  freeTable(&vm.globalSlots);
+  freeValueArray(&vm.globalNames);
+  freeValueArray(&vm.globalValues);
+  freeValueArray(&vm.selectorNames);
+  freeStringSet(&vm.strings);
   vm.initString = NULL;
+#ifdef DEBUG_PROFILE_CACHES
+  printCacheProfile();
+#endif /* DEBUG_PROFILE_CACHES */
   freeObjects();
+
+#ifdef DEBUG_PROFILE_OPCODES
+  printOpcodeProfile(opcodeCounts, opcodePairCounts);
+#endif /* DEBUG_PROFILE_OPCODES */
+  freeStack();
 }
 
 void push(Value value) {
@@ -112,7 +505,14 @@ static bool call(ObjectClosure *closure, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  if (vm.frameCount == vm.frameMax) {
+    runtimeError("Stack Overflow.");
+    return false;
+  }
+
+  // Register code addresses its whole frame, which has to fit on the stack
+  if (vm.stackTop - argCount - 1 + closure->function->registerCount >
+      vm.stackEnd) {
     runtimeError("Stack Overflow.");
     return false;
   }
@@ -124,7 +524,143 @@ static bool call(ObjectClosure *closure, int argCount) {
   return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+// Array index operands have to be integers within bounds
+static inline bool arrayIndex(Value index, int count, int *result) {
+  if (!IS_NUMBER(index)) {
+    runtimeError("Index must be a number.");
+    return false;
+  }
+  double number = AS_NUMBER(index);
+  if (!(number >= 0 && number < count)) {
+    runtimeError("Index out of bounds.");
+    return false;
+  }
+  if (number != (int)number) {
+    runtimeError("Index must be an integer.");
+    return false;
+  }
+  *result = (int)number;
+  return true;
+}
+
+// NaN never equals itself, a NaN key could be stored but never found
+static inline bool mapKey(Value key) {
+  if (IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key)) {
+    runtimeError("Map keys can't be NaN.");
+    return false;
+  }
+  return true;
+}
+
+// Missing map keys read as nah
+static inline bool getIndex(Value array, Value index, Value *result) {
+  if (IS_MAP(array)) {
+    if (!mapGet(&AS_MAP(array)->table, index, result))
+      *result = CREATE_NAH_VALUE();
+    return true;
+  }
+  if (IS_LIST(array)) {
+    ValueArray *items = &AS_LIST(array)->items;
+    int i;
+    if (!arrayIndex(index, items->count, &i))
+      return false;
+    *result = items->values[i];
+    return true;
+  }
+  if (!IS_FLOAT64_ARRAY(array)) {
+    runtimeError("Only lists, maps and arrays can be indexed.");
+    return false;
+  }
+  ObjectFloat64Array *numbers = AS_FLOAT64_ARRAY(array);
+  int i;
+  if (!arrayIndex(index, numbers->count, &i))
+    return false;
+  *result = CREATE_NUMBER_VALUE(numbers->values[i]);
+  return true;
+}
+
+static inline bool setIndex(Value array, Value index, Value value) {
+  if (IS_MAP(array)) {
+    if (!mapKey(index))
+      return false;
+    mapSet(&AS_MAP(array)->table, index, value);
+    writeBarrier(AS_OBJECT(array), index);
+    writeBarrier(AS_OBJECT(array), value);
+    return true;
+  }
+  if (IS_LIST(array)) {
+    ValueArray *items = &AS_LIST(array)->items;
+    int i;
+    if (!arrayIndex(index, items->count, &i))
+      return false;
+    items->values[i] = value;
+    writeBarrier(AS_OBJECT(array), value);
+    return true;
+  }
+  if (!IS_FLOAT64_ARRAY(array)) {
+    runtimeError("Only lists, maps and arrays can be indexed.");
+    return false;
+  }
+  ObjectFloat64Array *numbers = AS_FLOAT64_ARRAY(array);
+  int i;
+  if (!arrayIndex(index, numbers->count, &i))
+    return false;
+  if (!IS_NUMBER(value)) {
+    runtimeError("Float64Array elements must be numbers.");
+    return false;
+  }
+  numbers->values[i] = AS_NUMBER(value);
+  return true;
+}
+
+static uint16_t nativeType(Value value) {
+  if (IS_NAH(value))
+    return NATIVE_NAH;
+  if (IS_BOOLEAN(value))
+    return NATIVE_BOOLEAN;
+  if (IS_NUMBER(value))
+    return NATIVE_NUMBER;
+  if (IS_STRING(value))
+    return NATIVE_STRING;
+  if (IS_INSTANCE(value))
+    return NATIVE_INSTANCE;
+  if (IS_FLOAT64_ARRAY(value))
+    return NATIVE_FLOAT64_ARRAY;
+  if (IS_LIST(value))
+    return NATIVE_LIST;
+  if (IS_MAP(value))
+    return NATIVE_MAP;
+  return NATIVE_OBJECT;
+}
+
+// The arguments are checked here once, so natives can use them as declared.
+// The result is already in the callee's slot, only the arguments are popped.
+static inline bool callNative(ObjectNativeFunction *native, int argCount) {
+  Value *args = vm.stackTop - argCount;
+  if (native->arity != NATIVE_VARIADIC) {
+    if (argCount != native->arity) {
+      runtimeError("Expected %d arguments but got %d", native->arity,
+                   argCount);
+      return false;
+    }
+    if (native->argTypes != NULL) {
+      for (int i = 0; i < argCount; i++) {
+        if (!(nativeType(args[i]) & native->argTypes[i])) {
+          runtimeError("Invalid type for argument %d of %s().", i + 1,
+                       native->name->chars);
+          return false;
+        }
+      }
+    }
+  }
+
+  if (!native->function(&vm, argCount, args))
+    return false;
+  vm.stackTop = args;
+  return true;
+}
+
+bool callValue(Value callee, int argCount) {
   if (IS_OBJECT(callee)) {
     switch (OBJECT_TYPE(callee)) {
       case OBJECT_BOUND_METHOD: {
@@ -135,9 +671,8 @@ static bool callValue(Value callee, int argCount) {
       case OBJECT_CLASS: {
         ObjectClass *klass = AS_CLASS(callee);
         vm.stackTop[-argCount - 1] = CREATE_OBJECT_VALUE(newInstance(klass));
-        Value initializer;
-        if (tableGet(&klass->methods, vm.initString, &initializer)) {
-          return call(AS_CLOSURE(initializer), argCount);
+        if (klass->initializer != NULL) {
+          return call(klass->initializer, argCount);
         } else if (argCount != 0) {
           runtimeError("Expected  0 arguments, but got %d.", argCount);
           return false;
@@ -147,13 +682,8 @@ static bool callValue(Value callee, int argCount) {
       case OBJECT_CLOSURE: {
         return call(AS_CLOSURE(callee), argCount);
       }
-      case OBJECT_NATIVE_FUNCTION: {
-        NativeFn native = AS_NATIVE_FUNCTION(callee);
-        Value result = native(argCount, vm.stackTop - argCount);
-        vm.stackTop -= argCount + 1;
-        push(result);
-        return true;
-      }
+      case OBJECT_NATIVE_FUNCTION:
+        return callNative(AS_NATIVE_FUNCTION(callee), argCount);
       default:
         break; // Non-callable object called
     }
@@ -165,14 +695,78 @@ static bool callValue(Value callee, int argCount) {
 static bool invokeFromClass(ObjectClass *klass, ObjectString *name,
                             int argCount) {
   Value method;
-  if (!tableGet(&klass->methods, name, &method)) {
+  if (!classGetMethod(klass, name, &method)) {
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
   return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjectString *name, int argCount) {
+// Called after a cache miss, which may have stored young or white shapes
+// and methods in the caches of the running function
+static inline void rememberRunningFunction() {
+  writeBarrierBack((Object *)vm.frames[vm.frameCount - 1].closure->function);
+}
+
+// Returns the cache entry for reading name from instance, or NULL when the
+// instance is in dictionary mode or has no such property
+static inline CacheEntry *cachedGet(InlineCache *cache,
+                                    ObjectInstance *instance,
+                                    ObjectString *name) {
+  ObjectShape *shape = instance->shape;
+  if (cache->epoch == vm.methodEpoch) {
+    for (int i = 0; i < cache->entryCount; i++) {
+      if (cache->entries[i].shape == shape) {
+        cache->hits++;
+        return &cache->entries[i];
+      }
+    }
+  }
+
+  if (shape == NULL) {
+    cache->misses++;
+    return NULL;
+  }
+  CacheEntry *entry = cacheGetMiss(cache, shape, instance->klass, name);
+  rememberRunningFunction();
+  return entry;
+}
+
+// The value has to stay reachable, adding a field may allocate
+static inline void cachedSet(InlineCache *cache, ObjectInstance *instance,
+                             ObjectString *name, Value value) {
+  ObjectShape *shape = instance->shape;
+  CacheEntry *entry = NULL;
+  for (int i = 0; i < cache->entryCount; i++) {
+    if (cache->entries[i].shape == shape) {
+      cache->hits++;
+      entry = &cache->entries[i];
+      break;
+    }
+  }
+
+  if (entry == NULL) {
+    if (shape != NULL) {
+      entry = cacheSetMiss(cache, shape, name);
+      rememberRunningFunction();
+    } else {
+      cache->misses++;
+    }
+    if (entry == NULL) {
+      instanceSetField(instance, name, value);
+      return;
+    }
+  }
+
+  if (entry->transition == NULL) {
+    instance->fields[entry->slot] = value;
+    writeBarrier((Object *)instance, value);
+  } else {
+    instanceAddField(instance, entry->transition, value);
+  }
+}
+
+bool invoke(ObjectString *name, int argCount, InlineCache *cache) {
   Value receiver = peek(argCount);
 
   if (!IS_INSTANCE(receiver)) {
@@ -181,27 +775,139 @@ static bool invoke(ObjectString *name, int argCount) {
   }
   ObjectInstance *instance = AS_INSTANCE(receiver);
 
+  CacheEntry *entry = cachedGet(cache, instance, name);
+  if (entry != NULL) {
+    if (entry->slot == -1)
+      return call(AS_CLOSURE(entry->method), argCount);
+    Value value = instance->fields[entry->slot];
+    vm.stackTop[-argCount - 1] = value;
+    return callValue(value, argCount);
+  }
+
   Value value;
-  if (tableGet(&instance->fields, name, &value)) {
+  if (instanceGetField(instance, name, &value)) {
     vm.stackTop[-argCount - 1] = value;
     return callValue(value, argCount);
   }
   return invokeFromClass(instance->klass, name, argCount);
 }
 
+// Replaces the current frame with a call to closure
+static bool tailCall(ObjectClosure *closure, int argCount) {
+  if (argCount != closure->function->arity) {
+    runtimeError("Expected %d arguments but got %d", closure->function->arity,
+                 argCount);
+    return false;
+  }
+
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  if (frame->slots + closure->function->registerCount > vm.stackEnd) {
+    runtimeError("Stack Overflow.");
+    return false;
+  }
+
+  // The callee and its arguments move down over the finished frame
+  closeUpvalues(frame->slots);
+  Value *callee = vm.stackTop - argCount - 1;
+  memmove(frame->slots, callee, sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  frame->closure = closure;
+  frame->ip = closure->function->byteChunk.code;
+  return true;
+}
+
+bool tailCallValue(Value callee, int argCount) {
+  if (IS_CLOSURE(callee))
+    return tailCall(AS_CLOSURE(callee), argCount);
+  if (IS_BOUND_METHOD(callee)) {
+    ObjectBoundMethod *bound = AS_BOUND_METHOD(callee);
+    vm.stackTop[-argCount - 1] = bound->receiver;
+    return tailCall(bound->method, argCount);
+  }
+  return callValue(callee, argCount);
+}
+
+bool tailInvoke(ObjectString *name, int argCount, InlineCache *cache) {
+  Value receiver = peek(argCount);
+
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError("Only instances of defined classes have methods.");
+    return false;
+  }
+  ObjectInstance *instance = AS_INSTANCE(receiver);
+
+  CacheEntry *entry = cachedGet(cache, instance, name);
+  if (entry != NULL) {
+    if (entry->slot == -1)
+      return tailCall(AS_CLOSURE(entry->method), argCount);
+    Value value = instance->fields[entry->slot];
+    vm.stackTop[-argCount - 1] = value;
+    return tailCallValue(value, argCount);
+  }
+
+  Value value;
+  if (instanceGetField(instance, name, &value)) {
+    vm.stackTop[-argCount - 1] = value;
+    return tailCallValue(value, argCount);
+  }
+  if (!classGetMethod(instance->klass, name, &value)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+  return tailCall(AS_CLOSURE(value), argCount);
+}
+
 static bool bindMethod(ObjectClass *klass, ObjectString *name) {
   Value method;
-  if (!tableGet(&klass->methods, name, &method)) {
+  if (!classGetMethod(klass, name, &method)) {
     // Method not exist in class
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
-  ObjectBoundMethod *boundMethod = newBoundMethod(peek(0), AS_CLOSURE(method));
+  ObjectBoundMethod *boundMethod =
+      bindInstanceMethod(AS_INSTANCE(peek(0)), AS_CLOSURE(method));
   pop();
   push(CREATE_OBJECT_VALUE(boundMethod));
   return true;
 }
 
+bool tryGetProperty(ObjectString *name, InlineCache *cache) {
+  Value receiver = peek(0);
+  if (!IS_INSTANCE(receiver))
+    return false;
+  ObjectInstance *instance = AS_INSTANCE(receiver);
+
+  Value value;
+  CacheEntry *entry = cachedGet(cache, instance, name);
+  if (entry != NULL) {
+    if (entry->slot != -1) {
+      vm.stackTop[-1] = instance->fields[entry->slot];
+      return true;
+    }
+    value = entry->method;
+  } else if (instanceGetField(instance, name, &value)) {
+    vm.stackTop[-1] = value;
+    return true;
+  } else if (!classGetMethod(instance->klass, name, &value)) {
+    return false;
+  }
+
+  ObjectBoundMethod *bound = bindInstanceMethod(instance, AS_CLOSURE(value));
+  vm.stackTop[-1] = CREATE_OBJECT_VALUE(bound);
+  return true;
+}
+
+// Leaves the value in place of the instance, the caller pops the other copy
+bool trySetProperty(ObjectString *name, InlineCache *cache) {
+  Value receiver = peek(1);
+  if (!IS_INSTANCE(receiver))
+    return false;
+  Value value = peek(0);
+  cachedSet(cache, AS_INSTANCE(receiver), name, value);
+  vm.stackTop[-2] = value;
+  return true;
+}
+
 static ObjectUpvalue *captureUpvalue(Value *local) {
   // Traverse the list of open upvalues
   ObjectUpvalue *previousUpvalue = NULL;
@@ -230,11 +936,12 @@ static ObjectUpvalue *captureUpvalue(Value *local) {
   return createdUpvalue;
 }
 
-static void closeUpvalues(Value *last) {
+void closeUpvalues(Value *last) {
   while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
     ObjectUpvalue *upvalue = vm.openUpvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    writeBarrier((Object *)upvalue, upvalue->closed);
     vm.openUpvalues = upvalue->next;
   }
 }
@@ -242,325 +949,1421 @@ static void closeUpvalues(Value *last) {
 static void defineMethod(ObjectString *name) {
   Value method = peek(0);
   ObjectClass *klass = AS_CLASS(peek(1));
-  tableSet(&klass->methods, name, method);
+  classSetMethod(klass, name, method);
+  if (name == vm.initString)
+    klass->initializer = AS_CLOSURE(method);
+  vm.methodEpoch++;
   pop();
 }
 
-static bool isFalsey(Value value) {
+bool isFalsey(Value value) {
   return IS_NAH(value) || (IS_BOOLEAN(value) && !AS_BOOLEAN(value)) ||
          (IS_NUMBER(value) && AS_NUMBER(value) == 0);
 }
 
-static void concatenate() {
-  ObjectString *b = AS_STRING(peek(0));
-  ObjectString *a = AS_STRING(peek(1));
-
+// Both operands have to stay reachable until the result is created. Long
+// results are ropes, so building a string piece by piece copies it once
+// when it is first read instead of on every step. Results aren't hashed or
+// interned, most are only printed or concatenated again.
+ObjectString *concatenate(ObjectString *a, ObjectString *b) {
+  if (a->length == 0)
+    return b;
+  if (b->length == 0)
+    return a;
   int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+  if (length >= ROPE_MIN_LENGTH)
+    return newRope(a, b);
 
-  ObjectString *result = takeString(chars, length);
-  pop();
-  pop();
-  push(CREATE_OBJECT_VALUE(result));
+  // Neither part can be a rope that short
+  ObjectString *result = newRuntimeString(length);
+  memcpy(result->chars, a->chars, a->length);
+  memcpy(result->chars + a->length, b->chars, b->length);
+  return result;
 }
 
 static InterpretResult run() {
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  // Interpreter state lives in locals so the compiler can keep it in
+  // registers. The top of the stack is cached in tos and written through to
+  // the stack, so sp[-1] and tos always agree and the stack itself is never
+  // stale. frame->ip and vm.stackTop are only written back before calls,
+  // returns, allocations (the GC scans the stack) and runtime errors.
+  CallFrame *frame;
+  uint8_t *ip;
+  Value *slots;
+  Value *constants;
+  InlineCache *caches;
+  Value *sp;
+  Value tos;
+  // No globals are added while code runs, so the slots don't move
+  Value *globals = vm.globalValues.values;
+  bool jit = vm.jitEnabled;
+  bool registerBackend = vm.registerBackend;
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->byteChunk.constants.values[READ_BYTE()])
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->closure->function->byteChunk.constants.values;          \
+    caches = frame->closure->function->byteChunk.caches;                       \
+  } while (false)
+#define LOAD_STACK() (sp = vm.stackTop, tos = sp[-1])
+#define LOAD_STATE()                                                           \
+  do {                                                                         \
+    LOAD_FRAME();                                                              \
+    LOAD_STACK();                                                              \
+  } while (false)
+#define SYNC_STACK() (vm.stackTop = sp)
+#define SAVE_STATE() (frame->ip = ip, vm.stackTop = sp)
+
+#define PUSH(value) (tos = (value), *sp++ = tos)
+#define DROP() (sp--, tos = sp[-1])
+#define SET_TOP(value) (tos = (value), sp[-1] = tos)
+#define PEEK(distance) ((distance) == 0 ? tos : sp[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&caches[READ_SHORT()])
+#define GLOBAL_NAME(slot) AS_CSTRING(vm.globalNames.values[slot])
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    SAVE_STATE();                                                              \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+#define COMPARE_JUMP(op, jumpIf)                                               \
+  do {                                                                         \
+    uint16_t offset = READ_SHORT();                                            \
+    if (!IS_NUMBER(tos) || !IS_NUMBER(sp[-2])) {                               \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    double b = AS_NUMBER(tos);                                                 \
+    double a = AS_NUMBER(sp[-2]);                                              \
+    sp -= 2;                                                                   \
+    tos = sp[-1];                                                              \
+    if ((a op b) == jumpIf)                                                    \
+      ip += offset;                                                            \
+  } while (false)
 #define BINARY_OP(valueType, op)                                               \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
+    if (!IS_NUMBER(tos) || !IS_NUMBER(sp[-2])) {                               \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    double b = AS_NUMBER(tos);                                                 \
+    double a = AS_NUMBER(sp[-2]);                                              \
+    sp--;                                                                      \
+    SET_TOP(valueType(a op b));                                                \
+  } while (false)
+  // Rewrites the instruction being executed, whose opcode is length bytes
+  // before ip
+#define QUICKEN(length, instruction) (ip[-(length)] = (instruction))
+#define CALL_VALUE(argCount)                                                   \
+  do {                                                                         \
+    SAVE_STATE();                                                              \
+    if (!callValue(PEEK(argCount), argCount)) {                                \
       return INTERPRET_RUNTIME_ERROR;                                          \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
+    LOAD_STATE();                                                              \
+    SWITCH_BACKEND();                                                          \
+    TRY_JIT();                                                                 \
+  } while (false)
+  // Hands the top frame to compiled code, which runs until it calls a
+  // function or meets an instruction it leaves to the interpreter. Tried
+  // wherever a frame is entered or resumed and on loop back edges.
+#define TRY_JIT()                                                              \
+  do {                                                                         \
+    if (jit) {                                                                 \
+      SAVE_STATE();                                                            \
+      if (!jitRun())                                                           \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+      LOAD_STATE();                                                            \
+      SWITCH_BACKEND();                                                        \
+    }                                                                          \
+  } while (false)
+  // Functions the register backend could not translate stay on stack
+  // bytecode. Register code entered or returned to from here is left to
+  // runRegisters(), which interpret() starts once this loop returns.
+#define SWITCH_BACKEND()                                                       \
+  do {                                                                         \
+    if (registerBackend && frame->closure->function->registerCount > 0) {      \
+      SAVE_STATE();                                                            \
+      return INTERPRET_OK;                                                     \
+    }                                                                          \
   } while (false)
 
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(
-        &frame->closure->function->byteChunk,
-        (int)(frame->ip - frame->closure->function->byteChunk.code));
-#endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
-        push(constant);
-        break;
-      }
-      case OP_NAH:
-        push(CREATE_NAH_VALUE());
-        break;
-      case OP_TRUE:
-        push(CREATE_BOOLEAN_VALUE(true));
-        break;
-      case OP_FALSE:
-        push(CREATE_BOOLEAN_VALUE(false));
-        break;
-      case OP_POP:
-        pop();
-        break;
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
-      }
-      case OP_SET_GLOBAL: {
-        ObjectString *name = READ_STRING();
-        if (tableSet(&vm.globals, name, peek(0))) {
-          tableDelete(&vm.globals, name);
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+#define TRACE_EXECUTION()                                                      \
+  do {                                                                         \
+    printf("          ");                                                      \
+    for (Value *slot = vm.stack; slot < sp; slot++) {                          \
+      printf("[ ");                                                            \
+      printValue(*slot);                                                       \
+      printf(" ]");                                                            \
+    }                                                                          \
+    printf("\n");                                                              \
+    disassembleInstruction(                                                    \
+        &frame->closure->function->byteChunk,                                  \
+        (int)(ip - frame->closure->function->byteChunk.code));                 \
+  } while (false)
+#else
+#define TRACE_EXECUTION()                                                      \
+  do {                                                                         \
+  } while (false)
+#endif /* DEBUG_TRACE_EXECUTION */
+
+#ifdef DEBUG_PROFILE_OPCODES
+  uint8_t previousOpcode = OP_RETURN;
+#define PROFILE_OPCODE()                                                       \
+  do {                                                                         \
+    opcodeCounts[*ip]++;                                                       \
+    opcodePairCounts[previousOpcode][*ip]++;                                   \
+    previousOpcode = *ip;                                                      \
+  } while (false)
+#else
+#define PROFILE_OPCODE()                                                       \
+  do {                                                                         \
+  } while (false)
+#endif /* DEBUG_PROFILE_OPCODES */
+
+#ifdef COMPUTED_GOTO
+  // Direct threading: every handler jumps straight to the next handler
+  // through the label table, so each opcode gets its own indirect branch
+  static void *dispatchTable[] = {
+      [OP_CONSTANT] = &&op_CONSTANT,
+      [OP_NAH] = &&op_NAH,
+      [OP_TRUE] = &&op_TRUE,
+      [OP_FALSE] = &&op_FALSE,
+      [OP_POP] = &&op_POP,
+      [OP_GET_LOCAL] = &&op_GET_LOCAL,
+      [OP_SET_LOCAL] = &&op_SET_LOCAL,
+      [OP_SET_GLOBAL] = &&op_SET_GLOBAL,
+      [OP_GET_GLOBAL] = &&op_GET_GLOBAL,
+      [OP_DEFINE_GLOBAL] = &&op_DEFINE_GLOBAL,
+      [OP_GET_UPVALUE] = &&op_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&op_SET_UPVALUE,
+      [OP_GET_PROPERTY] = &&op_GET_PROPERTY,
+      [OP_SET_PROPERTY] = &&op_SET_PROPERTY,
+      [OP_GET_SUPER] = &&op_GET_SUPER,
+      [OP_EQUAL] = &&op_EQUAL,
+      [OP_GREATER] = &&op_GREATER,
+      [OP_LESS] = &&op_LESS,
+      [OP_ADD] = &&op_ADD,
+      [OP_SUBTRACT] = &&op_SUBTRACT,
+      [OP_MULTIPLY] = &&op_MULTIPLY,
+      [OP_DIVIDE] = &&op_DIVIDE,
+      [OP_NOT] = &&op_NOT,
+      [OP_NEGATE] = &&op_NEGATE,
+      [OP_PRINT] = &&op_PRINT,
+      [OP_JUMP] = &&op_JUMP,
+      [OP_JUMP_IF_FALSE] = &&op_JUMP_IF_FALSE,
+      [OP_LOOP] = &&op_LOOP,
+      [OP_CALL] = &&op_CALL,
+      [OP_INVOKE] = &&op_INVOKE,
+      [OP_SUPER_INVOKE] = &&op_SUPER_INVOKE,
+      [OP_TAIL_CALL] = &&op_TAIL_CALL,
+      [OP_TAIL_INVOKE] = &&op_TAIL_INVOKE,
+      [OP_CLOSURE] = &&op_CLOSURE,
+      [OP_CLOSE_UPVALUE] = &&op_CLOSE_UPVALUE,
+      [OP_RETURN] = &&op_RETURN,
+      [OP_CLASS] = &&op_CLASS,
+      [OP_INHERIT] = &&op_INHERIT,
+      [OP_METHOD] = &&op_METHOD,
+      [OP_GET_INDEX] = &&op_GET_INDEX,
+      [OP_SET_INDEX] = &&op_SET_INDEX,
+      [OP_LIST] = &&op_LIST,
+      [OP_MAP] = &&op_MAP,
+      [OP_JUMP_IF_NOT_LESS] = &&op_JUMP_IF_NOT_LESS,
+      [OP_JUMP_IF_NOT_GREATER] = &&op_JUMP_IF_NOT_GREATER,
+      [OP_JUMP_IF_LESS] = &&op_JUMP_IF_LESS,
+      [OP_JUMP_IF_GREATER] = &&op_JUMP_IF_GREATER,
+      [OP_ADD_LOCAL_CONSTANT] = &&op_ADD_LOCAL_CONSTANT,
+      [OP_SUBTRACT_LOCAL_CONSTANT] = &&op_SUBTRACT_LOCAL_CONSTANT,
+      [OP_ADD_LOCAL_LOCAL] = &&op_ADD_LOCAL_LOCAL,
+      [OP_GET_LOCAL_PROPERTY] = &&op_GET_LOCAL_PROPERTY,
+      [OP_SET_LOCAL_POP] = &&op_SET_LOCAL_POP,
+      [OP_ADD_NUM] = &&op_ADD_NUM,
+      [OP_ADD_STR] = &&op_ADD_STR,
+      [OP_LESS_NUM] = &&op_LESS_NUM,
+      [OP_CALL_CLOSURE] = &&op_CALL_CLOSURE,
+      [OP_CALL_NATIVE] = &&op_CALL_NATIVE,
+  };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) op_##name
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_EXECUTION();                                                         \
+    PROFILE_OPCODE();                                                          \
+    goto *dispatchTable[instruction = READ_BYTE()];                            \
+  } while (false)
+#else
+#define INTERPRET_LOOP                                                         \
+  loop:                                                                        \
+  TRACE_EXECUTION();                                                           \
+  PROFILE_OPCODE();                                                            \
+  switch (instruction = READ_BYTE())
+#define CASE(name) case OP_##name
+#define DISPATCH() goto loop
+#endif /* COMPUTED_GOTO */
+
+  LOAD_STATE();
+
+  uint8_t instruction;
+  INTERPRET_LOOP {
+    CASE(CONSTANT): {
+      PUSH(READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(NAH):
+      PUSH(CREATE_NAH_VALUE());
+      DISPATCH();
+    CASE(TRUE):
+      PUSH(CREATE_BOOLEAN_VALUE(true));
+      DISPATCH();
+    CASE(FALSE):
+      PUSH(CREATE_BOOLEAN_VALUE(false));
+      DISPATCH();
+    CASE(POP):
+      DROP();
+      DISPATCH();
+    CASE(GET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      PUSH(slots[slot]);
+      DISPATCH();
+    }
+    CASE(SET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = tos;
+      DISPATCH();
+    }
+    CASE(SET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(globals[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      case OP_GET_GLOBAL: {
-        ObjectString *name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
-      }
-      case OP_DEFINE_GLOBAL: {
-        ObjectString *name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
-        break;
-      }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        // Push value referenced by the upvalue
-        push(*frame->closure->upvalues[slot]->location);
-        break;
-      }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        // Deference Value slot referenced by the upvalue
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
-      }
-      case OP_GET_PROPERTY: {
-        if (!IS_INSTANCE(peek(0))) {
-          runtimeError("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjectInstance *instance = AS_INSTANCE(peek(0));
-        ObjectString *name = READ_STRING();
-
-        Value value;
-        if (tableGet(&instance->fields, name, &value)) {
-          pop(); // Instance
-          push(value);
-          break;
+      globals[slot] = tos;
+      DISPATCH();
+    }
+    CASE(GET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      Value value = globals[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+      }
+      PUSH(value);
+      DISPATCH();
+    }
+    CASE(DEFINE_GLOBAL): {
+      globals[READ_SHORT()] = tos;
+      DROP();
+      DISPATCH();
+    }
+    CASE(GET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      // Push value referenced by the upvalue
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(SET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      // Deference Value slot referenced by the upvalue
+      ObjectUpvalue *upvalue = frame->closure->upvalues[slot];
+      *upvalue->location = tos;
+      writeBarrier((Object *)upvalue, tos);
+      DISPATCH();
+    }
+    CASE(GET_PROPERTY): {
+    getProperty:
+      if (!IS_INSTANCE(tos)) {
+        RUNTIME_ERROR("Only instances have properties.");
+      }
+      ObjectInstance *instance = AS_INSTANCE(tos);
+      ObjectString *name = READ_STRING();
+      CacheEntry *entry = cachedGet(READ_CACHE(), instance, name);
+      if (entry != NULL) {
+        if (entry->slot != -1) {
+          SET_TOP(instance->fields[entry->slot]); // Replace the instance
+          DISPATCH();
         }
+        SAVE_STATE();
+        ObjectBoundMethod *bound =
+            bindInstanceMethod(instance, AS_CLOSURE(entry->method));
+        SET_TOP(CREATE_OBJECT_VALUE(bound));
+        DISPATCH();
+      }
 
-        if (!bindMethod(instance->klass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      // Dictionary mode, or a property that doesn't exist
+      Value value;
+      if (instanceGetField(instance, name, &value)) {
+        SET_TOP(value);
+        DISPATCH();
       }
-      case OP_SET_PROPERTY: {
-        // Stack: instance -> value
-        // ByteChunk: [Instance -> Value Expression] -> OP_SET_PROPERTY -> field
 
-        if (!IS_INSTANCE(peek(1))) {
-          runtimeError("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      SAVE_STATE();
+      if (!bindMethod(instance->klass, name)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(SET_PROPERTY): {
+      // Stack: instance -> value
+      // ByteChunk: [Instance -> Value Expression] -> OP_SET_PROPERTY -> field
 
-        ObjectInstance *instance = AS_INSTANCE(peek(1));
-        tableSet(&instance->fields, READ_STRING(), peek(0));
-        Value value = pop(); // Value
-        pop();               // Instance
-        push(value);         // Push value as the result of assignment
-        break;
-      }
-      case OP_GET_SUPER: {
-        ObjectString *name = READ_STRING();
-        ObjectClass *superclass = AS_CLASS(pop());
-        if (!bindMethod(superclass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(CREATE_BOOLEAN_VALUE(valuesEqual(a, b)));
-        break;
-      }
-      case OP_GREATER:
-        BINARY_OP(CREATE_BOOLEAN_VALUE, >);
-        break;
-      case OP_LESS:
-        BINARY_OP(CREATE_BOOLEAN_VALUE, <);
-        break;
-      case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(CREATE_NUMBER_VALUE(a + b));
+      if (!IS_INSTANCE(sp[-2])) {
+        RUNTIME_ERROR("Only instances have properties.");
+      }
+
+      ObjectInstance *instance = AS_INSTANCE(sp[-2]);
+      ObjectString *name = READ_STRING();
+      SYNC_STACK();
+      cachedSet(READ_CACHE(), instance, name, tos);
+      Value value = tos;
+      sp--;
+      SET_TOP(value); // Replace the instance with the assigned value
+      DISPATCH();
+    }
+    CASE(GET_SUPER): {
+      ObjectString *name = READ_STRING();
+      ObjectClass *superclass = AS_CLASS(tos);
+      DROP();
+      SAVE_STATE();
+      if (!bindMethod(superclass, name)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(EQUAL): {
+      Value b = tos;
+      Value a = sp[-2];
+      sp--;
+      SET_TOP(CREATE_BOOLEAN_VALUE(valuesEqual(a, b)));
+      DISPATCH();
+    }
+    CASE(GREATER):
+      BINARY_OP(CREATE_BOOLEAN_VALUE, >);
+      DISPATCH();
+    CASE(LESS):
+      if (IS_NUMBER(tos) && IS_NUMBER(sp[-2]))
+        QUICKEN(1, OP_LESS_NUM);
+      BINARY_OP(CREATE_BOOLEAN_VALUE, <);
+      DISPATCH();
+    CASE(ADD): {
+      if (IS_NUMBER(tos) && IS_NUMBER(sp[-2])) {
+        QUICKEN(1, OP_ADD_NUM);
+      } else if (IS_STRING(tos) && IS_STRING(sp[-2])) {
+        QUICKEN(1, OP_ADD_STR);
+      }
+      // Fused additions land here, their operands aren't quickened
+    addValues:
+      if (IS_NUMBER(tos) && IS_NUMBER(sp[-2])) {
+        double b = AS_NUMBER(tos);
+        double a = AS_NUMBER(sp[-2]);
+        sp--;
+        SET_TOP(CREATE_NUMBER_VALUE(a + b));
+      } else if (IS_STRING(tos) && IS_STRING(sp[-2])) {
+        SYNC_STACK();
+        ObjectString *result = concatenate(AS_STRING(sp[-2]), AS_STRING(tos));
+        sp--;
+        SET_TOP(CREATE_OBJECT_VALUE(result));
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      DISPATCH();
+    }
+    CASE(SUBTRACT):
+      BINARY_OP(CREATE_NUMBER_VALUE, -);
+      DISPATCH();
+    CASE(MULTIPLY):
+      BINARY_OP(CREATE_NUMBER_VALUE, *);
+      DISPATCH();
+    CASE(DIVIDE):
+      BINARY_OP(CREATE_NUMBER_VALUE, /);
+      DISPATCH();
+    CASE(NOT):
+      SET_TOP(CREATE_BOOLEAN_VALUE(isFalsey(tos)));
+      DISPATCH();
+    CASE(NEGATE):
+      if (!IS_NUMBER(tos)) {
+        RUNTIME_ERROR("Operand must be a number.");
+      }
+      SET_TOP(CREATE_NUMBER_VALUE(-AS_NUMBER(tos)));
+      DISPATCH();
+    CASE(PRINT):
+      printValue(tos);
+      printf("\n");
+      DROP();
+      DISPATCH();
+    CASE(JUMP): {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(tos))
+        ip += offset;
+      DISPATCH();
+    }
+    CASE(LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      TRY_JIT();
+      DISPATCH();
+    }
+    CASE(CALL): {
+      int argCount = READ_BYTE();
+      Value callee = PEEK(argCount);
+      if (IS_CLOSURE(callee)) {
+        QUICKEN(2, OP_CALL_CLOSURE);
+      } else if (IS_NATIVE_FUNCTION(callee)) {
+        QUICKEN(2, OP_CALL_NATIVE);
+      }
+      // callValue will update the frame array
+      CALL_VALUE(argCount);
+      DISPATCH();
+    }
+    CASE(INVOKE): {
+      ObjectString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      SAVE_STATE();
+      if (!invoke(method, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_STATE();
+      SWITCH_BACKEND();
+      TRY_JIT();
+      DISPATCH();
+    }
+    CASE(SUPER_INVOKE): {
+      ObjectString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjectClass *superclass = AS_CLASS(tos);
+      DROP();
+      SAVE_STATE();
+      if (!invokeFromClass(superclass, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_STATE();
+      SWITCH_BACKEND();
+      TRY_JIT();
+      DISPATCH();
+    }
+    CASE(TAIL_CALL): {
+      int argCount = READ_BYTE();
+      SAVE_STATE();
+      if (!tailCallValue(PEEK(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_STATE();
+      SWITCH_BACKEND();
+      TRY_JIT();
+      DISPATCH();
+    }
+    CASE(TAIL_INVOKE): {
+      ObjectString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      SAVE_STATE();
+      if (!tailInvoke(method, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_STATE();
+      SWITCH_BACKEND();
+      TRY_JIT();
+      DISPATCH();
+    }
+    CASE(CLOSURE): {
+      ObjectFunction *function = AS_FUNCTION(READ_CONSTANT());
+      SAVE_STATE();
+      ObjectClosure *closure = newClosure(function);
+      PUSH(CREATE_OBJECT_VALUE(closure));
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        if (isLocal) {
+          SYNC_STACK();
+          closure->upvalues[i] = captureUpvalue(slots + index);
         } else {
-          runtimeError("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
+          closure->upvalues[i] = frame->closure->upvalues[index];
         }
-        break;
-      }
-      case OP_SUBTRACT:
-        BINARY_OP(CREATE_NUMBER_VALUE, -);
-        break;
-      case OP_MULTIPLY:
-        BINARY_OP(CREATE_NUMBER_VALUE, *);
-        break;
-      case OP_DIVIDE:
-        BINARY_OP(CREATE_NUMBER_VALUE, /);
-        break;
-      case OP_NOT:
-        push(CREATE_BOOLEAN_VALUE(isFalsey(pop())));
-        break;
-      case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(CREATE_NUMBER_VALUE(-AS_NUMBER(pop())));
-        break;
-      case OP_PRINT:
-        printValue(pop());
-        printf("\n");
-        break;
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
-      }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0)))
-          frame->ip += offset;
-        break;
-      }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
-      }
-      case OP_CALL: {
-        int argCount = READ_BYTE();
-        // callValue will update the frame array
-        if (!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        // Capturing may have allocated, and collected the closure into the
+        // old generation
+        writeBarrier((Object *)closure,
+                     CREATE_OBJECT_VALUE(closure->upvalues[i]));
       }
-      case OP_INVOKE: {
-        ObjectString *method = READ_STRING();
-        int argCount = READ_BYTE();
-        if (!invoke(method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
-      case OP_SUPER_INVOKE: {
-        ObjectString *method = READ_STRING();
-        int argCount = READ_BYTE();
-        ObjectClass *superclass = AS_CLASS(pop());
-        if (!invokeFromClass(superclass, method, argCount)) {
+      DISPATCH();
+    }
+    CASE(CLOSE_UPVALUE): {
+      closeUpvalues(sp - 1);
+      DROP();
+      DISPATCH();
+    }
+    CASE(RETURN): {
+      Value result = tos;
+      closeUpvalues(slots);
+      vm.frameCount--;
+      if (vm.frameCount == 0) {
+        // Pop the script closure as well
+        vm.stackTop = slots;
+        return INTERPRET_OK;
+      }
+
+      sp = slots;
+      PUSH(result);
+      LOAD_FRAME();
+      SWITCH_BACKEND();
+      TRY_JIT();
+      DISPATCH();
+    }
+    CASE(CLASS): {
+      SYNC_STACK();
+      PUSH(CREATE_OBJECT_VALUE(newClass(READ_STRING())));
+      DISPATCH();
+    }
+    CASE(INHERIT): {
+      Value superclass = sp[-2];
+      if (!IS_CLASS(superclass)) {
+        RUNTIME_ERROR("Superclass must be a class.");
+      }
+      ObjectClass *subclass = AS_CLASS(tos);
+      SYNC_STACK();
+      classInherit(subclass, AS_CLASS(superclass));
+      vm.methodEpoch++;
+      DROP(); // subclass;
+      DISPATCH();
+    }
+    CASE(METHOD): {
+      SYNC_STACK();
+      defineMethod(READ_STRING());
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(GET_INDEX): {
+      Value element;
+      SAVE_STATE();
+      if (!getIndex(sp[-2], tos, &element)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DROP();
+      SET_TOP(element);
+      DISPATCH();
+    }
+    CASE(SET_INDEX): {
+      SAVE_STATE();
+      if (!setIndex(sp[-3], sp[-2], tos)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      Value value = tos;
+      sp -= 2;
+      SET_TOP(value); // Replace the array with the assigned value
+      DISPATCH();
+    }
+    CASE(LIST): {
+      int count = READ_BYTE();
+      SYNC_STACK(); // The elements stay reachable while the list is allocated
+      ObjectList *list = newList(count);
+      for (int i = 0; i < count; i++) {
+        list->items.values[i] = sp[i - count];
+      }
+      list->items.count = count;
+      sp -= count;
+      PUSH(CREATE_OBJECT_VALUE(list));
+      DISPATCH();
+    }
+    CASE(MAP): {
+      int count = READ_BYTE();
+      SAVE_STATE();
+      ObjectMap *map = newMap(count);
+      for (Value *pair = sp - 2 * count; pair < sp; pair += 2) {
+        if (!mapKey(pair[0]))
           return INTERPRET_RUNTIME_ERROR;
+        mapSet(&map->table, pair[0], pair[1]);
+      }
+      sp -= 2 * count;
+      PUSH(CREATE_OBJECT_VALUE(map));
+      DISPATCH();
+    }
+    CASE(JUMP_IF_NOT_LESS):
+      COMPARE_JUMP(<, false);
+      DISPATCH();
+    CASE(JUMP_IF_NOT_GREATER):
+      COMPARE_JUMP(>, false);
+      DISPATCH();
+    CASE(JUMP_IF_LESS):
+      COMPARE_JUMP(<, true);
+      DISPATCH();
+    CASE(JUMP_IF_GREATER):
+      COMPARE_JUMP(>, true);
+      DISPATCH();
+    CASE(ADD_LOCAL_CONSTANT): {
+      Value a = slots[READ_BYTE()];
+      Value b = READ_CONSTANT();
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        PUSH(CREATE_NUMBER_VALUE(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+      }
+      PUSH(a);
+      PUSH(b);
+      goto addValues;
+    }
+    CASE(SUBTRACT_LOCAL_CONSTANT): {
+      Value a = slots[READ_BYTE()];
+      Value b = READ_CONSTANT();
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      PUSH(CREATE_NUMBER_VALUE(AS_NUMBER(a) - AS_NUMBER(b)));
+      DISPATCH();
+    }
+    CASE(ADD_LOCAL_LOCAL): {
+      Value a = slots[READ_BYTE()];
+      Value b = slots[READ_BYTE()];
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        PUSH(CREATE_NUMBER_VALUE(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+      }
+      PUSH(a);
+      PUSH(b);
+      goto addValues;
+    }
+    CASE(GET_LOCAL_PROPERTY): {
+      PUSH(slots[READ_BYTE()]);
+      goto getProperty;
+    }
+    CASE(SET_LOCAL_POP): {
+      slots[READ_BYTE()] = tos;
+      DROP();
+      DISPATCH();
+    }
+    CASE(ADD_NUM): {
+      if (!IS_NUMBER(tos) || !IS_NUMBER(sp[-2])) {
+        QUICKEN(1, OP_ADD);
+        goto addValues;
+      }
+      double b = AS_NUMBER(tos);
+      double a = AS_NUMBER(sp[-2]);
+      sp--;
+      SET_TOP(CREATE_NUMBER_VALUE(a + b));
+      DISPATCH();
+    }
+    CASE(ADD_STR): {
+      if (!IS_STRING(tos) || !IS_STRING(sp[-2])) {
+        QUICKEN(1, OP_ADD);
+        goto addValues;
+      }
+      SYNC_STACK();
+      ObjectString *result = concatenate(AS_STRING(sp[-2]), AS_STRING(tos));
+      sp--;
+      SET_TOP(CREATE_OBJECT_VALUE(result));
+      DISPATCH();
+    }
+    CASE(LESS_NUM): {
+      if (!IS_NUMBER(tos) || !IS_NUMBER(sp[-2]))
+        QUICKEN(1, OP_LESS);
+      BINARY_OP(CREATE_BOOLEAN_VALUE, <);
+      DISPATCH();
+    }
+    CASE(CALL_CLOSURE): {
+      int argCount = READ_BYTE();
+      Value callee = PEEK(argCount);
+      if (!IS_CLOSURE(callee)) {
+        QUICKEN(2, OP_CALL);
+        CALL_VALUE(argCount);
+        DISPATCH();
+      }
+      SAVE_STATE();
+      if (!call(AS_CLOSURE(callee), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      // The arguments stay on the stack as the callee's slots
+      LOAD_FRAME();
+      SWITCH_BACKEND();
+      TRY_JIT();
+      DISPATCH();
+    }
+    CASE(CALL_NATIVE): {
+      int argCount = READ_BYTE();
+      Value callee = PEEK(argCount);
+      if (!IS_NATIVE_FUNCTION(callee)) {
+        QUICKEN(2, OP_CALL);
+        CALL_VALUE(argCount);
+        DISPATCH();
+      }
+      SAVE_STATE();
+      if (!callNative(AS_NATIVE_FUNCTION(callee), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_STACK();
+      DISPATCH();
+    }
+  }
+
+  // Only reachable from the switch fallback with an unknown opcode
+  RUNTIME_ERROR("Unknown opcode %d.", instruction);
+#undef LOAD_FRAME
+#undef LOAD_STACK
+#undef LOAD_STATE
+#undef SYNC_STACK
+#undef SAVE_STATE
+#undef PUSH
+#undef DROP
+#undef SET_TOP
+#undef PEEK
+#undef READ_BYTE
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_STRING
+#undef READ_CACHE
+#undef GLOBAL_NAME
+#undef RUNTIME_ERROR
+#undef COMPARE_JUMP
+#undef BINARY_OP
+#undef QUICKEN
+#undef CALL_VALUE
+#undef TRY_JIT
+#undef SWITCH_BACKEND
+#undef TRACE_EXECUTION
+#undef PROFILE_OPCODE
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+
+static InterpretResult runRegisters() {
+  // Register code reads and writes frame slots directly, so the frame is the
+  // only interpreter state. vm.stackTop always marks the end of the current
+  // frame's registers, which keeps all of them visible to the GC.
+  CallFrame *frame;
+  uint8_t *ip;
+  Value *slots;
+  Value *constants;
+  InlineCache *caches;
+  Value *globals = vm.globalValues.values;
+
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->closure->function->byteChunk.constants.values;          \
+    caches = frame->closure->function->byteChunk.caches;                       \
+  } while (false)
+#define FRAME_TOP() (slots + frame->closure->function->registerCount)
+  // Registers past the arguments may still hold values of an older frame
+#define ENTER_FRAME()                                                          \
+  do {                                                                         \
+    LOAD_FRAME();                                                              \
+    SWITCH_BACKEND();                                                          \
+    for (Value *slot = slots + frame->closure->function->arity + 1;            \
+         slot < FRAME_TOP(); slot++) {                                         \
+      *slot = CREATE_NAH_VALUE();                                              \
+    }                                                                          \
+    vm.stackTop = FRAME_TOP();                                                 \
+  } while (false)
+  // Stack bytecode entered or returned to from here is left to run(), with
+  // vm.stackTop just past the arguments or the result as run() expects
+#define SWITCH_BACKEND()                                                       \
+  do {                                                                         \
+    if (frame->closure->function->registerCount == 0)                          \
+      return INTERPRET_OK;                                                     \
+  } while (false)
+  // Registers above a finished call were clobbered by the callee, or were
+  // not scanned by the GC while the callee ran, so they can't be kept
+#define CLEAR_ABOVE(slot)                                                      \
+  do {                                                                         \
+    for (Value *dead = (slot) + 1; dead < vm.stackTop; dead++) {               \
+      *dead = CREATE_NAH_VALUE();                                              \
+    }                                                                          \
+  } while (false)
+  // The callee sees R[base] .. R[base + argCount] as its stack. Natives and
+  // classes without an initializer leave their result in R[base] instead of
+  // pushing a frame.
+#define FINISH_CALL(frameCount, base)                                          \
+  do {                                                                         \
+    if (vm.frameCount > (frameCount)) {                                        \
+      ENTER_FRAME();                                                           \
+    } else {                                                                   \
+      vm.stackTop = FRAME_TOP();                                               \
+      CLEAR_ABOVE(slots + (base));                                             \
+    }                                                                          \
+  } while (false)
+  // A tail call that took over the frame starts it over with the callee
+#define FINISH_TAIL_CALL(frameCount, base)                                     \
+  do {                                                                         \
+    if (frame->ip != ip) {                                                     \
+      ENTER_FRAME();                                                           \
+    } else {                                                                   \
+      FINISH_CALL(frameCount, base);                                           \
+    }                                                                          \
+  } while (false)
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&caches[READ_SHORT()])
+#define GLOBAL_NAME(slot) AS_CSTRING(vm.globalNames.values[slot])
+#define RK(operand)                                                            \
+  (IS_RK_CONSTANT(operand) ? constants[RK_INDEX(operand)] : slots[operand])
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    frame->ip = ip;                                                            \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+#define BINARY_OP(valueType, op)                                               \
+  do {                                                                         \
+    uint8_t dst = READ_BYTE();                                                 \
+    uint8_t left = READ_BYTE();                                                \
+    uint8_t right = READ_BYTE();                                               \
+    Value a = RK(left);                                                        \
+    Value b = RK(right);                                                       \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                      \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    slots[dst] = valueType(AS_NUMBER(a) op AS_NUMBER(b));                      \
+  } while (false)
+#define COMPARE_JUMP(op, jumpIf)                                               \
+  do {                                                                         \
+    uint8_t left = READ_BYTE();                                                \
+    uint8_t right = READ_BYTE();                                               \
+    uint16_t offset = READ_SHORT();                                            \
+    Value a = RK(left);                                                        \
+    Value b = RK(right);                                                       \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                      \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    if ((AS_NUMBER(a) op AS_NUMBER(b)) == jumpIf)                              \
+      ip += offset;                                                            \
+  } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION()                                                      \
+  do {                                                                         \
+    printf("          ");                                                      \
+    for (Value *slot = slots; slot < vm.stackTop; slot++) {                    \
+      printf("[ ");                                                            \
+      printValue(*slot);                                                       \
+      printf(" ]");                                                            \
+    }                                                                          \
+    printf("\n");                                                              \
+    disassembleInstruction(                                                    \
+        &frame->closure->function->byteChunk,                                  \
+        (int)(ip - frame->closure->function->byteChunk.code));                 \
+  } while (false)
+#else
+#define TRACE_EXECUTION()                                                      \
+  do {                                                                         \
+  } while (false)
+#endif /* DEBUG_TRACE_EXECUTION */
+
+#ifdef DEBUG_PROFILE_OPCODES
+  uint8_t previousOpcode = OP_R_RETURN;
+#define PROFILE_OPCODE()                                                       \
+  do {                                                                         \
+    opcodeCounts[*ip]++;                                                       \
+    opcodePairCounts[previousOpcode][*ip]++;                                   \
+    previousOpcode = *ip;                                                      \
+  } while (false)
+#else
+#define PROFILE_OPCODE()                                                       \
+  do {                                                                         \
+  } while (false)
+#endif /* DEBUG_PROFILE_OPCODES */
+
+#ifdef COMPUTED_GOTO
+  static void *dispatchTable[] = {
+      [OP_R_MOVE] = &&op_R_MOVE,
+      [OP_R_LOAD_CONSTANT] = &&op_R_LOAD_CONSTANT,
+      [OP_R_LOAD_NAH] = &&op_R_LOAD_NAH,
+      [OP_R_LOAD_TRUE] = &&op_R_LOAD_TRUE,
+      [OP_R_LOAD_FALSE] = &&op_R_LOAD_FALSE,
+      [OP_R_GET_GLOBAL] = &&op_R_GET_GLOBAL,
+      [OP_R_SET_GLOBAL] = &&op_R_SET_GLOBAL,
+      [OP_R_DEFINE_GLOBAL] = &&op_R_DEFINE_GLOBAL,
+      [OP_R_GET_UPVALUE] = &&op_R_GET_UPVALUE,
+      [OP_R_SET_UPVALUE] = &&op_R_SET_UPVALUE,
+      [OP_R_GET_PROPERTY] = &&op_R_GET_PROPERTY,
+      [OP_R_SET_PROPERTY] = &&op_R_SET_PROPERTY,
+      [OP_R_GET_SUPER] = &&op_R_GET_SUPER,
+      [OP_R_EQUAL] = &&op_R_EQUAL,
+      [OP_R_GREATER] = &&op_R_GREATER,
+      [OP_R_LESS] = &&op_R_LESS,
+      [OP_R_ADD] = &&op_R_ADD,
+      [OP_R_SUBTRACT] = &&op_R_SUBTRACT,
+      [OP_R_MULTIPLY] = &&op_R_MULTIPLY,
+      [OP_R_DIVIDE] = &&op_R_DIVIDE,
+      [OP_R_NOT] = &&op_R_NOT,
+      [OP_R_NEGATE] = &&op_R_NEGATE,
+      [OP_R_PRINT] = &&op_R_PRINT,
+      [OP_R_JUMP] = &&op_R_JUMP,
+      [OP_R_JUMP_IF_FALSE] = &&op_R_JUMP_IF_FALSE,
+      [OP_R_LOOP] = &&op_R_LOOP,
+      [OP_R_JUMP_IF_NOT_LESS] = &&op_R_JUMP_IF_NOT_LESS,
+      [OP_R_JUMP_IF_NOT_GREATER] = &&op_R_JUMP_IF_NOT_GREATER,
+      [OP_R_JUMP_IF_LESS] = &&op_R_JUMP_IF_LESS,
+      [OP_R_JUMP_IF_GREATER] = &&op_R_JUMP_IF_GREATER,
+      [OP_R_CALL] = &&op_R_CALL,
+      [OP_R_INVOKE] = &&op_R_INVOKE,
+      [OP_R_SUPER_INVOKE] = &&op_R_SUPER_INVOKE,
+      [OP_R_TAIL_CALL] = &&op_R_TAIL_CALL,
+      [OP_R_TAIL_INVOKE] = &&op_R_TAIL_INVOKE,
+      [OP_R_CLOSURE] = &&op_R_CLOSURE,
+      [OP_R_CLOSE_UPVALUE] = &&op_R_CLOSE_UPVALUE,
+      [OP_R_RETURN] = &&op_R_RETURN,
+      [OP_R_CLASS] = &&op_R_CLASS,
+      [OP_R_INHERIT] = &&op_R_INHERIT,
+      [OP_R_METHOD] = &&op_R_METHOD,
+      [OP_R_GET_INDEX] = &&op_R_GET_INDEX,
+      [OP_R_SET_INDEX] = &&op_R_SET_INDEX,
+      [OP_R_LIST] = &&op_R_LIST,
+      [OP_R_MAP] = &&op_R_MAP,
+  };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) op_##name
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_EXECUTION();                                                         \
+    PROFILE_OPCODE();                                                          \
+    goto *dispatchTable[instruction = READ_BYTE()];                            \
+  } while (false)
+#else
+#define INTERPRET_LOOP                                                         \
+  loop:                                                                        \
+  TRACE_EXECUTION();                                                           \
+  PROFILE_OPCODE();                                                            \
+  switch (instruction = READ_BYTE())
+#define CASE(name) case OP_##name
+#define DISPATCH() goto loop
+#endif /* COMPUTED_GOTO */
+
+  LOAD_FRAME();
+  if (ip == frame->closure->function->byteChunk.code) {
+    ENTER_FRAME();
+  } else {
+    // Resumed after a call into stack bytecode, which left its result on top
+    Value *callee = vm.stackTop - 1;
+    vm.stackTop = FRAME_TOP();
+    CLEAR_ABOVE(callee);
+  }
+
+  uint8_t instruction;
+  INTERPRET_LOOP {
+    CASE(R_MOVE): {
+      uint8_t dst = READ_BYTE();
+      slots[dst] = slots[READ_BYTE()];
+      DISPATCH();
+    }
+    CASE(R_LOAD_CONSTANT): {
+      uint8_t dst = READ_BYTE();
+      slots[dst] = READ_CONSTANT();
+      DISPATCH();
+    }
+    CASE(R_LOAD_NAH):
+      slots[READ_BYTE()] = CREATE_NAH_VALUE();
+      DISPATCH();
+    CASE(R_LOAD_TRUE):
+      slots[READ_BYTE()] = CREATE_BOOLEAN_VALUE(true);
+      DISPATCH();
+    CASE(R_LOAD_FALSE):
+      slots[READ_BYTE()] = CREATE_BOOLEAN_VALUE(false);
+      DISPATCH();
+    CASE(R_GET_GLOBAL): {
+      uint8_t dst = READ_BYTE();
+      uint16_t slot = READ_SHORT();
+      Value value = globals[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+      }
+      slots[dst] = value;
+      DISPATCH();
+    }
+    CASE(R_SET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      uint8_t operand = READ_BYTE();
+      if (IS_UNDEFINED(globals[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+      }
+      globals[slot] = RK(operand);
+      DISPATCH();
+    }
+    CASE(R_DEFINE_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      uint8_t operand = READ_BYTE();
+      globals[slot] = RK(operand);
+      DISPATCH();
+    }
+    CASE(R_GET_UPVALUE): {
+      uint8_t dst = READ_BYTE();
+      slots[dst] = *frame->closure->upvalues[READ_BYTE()]->location;
+      DISPATCH();
+    }
+    CASE(R_SET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      uint8_t operand = READ_BYTE();
+      ObjectUpvalue *upvalue = frame->closure->upvalues[slot];
+      *upvalue->location = RK(operand);
+      writeBarrier((Object *)upvalue, *upvalue->location);
+      DISPATCH();
+    }
+    CASE(R_GET_PROPERTY): {
+      uint8_t dst = READ_BYTE();
+      Value object = slots[READ_BYTE()];
+      ObjectString *name = READ_STRING();
+      if (!IS_INSTANCE(object)) {
+        RUNTIME_ERROR("Only instances have properties.");
+      }
+      ObjectInstance *instance = AS_INSTANCE(object);
+      CacheEntry *entry = cachedGet(READ_CACHE(), instance, name);
+      if (entry != NULL) {
+        if (entry->slot != -1) {
+          slots[dst] = instance->fields[entry->slot];
+        } else {
+          slots[dst] = CREATE_OBJECT_VALUE(
+              bindInstanceMethod(instance, AS_CLOSURE(entry->method)));
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
-      case OP_CLOSURE: {
-        ObjectFunction *function = AS_FUNCTION(READ_CONSTANT());
-        ObjectClosure *closure = newClosure(function);
-        push(CREATE_OBJECT_VALUE(closure));
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
-        }
-        break;
-      }
-      case OP_CLOSE_UPVALUE: {
-        closeUpvalues(vm.stackTop - 1);
-        pop();
-        break;
-      }
-      case OP_RETURN: {
-        Value result = pop();
-        closeUpvalues(frame->slots);
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          pop();
-          return INTERPRET_OK;
+        DISPATCH();
+      }
+
+      // Dictionary mode, or a property that doesn't exist
+      Value value;
+      if (instanceGetField(instance, name, &value)) {
+        slots[dst] = value;
+        DISPATCH();
+      }
+      if (!classGetMethod(instance->klass, name, &value)) {
+        RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+      }
+      // The receiver stays in its register while the bound method is created
+      slots[dst] =
+          CREATE_OBJECT_VALUE(bindInstanceMethod(instance, AS_CLOSURE(value)));
+      DISPATCH();
+    }
+    CASE(R_SET_PROPERTY): {
+      Value object = slots[READ_BYTE()];
+      ObjectString *name = READ_STRING();
+      uint8_t operand = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      if (!IS_INSTANCE(object)) {
+        RUNTIME_ERROR("Only instances have properties.");
+      }
+      cachedSet(cache, AS_INSTANCE(object), name, RK(operand));
+      DISPATCH();
+    }
+    CASE(R_GET_SUPER): {
+      uint8_t dst = READ_BYTE();
+      Value receiver = slots[READ_BYTE()];
+      ObjectClass *superclass = AS_CLASS(slots[READ_BYTE()]);
+      ObjectString *name = READ_STRING();
+      Value method;
+      if (!classGetMethod(superclass, name, &method)) {
+        RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+      }
+      slots[dst] = CREATE_OBJECT_VALUE(
+          bindInstanceMethod(AS_INSTANCE(receiver), AS_CLOSURE(method)));
+      DISPATCH();
+    }
+    CASE(R_EQUAL): {
+      uint8_t dst = READ_BYTE();
+      uint8_t left = READ_BYTE();
+      uint8_t right = READ_BYTE();
+      slots[dst] = CREATE_BOOLEAN_VALUE(valuesEqual(RK(left), RK(right)));
+      DISPATCH();
+    }
+    CASE(R_GREATER):
+      BINARY_OP(CREATE_BOOLEAN_VALUE, >);
+      DISPATCH();
+    CASE(R_LESS):
+      BINARY_OP(CREATE_BOOLEAN_VALUE, <);
+      DISPATCH();
+    CASE(R_ADD): {
+      uint8_t dst = READ_BYTE();
+      uint8_t left = READ_BYTE();
+      uint8_t right = READ_BYTE();
+      Value a = RK(left);
+      Value b = RK(right);
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        slots[dst] = CREATE_NUMBER_VALUE(AS_NUMBER(a) + AS_NUMBER(b));
+      } else if (IS_STRING(a) && IS_STRING(b)) {
+        slots[dst] =
+            CREATE_OBJECT_VALUE(concatenate(AS_STRING(a), AS_STRING(b)));
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      DISPATCH();
+    }
+    CASE(R_SUBTRACT):
+      BINARY_OP(CREATE_NUMBER_VALUE, -);
+      DISPATCH();
+    CASE(R_MULTIPLY):
+      BINARY_OP(CREATE_NUMBER_VALUE, *);
+      DISPATCH();
+    CASE(R_DIVIDE):
+      BINARY_OP(CREATE_NUMBER_VALUE, /);
+      DISPATCH();
+    CASE(R_NOT): {
+      uint8_t dst = READ_BYTE();
+      slots[dst] = CREATE_BOOLEAN_VALUE(isFalsey(slots[READ_BYTE()]));
+      DISPATCH();
+    }
+    CASE(R_NEGATE): {
+      uint8_t dst = READ_BYTE();
+      Value value = slots[READ_BYTE()];
+      if (!IS_NUMBER(value)) {
+        RUNTIME_ERROR("Operand must be a number.");
+      }
+      slots[dst] = CREATE_NUMBER_VALUE(-AS_NUMBER(value));
+      DISPATCH();
+    }
+    CASE(R_PRINT): {
+      uint8_t operand = READ_BYTE();
+      printValue(RK(operand));
+      printf("\n");
+      DISPATCH();
+    }
+    CASE(R_JUMP): {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(R_JUMP_IF_FALSE): {
+      Value condition = slots[READ_BYTE()];
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(condition))
+        ip += offset;
+      DISPATCH();
+    }
+    CASE(R_LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      DISPATCH();
+    }
+    CASE(R_JUMP_IF_NOT_LESS):
+      COMPARE_JUMP(<, false);
+      DISPATCH();
+    CASE(R_JUMP_IF_NOT_GREATER):
+      COMPARE_JUMP(>, false);
+      DISPATCH();
+    CASE(R_JUMP_IF_LESS):
+      COMPARE_JUMP(<, true);
+      DISPATCH();
+    CASE(R_JUMP_IF_GREATER):
+      COMPARE_JUMP(>, true);
+      DISPATCH();
+    CASE(R_CALL): {
+      uint8_t base = READ_BYTE();
+      int argCount = READ_BYTE();
+      int frameCount = vm.frameCount;
+      frame->ip = ip;
+      vm.stackTop = slots + base + argCount + 1;
+      if (!callValue(slots[base], argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      FINISH_CALL(frameCount, base);
+      DISPATCH();
+    }
+    CASE(R_INVOKE): {
+      uint8_t base = READ_BYTE();
+      ObjectString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      int frameCount = vm.frameCount;
+      frame->ip = ip;
+      vm.stackTop = slots + base + argCount + 1;
+      if (!invoke(method, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      FINISH_CALL(frameCount, base);
+      DISPATCH();
+    }
+    CASE(R_SUPER_INVOKE): {
+      uint8_t base = READ_BYTE();
+      ObjectString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjectClass *superclass = AS_CLASS(slots[READ_BYTE()]);
+      int frameCount = vm.frameCount;
+      frame->ip = ip;
+      vm.stackTop = slots + base + argCount + 1;
+      if (!invokeFromClass(superclass, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      FINISH_CALL(frameCount, base);
+      DISPATCH();
+    }
+    CASE(R_TAIL_CALL): {
+      uint8_t base = READ_BYTE();
+      int argCount = READ_BYTE();
+      int frameCount = vm.frameCount;
+      frame->ip = ip;
+      vm.stackTop = slots + base + argCount + 1;
+      if (!tailCallValue(slots[base], argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      FINISH_TAIL_CALL(frameCount, base);
+      DISPATCH();
+    }
+    CASE(R_TAIL_INVOKE): {
+      uint8_t base = READ_BYTE();
+      ObjectString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      int frameCount = vm.frameCount;
+      frame->ip = ip;
+      vm.stackTop = slots + base + argCount + 1;
+      if (!tailInvoke(method, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      FINISH_TAIL_CALL(frameCount, base);
+      DISPATCH();
+    }
+    CASE(R_CLOSURE): {
+      uint8_t dst = READ_BYTE();
+      ObjectFunction *function = AS_FUNCTION(READ_CONSTANT());
+      ObjectClosure *closure = newClosure(function);
+      slots[dst] = CREATE_OBJECT_VALUE(closure);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        if (isLocal) {
+          closure->upvalues[i] = captureUpvalue(slots + index);
+        } else {
+          closure->upvalues[i] = frame->closure->upvalues[index];
         }
+        // Capturing may have allocated, and collected the closure into the
+        // old generation
+        writeBarrier((Object *)closure,
+                     CREATE_OBJECT_VALUE(closure->upvalues[i]));
+      }
+      DISPATCH();
+    }
+    CASE(R_CLOSE_UPVALUE):
+      closeUpvalues(slots + READ_BYTE());
+      DISPATCH();
+    CASE(R_RETURN): {
+      uint8_t operand = READ_BYTE();
+      Value result = RK(operand);
+      closeUpvalues(slots);
+      vm.frameCount--;
+      if (vm.frameCount == 0) {
+        // Pop the script closure as well
+        vm.stackTop = slots;
+        return INTERPRET_OK;
+      }
 
-        vm.stackTop = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      // The result replaces the callee in the caller's register
+      Value *callee = slots;
+      *callee = result;
+      LOAD_FRAME();
+      if (frame->closure->function->registerCount == 0) {
+        vm.stackTop = callee + 1;
         return INTERPRET_OK;
       }
-      case OP_CLASS: {
-        push(CREATE_OBJECT_VALUE(newClass(READ_STRING())));
-        break;
+      vm.stackTop = FRAME_TOP();
+      CLEAR_ABOVE(callee);
+      DISPATCH();
+    }
+    CASE(R_CLASS): {
+      uint8_t dst = READ_BYTE();
+      slots[dst] = CREATE_OBJECT_VALUE(newClass(READ_STRING()));
+      DISPATCH();
+    }
+    CASE(R_INHERIT): {
+      Value superclass = slots[READ_BYTE()];
+      ObjectClass *subclass = AS_CLASS(slots[READ_BYTE()]);
+      if (!IS_CLASS(superclass)) {
+        RUNTIME_ERROR("Superclass must be a class.");
+      }
+      classInherit(subclass, AS_CLASS(superclass));
+      vm.methodEpoch++;
+      DISPATCH();
+    }
+    CASE(R_METHOD): {
+      ObjectClass *klass = AS_CLASS(slots[READ_BYTE()]);
+      ObjectString *name = READ_STRING();
+      Value method = slots[READ_BYTE()];
+      classSetMethod(klass, name, method);
+      if (name == vm.initString)
+        klass->initializer = AS_CLOSURE(method);
+      vm.methodEpoch++;
+      DISPATCH();
+    }
+    CASE(R_GET_INDEX): {
+      uint8_t dst = READ_BYTE();
+      Value array = slots[READ_BYTE()];
+      uint8_t index = READ_BYTE();
+      frame->ip = ip;
+      if (!getIndex(array, RK(index), &slots[dst])) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_INHERIT: {
-        Value superclass = peek(1);
-        if (!IS_CLASS(superclass)) {
-          runtimeError("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjectClass *subclass = AS_CLASS(peek(0));
-        tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-        pop(); // subclass;
-        break;
+      DISPATCH();
+    }
+    CASE(R_SET_INDEX): {
+      Value array = slots[READ_BYTE()];
+      uint8_t index = READ_BYTE();
+      uint8_t value = READ_BYTE();
+      frame->ip = ip;
+      if (!setIndex(array, RK(index), RK(value))) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_METHOD: {
-        defineMethod(READ_STRING());
-        break;
+      DISPATCH();
+    }
+    CASE(R_LIST): {
+      uint8_t dst = READ_BYTE();
+      int count = READ_BYTE();
+      ObjectList *list = newList(count);
+      for (int i = 0; i < count; i++) {
+        list->items.values[i] = slots[dst + i];
       }
+      list->items.count = count;
+      slots[dst] = CREATE_OBJECT_VALUE(list);
+      DISPATCH();
+    }
+    CASE(R_MAP): {
+      uint8_t dst = READ_BYTE();
+      int count = READ_BYTE();
+      frame->ip = ip;
+      ObjectMap *map = newMap(count);
+      for (Value *pair = slots + dst; pair < slots + dst + 2 * count;
+           pair += 2) {
+        if (!mapKey(pair[0]))
+          return INTERPRET_RUNTIME_ERROR;
+        mapSet(&map->table, pair[0], pair[1]);
+      }
+      slots[dst] = CREATE_OBJECT_VALUE(map);
+      DISPATCH();
     }
   }
+
+  // Only reachable from the switch fallback with an unknown opcode
+  RUNTIME_ERROR("Unknown opcode %d.", instruction);
+#undef LOAD_FRAME
+#undef FRAME_TOP
+#undef ENTER_FRAME
+#undef SWITCH_BACKEND
+#undef CLEAR_ABOVE
+#undef FINISH_CALL
+#undef FINISH_TAIL_CALL
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
+#undef READ_STRING
+#undef READ_CACHE
+#undef GLOBAL_NAME
+#undef RK
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef COMPARE_JUMP
+#undef TRACE_EXECUTION
+#undef PROFILE_OPCODE
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
 InterpretResult interpret(const char *source) {
@@ -569,11 +2372,25 @@ InterpretResult interpret(const char *source) {
   if (function == NULL)
     return INTERPRET_COMPILE_ERROR;
 
+  // Pushes are not checked against the end of the stack. One that runs into
+  // the guard page after it comes back here instead.
+  if (sigsetjmp(overflowJump, 1)) {
+    runtimeError("Stack Overflow.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+
   push(CREATE_OBJECT_VALUE(function));
   ObjectClosure *closure = newClosure(function);
   pop();
   push(CREATE_OBJECT_VALUE(closure));
   call(closure, 0);
 
-  return run();
+  // The loops hand over to each other by returning with frames left
+  InterpretResult result;
+  do {
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    result = frame->closure->function->registerCount > 0 ? runRegisters()
+                                                         : run();
+  } while (result == INTERPRET_OK && vm.frameCount > 0);
+  return result;
 }
@@ -4,10 +4,12 @@
 #include "bytechunk.h"
 #include "common.h"
 #include "object.h"
+#include "stringset.h"
 #include "table.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX 256
+// Default limits, both can be changed per run from the command line
+#define FRAMES_MAX 65536
+#define STACK_MAX (1024 * 1024)
 
 typedef struct {
   ObjectClosure *closure;
@@ -15,27 +17,52 @@ typedef struct {
   Value *slots;
 } CallFrame;
 
-typedef struct {
+// Where the running full collection is, see memory.h
+typedef enum {
+  GC_IDLE,
+  GC_MARK,
+  GC_SWEEP,
+} GcPhase;
+
+typedef struct VirtualMachine {
   // Frames
-  CallFrame frames[FRAMES_MAX];
+  CallFrame *frames;
   int frameCount;
+  int frameMax;
 
   // ByteChunk
   ByteChunk *byteChunk;
   uint8_t *ip;
 
-  // Stack
-  Value stack[STACK_MAX];
+  // Stack. Both it and the frames are reserved for their whole limit up
+  // front and committed by the OS as recursion reaches them, so they never
+  // move. The stack ends in a guard page, see interpret(), so its limit is
+  // rounded up to a whole page of values.
+  Value *stack;
   Value *stackTop;
+  Value *stackEnd;
+
+  // Globals are resolved to slots at compile time. A slot stays undefined
+  // until its global is defined.
+  Table globalSlots;       // Name -> slot index
+  ValueArray globalNames;  // Slot index -> name, for error messages
+  ValueArray globalValues;
+  // Method names are given selectors at compile time, which index the
+  // method arrays of classes at runtime
+  ValueArray selectorNames; // Selector -> name, keeps selectors stable
 
-  // Global values, strings
-  Table globals;
-  Table strings;
+  // Strings
+  StringSet strings; // Interned strings, held weakly
   ObjectString *initString;
 
   // Upvalues
   ObjectUpvalue *openUpvalues;
   Object *objects;
+  Object *oldObjects; // The objects from here on survived a collection
+  // Old objects that may refer to young ones, see memory.h
+  int rememberedCount;
+  int rememberedCapacity;
+  Object **remembered;
 
   // Tricolor Abstraction
   //  + White: Object not referenced
@@ -45,9 +72,32 @@ typedef struct {
   int grayCapacity;
   Object **grayStack;
 
+  // Bumped whenever a method table changes, see inlinecache.h
+  uint32_t methodEpoch;
+
+  // Run translated register code instead of stack bytecode
+  bool registerBackend;
+  // Compile hot stack bytecode to native code, see jit.h
+  bool jitEnabled;
+
   // States to keep track of allocated memory size
   size_t bytesAllocated;
   size_t gcThreshold; // Garbage Collection Threshold
+  size_t nurseryBytes; // Allocated since the last collection
+  size_t nurserySize;  // Allocation that triggers a minor collection
+  GcPhase gcPhase;
+  bool sweepFlag; // Flipped when marking ends, see memory.h
+  int gcSliceWork; // Work units per slice of a full collection, 0 for none
+
+  // Collector statistics, printed by --gc-stats
+  uint64_t minorCollections;
+  uint64_t majorCollections;
+  uint64_t gcSlices;
+  uint64_t gcPauses;
+  double gcPauseTotal; // Seconds
+  double gcPauseMax;
+  // Reads of a method that reused the receiver's last bound method
+  uint64_t boundMethodsReused;
 } VirtualMachine;
 
 typedef enum {
@@ -58,11 +108,32 @@ typedef enum {
 
 extern VirtualMachine vm;
 
-void initVirtualMachine();
+void initVirtualMachine(int frameMax, int stackMax);
 void freeVirtualMachine();
 
 InterpretResult interpret(const char *source);
+// Reports an error with a stack trace and unwinds the stack
+void runtimeError(const char *format, ...);
+int globalSlot(ObjectString *name);
+int methodSelector(ObjectString *name);
 void push(Value value);
 Value pop();
 
+// Runtime entry points for JIT-compiled code, which keeps vm.stackTop and
+// frame->ip up to date before calling them
+bool callValue(Value callee, int argCount);
+bool invoke(ObjectString *name, int argCount, InlineCache *cache);
+// Calls in tail position. Closures and bound methods take over the current
+// frame, anything else is called like callValue() and invoke() would.
+bool tailCallValue(Value callee, int argCount);
+bool tailInvoke(ObjectString *name, int argCount, InlineCache *cache);
+bool isFalsey(Value value);
+void closeUpvalues(Value *last);
+ObjectString *concatenate(ObjectString *a, ObjectString *b);
+// Property accesses on the top of the stack without the error cases. They
+// return false without changing anything when the interpreter should run
+// the instruction instead.
+bool tryGetProperty(ObjectString *name, InlineCache *cache);
+bool trySetProperty(ObjectString *name, InlineCache *cache);
+
 #endif /* MEKVM_VM_H */
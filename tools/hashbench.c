@@ -0,0 +1,169 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+
+// Measures the string hash against the FNV-1a it replaced: throughput, and
+// the worst linear probe when keys are picked to collide under FNV-1a.
+//   make bench-hash
+//   ./hashbench.out [--hash-seed=N] [flood.meks]
+// With a path it also writes the colliding keys as a map benchmark.
+
+#define KEY_COUNT 12000
+#define KEY_LENGTH 7
+#define SLOT_COUNT (1 << 14)
+#define FLOOD_HASH 0x1234
+#define KEYS_PER_FUNCTION 60 // Stays under the 256 constants of one chunk
+
+typedef uint32_t (*HashFn)(const char *key, int length);
+
+static uint32_t fnv1a(const char *key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void throughput(const char *name, HashFn hash, int length) {
+  static char buffer[1024];
+  for (int i = 0; i < length; i++)
+    buffer[i] = 'a' + i % 26;
+
+  long iterations = (256L << 20) / length;
+  volatile uint32_t sink = 0;
+  double best = 1e9;
+  for (int round = 0; round < 5; round++) {
+    double start = now();
+    for (long i = 0; i < iterations; i++) {
+      buffer[0] = (char)i;
+      sink += hash(buffer, length);
+    }
+    double elapsed = now() - start;
+    if (elapsed < best)
+      best = elapsed;
+  }
+  printf("  %-7s %5d bytes: %7.1f ns\n", name, length,
+         best / iterations * 1e9);
+}
+
+static int worstProbe(HashFn hash, char keys[][KEY_LENGTH + 1]) {
+  static bool used[SLOT_COUNT];
+  memset(used, 0, sizeof(used));
+
+  int worst = 0;
+  for (int k = 0; k < KEY_COUNT; k++) {
+    uint32_t index = hash(keys[k], KEY_LENGTH) & (SLOT_COUNT - 1);
+    int probe = 1;
+    while (used[index]) {
+      index = (index + 1) & (SLOT_COUNT - 1);
+      probe++;
+    }
+    used[index] = true;
+    if (probe > worst)
+      worst = probe;
+  }
+  return worst;
+}
+
+// Lowercase keys whose FNV-1a hashes agree on the low 16 bits
+static void floodKeys(char keys[][KEY_LENGTH + 1]) {
+  int found = 0;
+  for (uint64_t candidate = 0; found < KEY_COUNT; candidate++) {
+    uint64_t digits = candidate;
+    char key[KEY_LENGTH + 1] = {0};
+    for (int i = 0; i < KEY_LENGTH; i++) {
+      key[i] = 'a' + digits % 26;
+      digits /= 26;
+    }
+    if ((fnv1a(key, KEY_LENGTH) & 0xffff) == FLOOD_HASH)
+      memcpy(keys[found++], key, sizeof(key));
+  }
+}
+
+// Xorshift, seeded like the string hash so runs repeat
+static void randomKeys(char keys[][KEY_LENGTH + 1], uint64_t seed) {
+  uint64_t state = seed | 1;
+  for (int k = 0; k < KEY_COUNT; k++) {
+    for (int i = 0; i < KEY_LENGTH; i++) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      keys[k][i] = 'a' + state % 26;
+    }
+    keys[k][KEY_LENGTH] = '\0';
+  }
+}
+
+static void writeFlood(const char *path, char keys[][KEY_LENGTH + 1]) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+
+  fprintf(file, "var m = {};\n");
+  for (int k = 0; k < KEY_COUNT; k += KEYS_PER_FUNCTION) {
+    fprintf(file, "fun f%d() {\n", k);
+    for (int i = k; i < k + KEYS_PER_FUNCTION && i < KEY_COUNT; i++)
+      fprintf(file, "  m[\"%s\"] = 1;\n", keys[i]);
+    fprintf(file, "}\nf%d();\n", k);
+  }
+  fprintf(file, "print len(m);\n");
+  fclose(file);
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: hashbench [--hash-seed=N] [flood.meks]\n");
+  exit(64);
+}
+
+int main(int argc, const char *argv[]) {
+  uint64_t seed = 0;
+  const char *floodPath = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--hash-seed=", 12) == 0) {
+      char *end;
+      seed = strtoull(argv[i] + 12, &end, 10);
+      if (*end != '\0' || end == argv[i] + 12)
+        usage();
+    } else if (argv[i][0] != '-' && floodPath == NULL) {
+      floodPath = argv[i];
+    } else {
+      usage();
+    }
+  }
+  seedStringHash(seed);
+
+  printf("Hashing time:\n");
+  int lengths[] = {8, 16, 64, 1024};
+  for (int i = 0; i < 4; i++) {
+    throughput("FNV-1a", fnv1a, lengths[i]);
+    throughput("keyed", hashString, lengths[i]);
+  }
+
+  static char flood[KEY_COUNT][KEY_LENGTH + 1];
+  static char randomSet[KEY_COUNT][KEY_LENGTH + 1];
+  floodKeys(flood);
+  randomKeys(randomSet, seed);
+
+  printf("Worst probe, %d keys in %d slots:\n", KEY_COUNT, SLOT_COUNT);
+  printf("  FNV-1a collisions: FNV-1a %5d, keyed %5d\n",
+         worstProbe(fnv1a, flood), worstProbe(hashString, flood));
+  printf("  random keys:       FNV-1a %5d, keyed %5d\n",
+         worstProbe(fnv1a, randomSet), worstProbe(hashString, randomSet));
+
+  if (floodPath != NULL)
+    writeFlood(floodPath, flood);
+  return 0;
+}